@@ -0,0 +1,107 @@
+#pragma once
+
+/**
+  * CPU pinning of worker threads, and the NUMA nodes of the CPUs.
+  *
+  * Memory is not bound explicitly: Linux places a page on the node of the
+  * CPU that first writes it, so a thread pinned before it allocates its
+  * buffers gets them on its own node. Only those per thread buffers are
+  * local, the shared cache is not placed per node.
+  **/
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+namespace dns {
+
+struct Affinity {
+
+    // "0-3,8,10-11" into the list of CPUs, empty if malformed.
+    static std::vector<int> parseCpus(const std::string& list) {
+
+        std::vector<int> cpus;
+        std::istringstream ss(list);
+        std::string item;
+
+        while (getline(ss, item, ',')) {
+            if (item.empty())
+                continue;
+            char* end;
+            long first = strtol(item.c_str(), &end, 10);
+            long last = first;
+            if (*end == '-')
+                last = strtol(end + 1, &end, 10);
+            if (*end || first < 0 || last < first || last >= CPU_SETSIZE)
+                return std::vector<int>();
+            for (long cpu = first; cpu <= last; cpu++)
+                cpus.push_back(cpu);
+        }
+
+        return cpus;
+
+    }
+
+    // NUMA nodes that have CPUs, each with its CPUs.
+    static std::vector<std::vector<int>> nodes() {
+
+        std::vector<std::vector<int>> nodes;
+        DIR* dir = opendir("/sys/devices/system/node");
+
+        if (dir) {
+            while (dirent* entry = readdir(dir)) {
+                int node;
+                char tail;
+                if (sscanf(entry->d_name, "node%d%c", &node, &tail) != 1)
+                    continue;
+                std::string path = "/sys/devices/system/node/" + std::string(entry->d_name) + "/cpulist";
+                FILE* file = fopen(path.c_str(), "r");
+                char line[4096] = "";
+                if (file) {
+                    if (!fgets(line, sizeof(line), file))
+                        line[0] = 0;
+                    fclose(file);
+                }
+                std::string list(line);
+                while (!list.empty() && (list.back() == '\n' || list.back() == ' '))
+                    list.pop_back();
+                std::vector<int> cpus = parseCpus(list);
+                if (cpus.empty())
+                    continue;
+                if ((size_t) node >= nodes.size())
+                    nodes.resize(node + 1);
+                nodes[node] = cpus;
+            }
+            closedir(dir);
+        }
+
+        // No NUMA information: one node with every CPU.
+        if (nodes.empty()) {
+            nodes.push_back(std::vector<int>());
+            cpu_set_t set;
+            if (sched_getaffinity(0, sizeof(set), &set) == 0)
+                for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                    if (CPU_ISSET(cpu, &set))
+                        nodes[0].push_back(cpu);
+        }
+
+        return nodes;
+
+    }
+
+    // Pins the calling thread to cpu.
+    static bool pin(int cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+
+};
+
+};
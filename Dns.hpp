@@ -1,3 +1,5 @@
+#pragma once
+
 #include <cstdint>
 #include <vector>
 #include <cstring>
@@ -5,14 +7,31 @@
 #include <sstream>
 #include <string>
 #include <map>
+#include <set>
+#include <random>
 #include <algorithm>
 #include <fstream>
-#include <stack>
+#include <stdexcept>
 #include <ctime>
+#include <optional>
+#include <functional>
+#include <array>
+#include <memory>
+#include <utility>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <unistd.h>
+
+#include "Rcu.hpp"
+#include "Names.hpp"
+#include "DomainTrie.hpp"
+#include "Forwarding.hpp"
+#include "Trace.hpp"
 
-#define BUF_SIZE 256
+#define BUF_SIZE 512
+// Largest UDP reply to a client that offers more with EDNS (RFC 6891),
+// the size no path fragments at.
+#define EDNS_UDP_SIZE 1232
 
 void print_hex(std::vector <uint8_t> out) {
 
@@ -25,6 +44,133 @@ void print_hex(std::vector <uint8_t> out) {
 
 namespace dns {
 
+#define MAX_NAME 255
+
+// Thrown when a package does not follow RFC 1035 wire format.
+struct FormatError: public std::runtime_error {
+    FormatError(const std::string& what): std::runtime_error(what) {}
+};
+
+// Appends domain in wire format. Names are expected to be valid already,
+// over long labels are cut at 63 bytes.
+static void encodeDomain(std::vector<uint8_t>& out, const std::string& domain) {
+
+    size_t begin = 0;
+    while (begin < domain.size()) {
+        size_t dot = domain.find('.', begin);
+        if (dot == std::string::npos)
+            dot = domain.size();
+        size_t len = std::min(dot - begin, (size_t) 63);
+        if (len) {
+            out.push_back(len);
+            out.insert(out.end(), domain.begin() + begin, domain.begin() + begin + len);
+        }
+        begin = dot + 1;
+    }
+    out.push_back(0);
+
+}
+
+// Bounds checked cursor over a package in wire format, every read throws
+// FormatError rather than going past end.
+struct WireReader {
+
+    const uint8_t* start;
+    const uint8_t* end;
+    const uint8_t* buffer;
+
+    WireReader(const uint8_t* start, const uint8_t* end):
+        start(start), end(end), buffer(start) {}
+
+    void need(size_t n) {
+        if ((size_t) (end - buffer) < n)
+            throw FormatError("truncated package");
+    }
+
+    uint8_t get8bits() {
+        need(1);
+        uint8_t value;
+        memcpy(&value, buffer, 1);
+        buffer += 1;
+        return value;
+    }
+
+    uint16_t get16bits() {
+        need(2);
+        uint16_t value;
+        memcpy(&value, buffer, 2);
+        buffer += 2;
+        return ntohs(value);
+    }
+
+    uint32_t get32bits() {
+        need(4);
+        uint32_t value;
+        memcpy(&value, buffer, 4);
+        buffer += 4;
+        return ntohl(value);
+    }
+
+    // Compression pointers may only point backwards, before the label that
+    // holds them, so a name is decoded in at most one pass over the package.
+    std::string decodeDomain() {
+
+        std::string name;
+        const uint8_t* cursor = buffer;
+        const uint8_t* limit = buffer;
+        const uint8_t* resume = NULL;
+
+        while (true) {
+
+            if (cursor >= end)
+                throw FormatError("truncated name");
+
+            uint8_t len = *cursor;
+
+            if ((len >> 6) == 0x03) {
+
+                if (cursor + 1 >= end)
+                    throw FormatError("truncated name pointer");
+                const uint8_t* target = start + (((len & 0x3F) << 8) | cursor[1]);
+                if (target >= limit)
+                    throw FormatError("forward name pointer");
+                if (!resume)
+                    resume = cursor + 2;
+                cursor = limit = target;
+
+            } else if (len >> 6) {
+
+                throw FormatError("bad label type");
+
+            } else if (len == 0) {
+
+                cursor++;
+                break;
+
+            } else {
+
+                if (cursor + 1 + len > end)
+                    throw FormatError("truncated label");
+                if (name.size() + len + 1 > MAX_NAME)
+                    throw FormatError("name too long");
+                if (memchr(cursor + 1, '.', len))
+                    throw FormatError("dot inside label");
+                if (!name.empty())
+                    name += '.';
+                name.append((const char*) cursor + 1, len);
+                cursor += 1 + len;
+
+            }
+
+        }
+
+        buffer = resume ? resume : cursor;
+        return name;
+
+    }
+
+};
+
 struct Question {
 
     std::string qName;
@@ -63,8 +209,13 @@ struct Answer {
     virtual std::string rDataToStr(){
         return std::string("default");
     };
-    virtual void putRData (uint8_t** out) = 0;
+    // Name the record points to for CNAME, PTR and NS, NULL otherwise.
+    virtual const std::string* target(){
+        return NULL;
+    }
+    virtual void putRData (std::vector<uint8_t>& out) = 0;
     virtual Answer * copy() = 0;
+    virtual ~Answer() {}
 };
 
 struct A_Answer: public Answer {
@@ -75,7 +226,7 @@ struct A_Answer: public Answer {
         Answer(aName, aType, aClass, aTTL) {}
 
     Answer * copy(){
-        Answer * answer = new A_Answer(aName, aType, aClass, aType);
+        Answer * answer = new A_Answer(aName, aType, aClass, aTTL);
         answer->setRData(addr[0],addr[1],addr[2],addr[3]);
         return answer;
     }
@@ -96,20 +247,19 @@ struct A_Answer: public Answer {
         return ip.str();
     }
 
-    void putRData (uint8_t** out){
-
-        uint16_t value = 4;
-        value = htons(value);
-        memcpy(*out, &value, 2);
-        *out += 2;
+    void putRData (std::vector<uint8_t>& out){
+        out.insert(out.end(), addr, addr + 4);
+    }
 
-        memcpy(*out, &addr[0], 1); *out += 1;
-        memcpy(*out, &addr[1], 1); *out += 1;
-        memcpy(*out, &addr[2], 1); *out += 1;
-        memcpy(*out, &addr[3], 1); *out += 1;
+    void getRData (WireReader& in, uint16_t length){
+        if (length != 4)
+            throw FormatError("bad A record");
+        for (int i = 0; i < 4; i++)
+            addr[i] = in.get8bits();
     }
 };
 
+// Any record whose RDATA is a single domain name: CNAME, PTR and NS.
 struct CNAME_Answer: public Answer {
 
     std::string domain;
@@ -118,7 +268,7 @@ struct CNAME_Answer: public Answer {
         Answer(aName, aType, aClass, aTTL) {}
 
     Answer * copy(){
-        Answer * answer = new A_Answer(aName, aType, aClass, aType);
+        Answer * answer = new CNAME_Answer(aName, aType, aClass, aTTL);
         answer->setRData(domain);
         return answer;
     }
@@ -131,112 +281,910 @@ struct CNAME_Answer: public Answer {
         return domain;
     }
 
-    void putRData (uint8_t** out){
+    const std::string* target(){
+        return &domain;
+    }
+
+    void putRData (std::vector<uint8_t>& out){
+        encodeDomain(out, domain);
+    }
+
+    void getRData (WireReader& in, uint16_t length){
+        domain = in.decodeDomain();
+    }
+
+};
+
+typedef CNAME_Answer PTR_Answer;
+typedef CNAME_Answer NS_Answer;
+
+struct AAAA_Answer: public Answer {
+
+    uint8_t addr[16];
+
+    AAAA_Answer(std::string aName, uint16_t aType, uint16_t aClass, uint32_t aTTL):
+        Answer(aName, aType, aClass, aTTL) {}
+
+    Answer * copy(){
+        AAAA_Answer * answer = new AAAA_Answer(aName, aType, aClass, aTTL);
+        answer->setRData(addr);
+        return answer;
+    }
+
+    void setRData(const uint8_t* addr){
+        memcpy(this->addr, addr, 16);
+    }
+
+    std::string rDataToStr(){
+        char ip[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, addr, ip, sizeof(ip));
+        return ip;
+    }
+
+    void putRData (std::vector<uint8_t>& out){
+        out.insert(out.end(), addr, addr + 16);
+    }
+
+    void getRData (WireReader& in, uint16_t length){
+        if (length != 16)
+            throw FormatError("bad AAAA record");
+        in.need(16);
+        setRData(in.buffer);
+        in.buffer += 16;
+    }
+};
+
+struct MX_Answer: public Answer {
+
+    uint16_t preference;
+    std::string exchange;
+
+    MX_Answer(std::string aName, uint16_t aType, uint16_t aClass, uint32_t aTTL):
+        Answer(aName, aType, aClass, aTTL) {}
+
+    Answer * copy(){
+        MX_Answer * answer = new MX_Answer(aName, aType, aClass, aTTL);
+        answer->preference = preference;
+        answer->exchange = exchange;
+        return answer;
+    }
+
+    std::string rDataToStr(){
+        return std::to_string(preference) + " " + exchange;
+    }
+
+    void putRData (std::vector<uint8_t>& out){
+        out.push_back(preference >> 8);
+        out.push_back(preference);
+        encodeDomain(out, exchange);
+    }
+
+    void getRData (WireReader& in, uint16_t length){
+        preference = in.get16bits();
+        exchange = in.decodeDomain();
+    }
+};
+
+struct TXT_Answer: public Answer {
+
+    std::vector<std::string> strings;
+
+    TXT_Answer(std::string aName, uint16_t aType, uint16_t aClass, uint32_t aTTL):
+        Answer(aName, aType, aClass, aTTL) {}
+
+    Answer * copy(){
+        TXT_Answer * answer = new TXT_Answer(aName, aType, aClass, aTTL);
+        answer->strings = strings;
+        return answer;
+    }
+
+    std::string rDataToStr(){
+        std::string res;
+        for (std::string& str : strings)
+            res += (res.empty() ? "\"" : " \"") + str + "\"";
+        return res;
+    }
+
+    void putRData (std::vector<uint8_t>& out){
+        for (std::string& str : strings){
+            size_t len = std::min(str.size(), (size_t) 255);
+            out.push_back(len);
+            out.insert(out.end(), str.begin(), str.begin() + len);
+        }
+    }
+
+    void getRData (WireReader& in, uint16_t length){
+        in.need(length);
+        const uint8_t* rend = in.buffer + length;
+        while (in.buffer < rend){
+            uint8_t len = *in.buffer++;
+            if (in.buffer + len > rend)
+                throw FormatError("bad TXT record");
+            strings.push_back(std::string((const char*) in.buffer, len));
+            in.buffer += len;
+        }
+    }
+};
+
+struct SRV_Answer: public Answer {
+
+    uint16_t priority;
+    uint16_t weight;
+    uint16_t port;
+    std::string target;
+
+    SRV_Answer(std::string aName, uint16_t aType, uint16_t aClass, uint32_t aTTL):
+        Answer(aName, aType, aClass, aTTL) {}
+
+    Answer * copy(){
+        SRV_Answer * answer = new SRV_Answer(aName, aType, aClass, aTTL);
+        answer->priority = priority;
+        answer->weight = weight;
+        answer->port = port;
+        answer->target = target;
+        return answer;
+    }
+
+    std::string rDataToStr(){
+        return std::to_string(priority) + " " + std::to_string(weight) + " " +
+            std::to_string(port) + " " + target;
+    }
+
+    void putRData (std::vector<uint8_t>& out){
+        for (uint16_t value : { priority, weight, port }){
+            out.push_back(value >> 8);
+            out.push_back(value);
+        }
+        encodeDomain(out, target);
+    }
+
+    void getRData (WireReader& in, uint16_t length){
+        priority = in.get16bits();
+        weight = in.get16bits();
+        port = in.get16bits();
+        target = in.decodeDomain();
+    }
+};
+
+struct SOA_Answer: public Answer {
+
+    std::string mname;
+    std::string rname;
+    uint32_t serial;
+    uint32_t refresh;
+    uint32_t retry;
+    uint32_t expire;
+    uint32_t minimum;
+
+    SOA_Answer(std::string aName, uint16_t aType, uint16_t aClass, uint32_t aTTL):
+        Answer(aName, aType, aClass, aTTL) {}
+
+    Answer * copy(){
+        return new SOA_Answer(*this);
+    }
+
+    std::string rDataToStr(){
+        return mname + " " + rname + " " + std::to_string(serial) + " " +
+            std::to_string(refresh) + " " + std::to_string(retry) + " " +
+            std::to_string(expire) + " " + std::to_string(minimum);
+    }
+
+    void putRData (std::vector<uint8_t>& out){
+        encodeDomain(out, mname);
+        encodeDomain(out, rname);
+        for (uint32_t value : { serial, refresh, retry, expire, minimum }){
+            out.push_back(value >> 24);
+            out.push_back(value >> 16);
+            out.push_back(value >> 8);
+            out.push_back(value);
+        }
+    }
+
+    void getRData (WireReader& in, uint16_t length){
+        mname = in.decodeDomain();
+        rname = in.decodeDomain();
+        serial = in.get32bits();
+        refresh = in.get32bits();
+        retry = in.get32bits();
+        expire = in.get32bits();
+        minimum = in.get32bits();
+    }
+};
+
+// Record types
+
+struct Types {
+    enum {
+        A_Type = 1,
+        NS_Type = 2,
+        CNAME_Type = 5,
+        SOA_Type = 6,
+        PTR_Type = 12,
+        MX_Type = 15,
+        TXT_Type = 16,
+        AAAA_Type = 28,
+        SRV_Type = 33,
+        OPT_Type = 41       // EDNS pseudo record, never cached
+    };
+};
+
+// What the server knows about each record type, resolved at compile time.
+// Supporting a new type takes one specialization: its name, the Answer
+// class that parses and writes its RDATA, and whether it is cached.
+template <uint16_t Type>
+struct Record {
+    static constexpr bool known = false;
+};
+
+#define RECORD(TYPE, ANSWER, CACHEABLE) \
+    template <> struct Record<Types::TYPE##_Type> { \
+        typedef ANSWER Class; \
+        static constexpr bool known = true; \
+        static constexpr const char* name = #TYPE; \
+        static constexpr bool cacheable = CACHEABLE; \
+    };
+
+RECORD(A, A_Answer, true)
+RECORD(NS, NS_Answer, true)
+RECORD(CNAME, CNAME_Answer, true)
+RECORD(SOA, SOA_Answer, true)
+RECORD(PTR, PTR_Answer, true)
+RECORD(MX, MX_Answer, true)
+RECORD(TXT, TXT_Answer, true)
+RECORD(AAAA, AAAA_Answer, true)
+RECORD(SRV, SRV_Answer, true)
+
+#undef RECORD
+
+typedef Answer* (*RecordReader)(const std::string& name, uint16_t klass, uint32_t ttl,
+    WireReader& in, uint16_t length);
+
+struct RecordInfo {
+    const char* name;
+    RecordReader read;      // NULL for types that are skipped
+    bool cacheable;
+};
+
+template <uint16_t Type>
+Answer* readRecord(const std::string& name, uint16_t klass, uint32_t ttl,
+    WireReader& in, uint16_t length) {
+    std::unique_ptr<typename Record<Type>::Class> answer(
+        new typename Record<Type>::Class(name, Type, klass, ttl));
+    answer->getRData(in, length);
+    return answer.release();
+}
+
+template <uint16_t Type>
+constexpr RecordInfo recordEntry() {
+    if constexpr (Record<Type>::known)
+        return { Record<Type>::name, &readRecord<Type>, Record<Type>::cacheable };
+    else
+        return { "Unknown", NULL, false };
+}
+
+template <size_t... Type>
+constexpr std::array<RecordInfo, sizeof...(Type)> recordTable(std::index_sequence<Type...>) {
+    return {{ recordEntry<Type>()... }};
+}
+
+// Every known type is below 256, the rest share the entry of type 0.
+inline constexpr std::array<RecordInfo, 256> RECORDS = recordTable(std::make_index_sequence<256>());
+
+constexpr const RecordInfo& recordInfo(uint16_t type) {
+    return RECORDS[type < RECORDS.size() ? type : 0];
+}
+
+// Storage for the RRsets a Cache would keep in its own tables, a segment
+// shared with other processes for instance. Answers given to put() stay
+// owned by the caller, the ones get() appends belong to it, with their
+// TTL counting down.
+struct CacheStore {
+    virtual bool get(const Question& question, time_t now, std::vector<Answer*>& answers) = 0;
+    virtual void put(const Question& question, const std::vector<Answer*>& answers, time_t expires) = 0;
+    // Every element not expired at now.
+    virtual void forEach(time_t now,
+        const std::function<void(const Question&, const std::vector<Answer*>&, time_t)>& f) = 0;
+    virtual void expire(time_t now) = 0;
+    virtual ~CacheStore() {}
+};
+
+// Decides which fetched RRsets a Cache takes in, from how often their
+// question is looked up. Both get the hash the cache files it under.
+struct Admission {
+    virtual void record(size_t hash) = 0;
+    virtual bool admit(size_t hash) = 0;
+    virtual ~Admission() {}
+};
+
+class Cache {
+
+    // Cached RRset in one block, immutable once published: the interned
+    // name and, right after the header, size bytes of records as
+    //
+    //   owner, 0 for name or 1 and an interned Label*
+    //   type, class, TTL and RDATA length, host order
+    //   RDATA as Answer::putRData() writes it
+    //
+    // Readers reach it without locks, so it is only freed through the
+    // epoch reclamation, which gives the names back.
+    struct Element {
+
+        const Label* name;
+        size_t hash;
+        time_t expires;
+        uint16_t type;
+        uint16_t klass;
+        uint32_t size;
+
+        const uint8_t* records() const {
+            return (const uint8_t*) (this + 1);
+        }
+
+        // Answers stay owned by the caller.
+        static Element* make(const Question& question, size_t hash, const std::vector<Answer*>& answers, time_t expires) {
+
+            Names& names = Names::instance();
+            std::vector<uint8_t> records;
+
+            for (Answer* a : answers) {
+                if (!recordInfo(a->aType).read)
+                    continue;
+                if (a->aName == question.qName) {
+                    records.push_back(0);
+                } else {
+                    const Label* owner = names.intern(a->aName);
+                    records.push_back(1);
+                    records.insert(records.end(), (const uint8_t*) &owner, (const uint8_t*) (&owner + 1));
+                }
+                size_t header = records.size();
+                records.resize(header + 10);
+                a->putRData(records);
+                uint16_t length = records.size() - header - 10;
+                memcpy(&records[header], &a->aType, 2);
+                memcpy(&records[header + 2], &a->aClass, 2);
+                memcpy(&records[header + 4], &a->aTTL, 4);
+                memcpy(&records[header + 8], &length, 2);
+            }
+
+            Element* e = new (::operator new(sizeof(Element) + records.size())) Element{
+                names.intern(question.qName), hash, expires, question.qType, question.qClass, (uint32_t) records.size() };
+            memcpy((uint8_t*) e->records(), records.data(), records.size());
+            return e;
+
+        }
+
+        static void operator delete(void* p) {
+            ::operator delete(p);
+        }
+
+        ~Element() {
+            Names& names = Names::instance();
+            for (const uint8_t* p = records(); p < records() + size; ) {
+                if (*p++) {
+                    const Label* owner;
+                    memcpy(&owner, p, sizeof(owner));
+                    names.release(owner);
+                    p += sizeof(owner);
+                }
+                uint16_t length;
+                memcpy(&length, p + 8, 2);
+                p += 10 + length;
+            }
+            names.release(name);
+        }
+
+        bool matches(size_t h, const Question& question) const {
+            return hash == h && type == question.qType && klass == question.qClass &&
+                Names::equals(name, question.qName);
+        }
+
+        Question question() const {
+            return Question(Names::str(name), type, klass);
+        }
+
+        // Fresh copies of the records. With now their TTL is what is left
+        // of them, else the one they were cached with.
+        std::vector<Answer*> answers(time_t now) const {
+
+            std::vector<Answer*> out;
+            std::string owner = Names::str(name);
+
+            for (const uint8_t* p = records(); p < records() + size; ) {
+                std::string other;
+                const std::string* aName = &owner;
+                if (*p++) {
+                    const Label* label;
+                    memcpy(&label, p, sizeof(label));
+                    other = Names::str(label);
+                    aName = &other;
+                    p += sizeof(label);
+                }
+                uint16_t rtype, rclass, length;
+                uint32_t ttl;
+                memcpy(&rtype, p, 2);
+                memcpy(&rclass, p + 2, 2);
+                memcpy(&ttl, p + 4, 4);
+                memcpy(&length, p + 8, 2);
+                p += 10;
+                if (now && expires)
+                    ttl = expires - now;
+                WireReader in(p, p + length);
+                try {
+                    out.push_back(recordInfo(rtype).read(*aName, rclass, ttl, in, length));
+                } catch (FormatError& e) {
+                    // RDATA putRData() wrote and the reader refuses, dropped.
+                }
+                p += length;
+            }
+            return out;
+
+        }
+
+    };
+
+    // Open addressing, linear probing. Slots only go from empty to used,
+    // removed elements leave a tombstone until the next rehash.
+    struct Table {
+        size_t mask;
+        size_t used;
+        std::atomic<Element*>* slots;
+
+        Table(size_t size): mask(size - 1), used(0), slots(new std::atomic<Element*>[size]) {
+            for (size_t i = 0; i < size; i++)
+                slots[i].store(nullptr, std::memory_order_relaxed);
+        }
+
+        ~Table() {
+            delete[] slots;
+        }
+    };
+
+    // Readers never take the writer lock. Inserts, replacements, expiry
+    // and rehashing of one shard are serialized by it.
+    struct alignas(64) Shard {
+        std::mutex writer;
+        std::atomic<Table*> table;
+        size_t live;
+    };
+
+    // Lookup counters, one line per shard so that readers of different
+    // shards do not write to the same one.
+    struct alignas(64) Counters {
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> misses;
+    };
+
+    static constexpr size_t SHARDS = 64;
+    static constexpr size_t MIN_SLOTS = 16;
+
+    Shard shards[SHARDS];
+    Counters counters[SHARDS];
+    Epoch& epoch;
+    CacheStore* store;
+    Admission* admission;
+    time_t (*clock)(time_t*);
+
+    static Element* tombstone() {
+        static char t;
+        return reinterpret_cast<Element*>(&t);
+    }
+
+    static size_t hash(const Question& q) {
+        size_t h = std::hash<std::string>()(q.qName);
+        return h ^ (((size_t) q.qType << 16 | q.qClass) * 0x9E3779B97F4A7C15ULL);
+    }
+
+    Shard& shardOf(size_t h) {
+        return shards[(h >> 58) % SHARDS];
+    }
+
+    // Called with the shard writer held.
+    void rehash(Shard& shard, size_t size) {
+
+        Table* old = shard.table.load(std::memory_order_relaxed);
+        Table* table = new Table(size);
+
+        for (size_t i = 0; i <= old->mask; i++) {
+            Element* e = old->slots[i].load(std::memory_order_relaxed);
+            if (e == nullptr || e == tombstone())
+                continue;
+            size_t j = e->hash & table->mask;
+            while (table->slots[j].load(std::memory_order_relaxed))
+                j = (j + 1) & table->mask;
+            table->slots[j].store(e, std::memory_order_relaxed);
+            table->used++;
+        }
+
+        shard.table.store(table, std::memory_order_release);
+        epoch.retire([old]() { delete old; });
+
+    }
+
+    void insert(Question question, std::vector<Answer*> answers, time_t expires) {
+
+        // Hosts entries never expire and stay in the tables of the process.
+        if (store && expires) {
+            store->put(question, answers, expires);
+            for (Answer* a : answers)
+                delete a;
+            return;
+        }
+
+        size_t h = hash(question);
+        Shard& shard = shardOf(h);
+        Element* element = Element::make(question, h, answers, expires);
+        for (Answer* a : answers)
+            delete a;
+
+        std::lock_guard<std::mutex> guard(shard.writer);
+
+        Table* table = shard.table.load(std::memory_order_relaxed);
+        if ((table->used + 1) * 4 > (table->mask + 1) * 3) {
+            rehash(shard, std::max(MIN_SLOTS, (table->mask + 1) * (shard.live * 2 > table->mask ? 2 : 1)));
+            table = shard.table.load(std::memory_order_relaxed);
+        }
+
+        size_t i = h & table->mask;
+        std::atomic<Element*>* free = nullptr;
+        while (true) {
+            Element* e = table->slots[i].load(std::memory_order_relaxed);
+            if (e == nullptr)
+                break;
+            if (e == tombstone()) {
+                if (!free)
+                    free = &table->slots[i];
+            } else if (e->matches(h, question)) {
+                table->slots[i].store(element, std::memory_order_release);
+                epoch.retire([e]() { delete e; });
+                return;
+            }
+            i = (i + 1) & table->mask;
+        }
+
+        if (free) {
+            free->store(element, std::memory_order_release);
+        } else {
+            table->slots[i].store(element, std::memory_order_release);
+            table->used++;
+        }
+        shard.live++;
+
+    }
+
+
+    std::string trim(const std::string& str) {
+        size_t first = str.find_first_not_of(' ');
+        if (std::string::npos == first){
+            return str;
+        }
+        size_t last = str.find_last_not_of(' ');
+        return str.substr(first, (last - first + 1));
+    }
+
+    static bool validDomain(const std::string& domain){
+        if (domain.size() > MAX_NAME)
+            return false;
+        size_t begin = 0;
+        while (begin <= domain.size()){
+            size_t dot = std::min(domain.find('.', begin), domain.size());
+            if (dot - begin > 63 || (dot == begin && dot != domain.size()))
+                return false;
+            begin = dot + 1;
+        }
+        return true;
+    }
+
+    public:
+
+    // How long empty answers (NODATA) are kept.
+    static constexpr time_t NEGATIVE_TTL = 60;
+
+    Cache(): epoch(Epoch::instance()), store(NULL), admission(NULL), clock(time) {
+        for (Shard& shard : shards){
+            shard.table.store(new Table(MIN_SLOTS));
+            shard.live = 0;
+        }
+        resetStats();
+    }
+
+    Cache(const Cache&) = delete;
+    Cache& operator = (const Cache&) = delete;
+
+    // in-addr.arpa or ip6.arpa name of an address, for PTR lookups.
+    static std::string reverseName(int family, const uint8_t* addr){
+
+        std::stringstream name;
+        if (family == AF_INET){
+            for (int i = 3; i >= 0; i--)
+                name << int(addr[i]) << ".";
+            name << "in-addr.arpa";
+        }else{
+            const char* hex = "0123456789abcdef";
+            for (int i = 15; i >= 0; i--)
+                name << hex[addr[i] & 0x0F] << "." << hex[addr[i] >> 4] << ".";
+            name << "ip6.arpa";
+        }
+        return name.str();
+
+    }
+
+    // Every name of a line gets its A or AAAA record, and the address a PTR
+    // record to the first (canonical) name, so reverse lookups for hosts
+    // entries never leave the server.
+    void load(std::string hosts){
+
+        std::string line;
+        std::ifstream hfile(hosts);
+        std::string domain;
+        std::string ip;
+        std::map<std::pair<std::string, uint16_t>, std::vector<Answer*>> records;
+
+        if(hfile.is_open()){
+
+            while (getline(hfile, line)){
+                line = line.substr(0, line.find('#'));
+                std::replace( line.begin(), line.end(), '\t', ' ');
+                line = trim(line);
+                if (line.size() == 0) continue;
+                std::istringstream ss(line);
+                getline(ss, ip, ' ');
+
+                uint8_t addr[16];
+                int family = AF_INET;
+                if (inet_pton(AF_INET, ip.c_str(), addr) != 1){
+                    family = AF_INET6;
+                    if (inet_pton(AF_INET6, ip.c_str(), addr) != 1)
+                        continue;
+                }
+
+                std::string canonical;
+                while (getline(ss, domain, ' ')){
+
+                    if (domain == "" || !validDomain(domain)) continue;
+                    if (canonical == "") canonical = domain;
+
+                    if (family == AF_INET){
+                        Answer* ans = new A_Answer(domain, 1, 1, 0);
+                        ans->setRData(addr[0], addr[1], addr[2], addr[3]);
+                        records[std::make_pair(domain, 1)].push_back(ans);
+                    }else{
+                        AAAA_Answer* ans = new AAAA_Answer(domain, 28, 1, 0);
+                        ans->setRData(addr);
+                        records[std::make_pair(domain, 28)].push_back(ans);
+                    }
+
+                }
+
+                if (canonical != ""){
+                    std::string reverse = reverseName(family, addr);
+                    std::vector<Answer*>& ptr = records[std::make_pair(reverse, 12)];
+                    if (ptr.empty()){
+                        Answer* ans = new PTR_Answer(reverse, 12, 1, 0);
+                        ans->setRData(canonical);
+                        ptr.push_back(ans);
+                    }
+                }
+
+            }
+
+            hfile.close();
+
+            for (auto& r : records)
+                insert(Question(r.first.first, r.first.second, 1), r.second, 0);
+
+        }
+
+    }
+
+    // Every element that expires goes to store from now on, which has to
+    // outlive the cache. Call it before anything is cached.
+    void setStore(CacheStore* store){
+        this->store = store;
+    }
+
+    // Fetched RRsets are only cached when admission admits them from now
+    // on, NULL takes them all. It has to outlive the cache.
+    void setAdmission(Admission* admission){
+        this->admission = admission;
+    }
+
+    // TTLs count down on clock, time() unless set, as when queries are
+    // replayed at the time they were captured rather than now.
+    void setClock(time_t (*clock)(time_t*)){
+        this->clock = clock;
+    }
+
+    // count is set on the first lookup of a name for a client question
+    // only, so that admission counts questions rather than lookups.
+    std::optional<std::vector<Answer*>> get(Question question, bool count = false){
+
+        size_t h = hash(question);
+        if (admission && count)
+            admission->record(h);
+        Shard& shard = shardOf(h);
+        Counters& counter = counters[&shard - shards];
+        time_t now = clock(NULL);
+
+        {
+            Epoch::Guard guard(epoch);
+            Table* table = shard.table.load(std::memory_order_acquire);
+
+            for (size_t i = h & table->mask, n = 0; n <= table->mask; i = (i + 1) & table->mask, n++) {
+
+                Element* e = table->slots[i].load(std::memory_order_acquire);
+                if (e == nullptr)
+                    break;
+                if (e == tombstone() || !e->matches(h, question))
+                    continue;
+                if (e->expires && e->expires <= now)
+                    break;
+
+                // Copies leave the read section, the element may be retired
+                // right after it.
+                std::vector<Answer*> answers = e->answers(now);
+                counter.hits.fetch_add(1, std::memory_order_relaxed);
+                return answers;
+
+            }
+        }
+
+        std::vector<Answer*> answers;
+        if (store && store->get(question, now, answers)){
+            counter.hits.fetch_add(1, std::memory_order_relaxed);
+            return answers;
+        }
+
+        counter.misses.fetch_add(1, std::memory_order_relaxed);
+        return {};
+
+    }
+
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+    };
 
-        int16_t value = domain.size();
-        value = htons(value);
-        memcpy(*out, &value, 2);
-        *out += 2;
-        memcpy(*out, domain.c_str(), value); *out += 1;
-    
+    // Lookups since the last reset, summed over the shards.
+    Stats stats(){
+        Stats total = { 0, 0 };
+        for (Counters& c : counters){
+            total.hits += c.hits.load(std::memory_order_relaxed);
+            total.misses += c.misses.load(std::memory_order_relaxed);
+        }
+        return total;
     }
 
-};
-
-class Cache {
+    void resetStats(){
+        for (Counters& c : counters){
+            c.hits.store(0, std::memory_order_relaxed);
+            c.misses.store(0, std::memory_order_relaxed);
+        }
+    }
 
-    typedef std::pair<std::vector<Answer*>, time_t> Element;
+    // Takes ownership of the answers. They are kept for the smallest TTL
+    // among them, hosts file entries never expire. Dropped unless admitted.
+    void set(Question question, std::vector<Answer*> answers){
 
-    private:
-    std::map<Question, Element> cache;
+        if (admission && !admission->admit(hash(question))){
+            for (Answer* a : answers)
+                delete a;
+            return;
+        }
 
-    std::string trim(const std::string& str) {
-        size_t first = str.find_first_not_of(' ');
-        if (std::string::npos == first){
-            return str;
+        time_t now = clock(NULL);
+        time_t expires = now + NEGATIVE_TTL;
+        if (!answers.empty()){
+            uint32_t ttl = answers[0]->aTTL;
+            for (Answer* a : answers)
+                ttl = std::min(ttl, a->aTTL);
+            // TTL 0 records still answer the query that fetched them.
+            expires = now + std::max(ttl, (uint32_t) 1);
         }
-        size_t last = str.find_last_not_of(' ');
-        return str.substr(first, (last - first + 1));
+        insert(question, answers, expires);
+
     }
 
-    bool is_number(const std::string& s){
-        return !s.empty() && std::find_if(s.begin(), 
-            s.end(), [](char c) { return !std::isdigit(c); }) == s.end();
+    // Same as set() with an absolute expiry time, 0 for never.
+    void set(Question question, std::vector<Answer*> answers, time_t expires){
+        insert(question, answers, expires);
     }
 
-    public:
+    // Rebuilds the tables of shards first, first + step, ... from the
+    // calling thread, so their pages are first touched on its NUMA node.
+    // Pinned workers calling it with step = their count interleave the
+    // tables over their nodes, so no single node carries every lookup.
+    // It does not make lookups local: shards follow the hash of the name,
+    // a worker finds its table on its own node about 1/nodes of the time,
+    // and elements stay on the node of the thread that cached them.
+    void interleave(size_t first, size_t step){
+
+        // A store is shared, its memory is not the thread's to place.
+        if (store)
+            return;
+
+        for (size_t i = first; i < SHARDS; i += step){
+            std::lock_guard<std::mutex> guard(shards[i].writer);
+            rehash(shards[i], shards[i].table.load(std::memory_order_relaxed)->mask + 1);
+        }
 
-    Cache(){}
+    }
 
-    void load(std::string hosts){
+    // Calls f with every live element that expires, hosts entries are
+    // left out. Answers are only valid during the call.
+    template <class F>
+    void forEach(F f){
 
-        std::string line;
-        std::ifstream hfile(hosts);
-        std::string domain;
-        std::string ip;
-        std::string oct;
-        uint8_t tip[4];
+        time_t now = clock(NULL);
 
-        if(hfile.is_open()){
+        if (store)
+            store->forEach(now, f);
 
-            while (getline(hfile, line)){
-                line = trim(line);
-                if ((line[0] == '#') || (line.size() == 0)) continue;
-                std::replace( line.begin(), line.end(), '\t', ' ');
-                std::istringstream ss(line);
-                getline(ss, ip, ' ');
+        for (Shard& shard : shards){
 
-                while (true){
-                    getline(ss, domain, ' ');
-                    if (domain != "" ) break;
-                }
+            Epoch::Guard guard(epoch);
+            Table* table = shard.table.load(std::memory_order_acquire);
 
-                std::istringstream sip(ip);
+            for (size_t i = 0; i <= table->mask; i++){
+                Element* e = table->slots[i].load(std::memory_order_acquire);
+                if (e == nullptr || e == tombstone() || !e->expires || e->expires <= now)
+                    continue;
+                std::vector<Answer*> answers = e->answers(0);
+                f(e->question(), (const std::vector<Answer*>&) answers, e->expires);
+                for (Answer* a : answers)
+                    delete a;
+            }
 
-                int i;
-                for(i=0; i<4; i++) {
-                    getline(sip, oct, '.');
-                    if (! is_number(oct)) break;
-                    tip[i] = std::stoi(oct);
-                }
+        }
 
-                if (i==4){
-                    Answer* ans = new A_Answer(domain, 1, 1, 0);
-                    Question qst(domain, 1, 1); 
-                    ans->setRData(tip[0], tip[1], tip[2], tip[3]);
-                    set(qst, std::vector<Answer*> (1, ans));
-                }
+    }
 
-            }
+    // Drops every expired element, shard by shard.
+    void expire(){
 
-            hfile.close();
+        time_t now = clock(NULL);
 
-        }
+        if (store)
+            store->expire(now);
 
-    }
+        for (Shard& shard : shards){
 
-    std::optional<std::vector<Answer*>> get(Question question){
+            std::lock_guard<std::mutex> guard(shard.writer);
+            Table* table = shard.table.load(std::memory_order_relaxed);
 
-        for (auto c : cache){
-            if(c.first == question){
-                return c.second.first;
+            for (size_t i = 0; i <= table->mask; i++){
+                Element* e = table->slots[i].load(std::memory_order_relaxed);
+                if (e == nullptr || e == tombstone() || !e->expires || e->expires > now)
+                    continue;
+                table->slots[i].store(tombstone(), std::memory_order_release);
+                epoch.retire([e]() { delete e; });
+                shard.live--;
             }
+
+            if (shard.live * 8 < table->mask && table->mask + 1 > MIN_SLOTS)
+                rehash(shard, std::max(MIN_SLOTS, (table->mask + 1) / 2));
+
         }
 
-        return {};
+        epoch.reclaim();
 
     }
 
-    void set(Question question, std::vector<Answer*> answers){
-        Element element(answers, 0);
-        cache.insert (
-            std::pair<Question, Element> (question, element)
-        );
+    ~Cache(){
+        for (Shard& shard : shards){
+            Table* table = shard.table.load();
+            for (size_t i = 0; i <= table->mask; i++){
+                Element* e = table->slots[i].load();
+                if (e != nullptr && e != tombstone())
+                    delete e;
+            }
+            delete table;
+        }
+        epoch.reclaim();
     }
 
 };
 
-class Package {
+class Package: public Types {
 
     private:
 
@@ -248,6 +1196,8 @@ class Package {
     uint16_t addCount;
     std::vector<Question> questions;
     std::vector<Answer*> answers;
+    bool edns;                  // the query had an OPT record
+    uint16_t payload;           // UDP reply size it offered
 
     // QR
     public:
@@ -257,17 +1207,10 @@ class Package {
         QR_Response = 1
     };
 
-    std::string qr2string(uint8_t qr){
-        std::string res("Unknown");
-        switch(qr){
-            case 0:
-                res = "Request";
-                break;
-            case 1:
-                res = "Response";
-                break;
-        }
-        return res;
+    static constexpr const char* QR_NAMES[2] = { "Request", "Response" };
+
+    static const char* qr2string(uint8_t qr){
+        return QR_NAMES[qr & 0x01];
     }
 
     // RCodes
@@ -281,77 +1224,21 @@ class Package {
         Refused_ResponseType = 5
     };
 
-    std::string rcodes2string(uint8_t rcode){
-        std::string res("Unknown");
-        switch(rcode){
-            case 0:
-                res = "Ok_ResponseType";
-                break;
-            case 1:
-                res = "FormatError_ResponseType";
-                break;
-            case 2:
-                res = "ServerFailure_ResponseType";
-                break;
-            case 3:
-                res = "NameError_ResponseType";
-                break;
-            case 4:
-                res = "NotImplemented_ResponseType";
-                break;
-            case 5:
-                res = "Refused_ResponseType";
-                break;
-        }
-        return res;
+    static constexpr const char* RCODE_NAMES[16] = {
+        "Ok_ResponseType", "FormatError_ResponseType", "ServerFailure_ResponseType",
+        "NameError_ResponseType", "NotImplemented_ResponseType", "Refused_ResponseType",
+        "Unknown", "Unknown", "Unknown", "Unknown", "Unknown",
+        "Unknown", "Unknown", "Unknown", "Unknown", "Unknown"
+    };
+
+    static const char* rcodes2string(uint8_t rcode){
+        return RCODE_NAMES[rcode & 0x0F];
     }
 
-    // Register Types
-    
-    enum {
-        A_Type = 1,
-        NS_Type = 2,
-        CNAME_Type = 5,
-        SOA_Type = 6,
-        PTR_Type = 12,
-        MX_Type = 15,
-        TXT_Type = 16,
-        AAAA_Type = 28,
-        SRV_Type = 33
-    };
+    // Register Types, see Record
 
-    std::string rtypes2string(uint8_t rtype){
-        std::string res("Unknown");
-        switch(rtype){
-            case 1:
-                res = "A";
-                break;
-            case 2:
-                res = "NS";
-                break;
-            case 5:
-                res = "CNAME";
-                break;
-            case 6:
-                res = "SOA";
-                break;
-            case 12:
-                res = "PTR";
-                break;
-            case 15:
-                res = "MX";
-                break;
-            case 16:
-                res = "TXT";
-                break;
-            case 28:
-                res = "AAAA";
-                break;
-            case 33:
-                res = "SRV";
-                break;
-        }
-        return res;
+    static const char* rtypes2string(uint16_t rtype){
+        return recordInfo(rtype).name;
     }
 
     // Classes
@@ -360,15 +1247,10 @@ class Package {
         IN_Class = 1
     };
 
-    std::string classes2string(uint8_t class_){
-        std::string res("Unknown");
-        switch(class_){
-            case 1:
-                res = "IN";
-                break;
-        }
+    static constexpr const char* CLASS_NAMES[5] = { "Unknown", "IN", "Unknown", "CH", "HS" };
 
-        return res;
+    static const char* classes2string(uint16_t class_){
+        return CLASS_NAMES[class_ < 5 ? class_ : 0];
     }
 
     private:
@@ -383,161 +1265,75 @@ class Package {
         UPDATE_OpCode = 5   // change resource records 
     };
 
-    std::string opcode2string(uint8_t opcode){
-        std::string res("Unknown");
-        switch(opcode){
-            case 0:
-                res = "Question";
-                break;
-            case 1:
-                res = "IQuestion";
-                break;
-            case 2:
-                res = "Status";
-                break;
-            case 4:
-                res = "Notify";
-                break;
-            case 5:
-                res = "Update";
-                break;
-        }
-        return res;
-    }
-
-    uint8_t* start;
-    uint8_t* buffer;
-    uint8_t* out;
-
-    uint8_t get8bits() {
-        uint8_t value;
-        memcpy(&value, buffer, 1);
-        buffer += 1;
-        return value;
-    }
+    static constexpr const char* OPCODE_NAMES[16] = {
+        "Question", "IQuestion", "Status", "Unknown", "Notify", "Update",
+        "Unknown", "Unknown", "Unknown", "Unknown", "Unknown",
+        "Unknown", "Unknown", "Unknown", "Unknown", "Unknown"
+    };
 
-    uint16_t get16bits() {
-        uint16_t value;
-        memcpy(&value, buffer, 2);
-        buffer += 2;
-        return ntohs(value);
+    static const char* opcode2string(uint8_t opcode){
+        return OPCODE_NAMES[opcode & 0x0F];
     }
 
-    uint32_t get32bits() {
-        uint32_t value;
-        memcpy(&value, buffer, 4);
-        buffer += 4;
-        return ntohl(value);
-    }
+    WireReader in;
 
-    void put8bits(uint8_t value) {
-        memcpy(out, &value, 1);
-        out += 1;
+    static void put8bits(std::vector<uint8_t>& out, uint8_t value) {
+        out.push_back(value);
     }
 
-    void put16bits(uint16_t value) {
-        value = htons(value);
-        memcpy(out, &value, 2);
-        out += 2;
+    static void put16bits(std::vector<uint8_t>& out, uint16_t value) {
+        out.push_back(value >> 8);
+        out.push_back(value);
     }
 
-    void put32bits(uint32_t value) {
-        value = htons(value);
-        memcpy(out, &value, 4);
-        out += 4;
+    static void put32bits(std::vector<uint8_t>& out, uint32_t value) {
+        put16bits(out, value >> 16);
+        put16bits(out, value);
     }
 
-    void putDomain(std::string domain) {
-
-        const char * start = domain.c_str();
-        const char * cursor = start;
-        uint8_t cont = 0;
-        while( *cursor != 0 ){
-            if(*cursor == '.'){
-                *out = cont;
-                out++;
-                memcpy(out, start, cont);
-                out += cont;
-                start += cont + 1;
-                cont = 0;
-            }else{
-                cont++;
-            }
-            cursor++;
-        }
-
-        *out = cont;
-        out ++;
-        memcpy(out, start, cont);
-        out += cont;
+    // Known types are read by their Record, unknown ones are skipped whole.
+    static Answer* parseAnswer(WireReader& in) {
 
-        *out = 0;
-        out++;
+        std::string Domain =    in.decodeDomain();
+        uint16_t Type =         in.get16bits();
+        uint16_t Class =        in.get16bits();
+        uint32_t TTL =          in.get32bits();
+        uint16_t Lenght =       in.get16bits();
 
-    }
-
-    std::string decodeDomain() {
-
-        char * name = new char[256];
-        uint8_t len;
-        int i = 0;
-        std::stack<uint8_t*> pointers;
-
-        while(*buffer != 0){
-
-            len = (uint8_t) *buffer;
-
-            // Is a offset of before name appaer
-            if((len >> 6) == 0x03){
-            
-                buffer++;
-                uint16_t offset = (uint16_t) *buffer;
-                offset &= 0x3FFF;
-                buffer++;
-                pointers.push(buffer);
-                buffer = start + offset;
-
-            }else{
-
-                buffer++;
-                memcpy(name + i, buffer, len);
-                buffer += len;
-                i += len;
-                name[i] = '.';
-                i++;
-            }
+        in.need(Lenght);
+        const uint8_t* rend = in.buffer + Lenght;
 
+        RecordReader read = recordInfo(Type).read;
+        if (!read){
+            in.buffer = rend;
+            return NULL;
         }
 
-        if(*buffer == 0)
-            buffer++;
+        Answer* ans = read(Domain, Class, TTL, in, Lenght);
 
-        while(!pointers.empty()){
-            buffer = pointers.top();
-            pointers.pop();
+        // RDATA has to be exactly what RDLENGTH says.
+        if (in.buffer != rend){
+            delete ans;
+            throw FormatError("bad RDLENGTH");
         }
+        return ans;
 
-        name[i-1] = 0;
-        std::string domain(name);
-        delete []name;
-        return domain;
-        
     }
 
     void parse() {
 
-        id =        get16bits();
-        flags =     get16bits();
-        queCount =  get16bits();
-        ansCount =  get16bits();
-        autCount =  get16bits();
-        addCount =  get16bits();
+        id =        in.get16bits();
+        flags =     in.get16bits();
+        queCount =  in.get16bits();
+        ansCount =  in.get16bits();
+        autCount =  in.get16bits();
+        addCount =  in.get16bits();
 
         for (int i = 0; i < queCount; ++i){
 
-            std::string qDomain = decodeDomain();
-            uint16_t qType = get16bits();
-            uint16_t qClass = get16bits();
+            std::string qDomain = in.decodeDomain();
+            uint16_t qType = in.get16bits();
+            uint16_t qClass = in.get16bits();
 
             questions.push_back(Question(
                 qDomain,
@@ -547,54 +1343,42 @@ class Package {
         }
 
         for (int i = 0; i < ansCount; ++i){
-  
-            std::string Domain =    decodeDomain();
-            uint16_t Type =         get16bits();
-            uint16_t Class =        get16bits();
-            uint32_t TTL =          get32bits();
-            uint16_t Lenght =       get16bits();
-
-            switch(Type){
-
-            case A_Type: {
-                
-                uint8_t oct1 = get8bits();
-                uint8_t oct2 = get8bits();
-                uint8_t oct3 = get8bits();
-                uint8_t oct4 = get8bits();
-                
-                Answer* ans = new A_Answer(
-                    Domain,
-                    Type,
-                    Class,
-                    TTL
-                );
-
-                ans->setRData(oct1, oct2, oct3, oct4);
 
+            Answer* ans = parseAnswer(in);
+            if (ans)
                 answers.push_back(ans);
-                break;
-            }
 
-            case CNAME_Type: {
+        }
 
-                std::string cname = decodeDomain();
-                
-                Answer* ans = new CNAME_Answer(
-                    Domain,
-                    Type,
-                    Class,
-                    TTL
-                );
+        if (!(flags & 0x8000))
+            readEdns();
 
-                ans->setRData(cname);
-                answers.push_back(ans);
-        
-                break;
-            }
+        // Authority and additional records are not kept.
+        ansCount = answers.size();
+        autCount = 0;
+        addCount = 0;
 
+    }
+
+    // Looks for the OPT record of a query in its additional section. A
+    // malformed one leaves the query without EDNS rather than rejected.
+    void readEdns() {
+
+        try {
+            for (int i = 0; i < autCount + addCount; ++i){
+                in.decodeDomain();
+                uint16_t Type = in.get16bits();
+                uint16_t Class = in.get16bits();
+                in.get32bits();
+                uint16_t Lenght = in.get16bits();
+                in.need(Lenght);
+                in.buffer += Lenght;
+                if (i >= autCount && Type == OPT_Type){
+                    edns = true;
+                    payload = std::max<uint16_t>(Class, BUF_SIZE);
+                }
             }
-        
+        } catch (FormatError& e) {
         }
 
     }
@@ -618,24 +1402,38 @@ class Package {
     }
 
     void setFlagRCode(uint8_t rcode){
-        flags |= (rcode & 0x0F) << 0;
+        flags = (flags & ~0x000F) | (rcode & 0x0F);
     }
 
     void setFlagQR(uint8_t qr){
         flags |= (qr & 0x01) << 15;
     }
 
-    Package(uint8_t* buffer):buffer(buffer), start(buffer) {
-        parse();
+    // Throws FormatError if the size bytes at buffer are not a well formed
+    // package. Never reads outside of them.
+    Package(const uint8_t* buffer, size_t size):
+        edns(false), payload(BUF_SIZE), in(buffer, buffer + size) {
+        try {
+            parse();
+        } catch (...) {
+            for (Answer* a : answers)
+                delete a;
+            throw;
+        }
     }
 
-    Package(uint16_t id) {
+    Package(const Package&) = delete;
+    Package& operator = (const Package&) = delete;
+
+    Package(uint16_t id): in(NULL, NULL) {
         this->id = id;
         this->flags = 0;
         this->queCount = 0;
         this->ansCount = 0;
         this->autCount = 0;
         this->addCount = 0;
+        this->edns = false;
+        this->payload = BUF_SIZE;
     }
 
     void addQuestion(Question question){
@@ -652,6 +1450,16 @@ class Package {
         return answers;
     }
 
+    const std::vector<Question>& getQuestions(){
+        return questions;
+    }
+
+    // Largest reply the client of this query takes over UDP: BUF_SIZE
+    // without EDNS, what it offered up to EDNS_UDP_SIZE with it.
+    size_t udpSize() const {
+        return std::min<size_t>(payload, EDNS_UDP_SIZE);
+    }
+
     ~Package() {
         for (Answer* a : answers){
             delete a;
@@ -659,6 +1467,7 @@ class Package {
     }
 
     friend class Resolver;
+    friend class Zones;
 
     void prettyPrint() {
 
@@ -694,116 +1503,484 @@ class Package {
 
     }
 
-    std::vector<uint8_t> dump() {
+    // Wire format of the package, at most limit bytes: when the answers do
+    // not fit, none is written and TC is set, the client asks again over
+    // a transport without the limit. Queries with EDNS get an OPT record.
+    std::vector<uint8_t> dump(size_t limit = SIZE_MAX) {
 
-        uint8_t* start = new uint8_t[256];
-        out = start;
+        std::vector<uint8_t> out;
+        out.reserve(BUF_SIZE);
 
-        put16bits(id);
-        put16bits(flags); 
-        put16bits(queCount);
-        put16bits(ansCount);
-        put16bits(autCount);
-        put16bits(addCount);
+        put16bits(out, id);
+        put16bits(out, flags);
+        put16bits(out, questions.size());
+        put16bits(out, answers.size());
+        put16bits(out, 0);
+        put16bits(out, edns ? 1 : 0);
 
         for (Question q : questions){
 
-            putDomain(q.qName);
-            put16bits(q.qType);
-            put16bits(q.qClass);
+            encodeDomain(out, q.qName);
+            put16bits(out, q.qType);
+            put16bits(out, q.qClass);
 
         }
 
-        for (Answer* a : answers){
+        size_t header = out.size();
+        size_t opt = edns ? 11 : 0;
+        for (Answer* a : answers)
+            putAnswer(out, a);
 
-            putDomain(a->aName);
-            put16bits(a->aType);
-            put16bits(a->aClass);
-            put32bits(a->aTTL);
-            a->putRData(&out);
+        if (out.size() + opt > limit){
+            out.resize(header);
+            out[2] |= 0x02;     // TC
+            out[6] = 0;
+            out[7] = 0;
+        }
 
+        // OPT: root name, our own UDP size, no extended RCODE or options.
+        if (edns){
+            put8bits(out, 0);
+            put16bits(out, OPT_Type);
+            put16bits(out, BUF_SIZE);
+            put32bits(out, 0);
+            put16bits(out, 0);
         }
 
-        std::vector<uint8_t> res(start, start + (out - start));
-        delete[] start;
-        return res;
+        return out;
     }
 
+    // Appends one resource record in wire format, names uncompressed.
+    static void putAnswer(std::vector<uint8_t>& out, Answer* a) {
+
+        encodeDomain(out, a->aName);
+        put16bits(out, a->aType);
+        put16bits(out, a->aClass);
+        put32bits(out, a->aTTL);
+
+        size_t length = out.size();
+        put16bits(out, 0);
+        a->putRData(out);
+        uint16_t rdlength = out.size() - length - 2;
+        out[length] = rdlength >> 8;
+        out[length + 1] = rdlength;
+
+    }
+
+    // Reads back one record written by putAnswer(). Returns NULL for types
+    // this server does not know, throws FormatError if malformed.
+    static Answer* getAnswer(const uint8_t* data, size_t size) {
+
+        WireReader in(data, data + size);
+        Answer* a = parseAnswer(in);
+        if (in.buffer != in.end){
+            delete a;
+            throw FormatError("trailing bytes after record");
+        }
+        return a;
+
+    }
+
+    // Reply for a package that could not be parsed: same ID, FORMERR.
+    static std::vector<uint8_t> formatError(const uint8_t* buffer, size_t size) {
+
+        std::vector<uint8_t> out(12, 0);
+        if (size >= 2)
+            memcpy(out.data(), buffer, 2);
+        if (size >= 3)
+            out[2] = buffer[2] & 0x79;
+        out[2] |= 0x80;
+        out[3] = FormatError_ResponseType;
+        return out;
+
+    }
+
+};
+
+#define RELAY_TIMEOUT 2
+#define MAX_CHAIN 8
+#define TCP_BUF_SIZE 65535
+
+// Where the resolver sends its misses. The default sends them over UDP,
+// tests and the replay tool plug in their own.
+struct Upstream {
+    // Sends query to server and writes the reply to res, at most BUF_SIZE
+    // bytes over UDP, TCP_BUF_SIZE over TCP. Returns its length, -1 on
+    // error or timeout.
+    virtual ssize_t exchange(const std::vector<uint8_t>& query, const sockaddr_in& server, uint8_t* res) = 0;
+    virtual ~Upstream() {}
+};
+
+// Other instances of the server sharing their caches. A miss is asked
+// to the instance owning the name before upstream, and what upstream
+// answers is handed to it.
+struct Peer {
+    // Writes the owner's reply to query, at most BUF_SIZE bytes, to res.
+    // Returns its length, -1 if this instance owns the name, the owner
+    // did not have it or did not answer.
+    virtual ssize_t ask(const std::vector<uint8_t>& query, const std::string& name, uint8_t* res) = 0;
+    // Gives the owner of name a reply this instance got from upstream.
+    virtual void tell(const std::string& name, const uint8_t* reply, size_t length) = 0;
+    virtual ~Peer() {}
+};
+
+// Names this server answers with authority, from the wire, before the
+// cache and upstream.
+struct Authority {
+    // Writes to out the reply to query if its name is served here.
+    // Returns its length, 0 for anything to resolve.
+    virtual size_t answer(const uint8_t* query, size_t len, uint8_t* out, size_t size) const = 0;
+    virtual ~Authority() {}
 };
 
 class Resolver {
 
     Cache& cache;
     std::string remote_ip;
-
-    ssize_t relay(Package& package, uint8_t * res){
+    const DomainTrie* blocklist;
+    Forwarder* forwarder;
+    Forwarder defaults;
+    Upstream* upstream;
+    Upstream* stream;
+    Peer* peer;
+    const Authority* authority;
+
+    // Sends the package to server and waits at most RELAY_TIMEOUT for the
+    // reply. Returns its length, -1 on error or timeout.
+    ssize_t relay(Package& package, const Server& server, uint8_t * res){
 
         ssize_t l;
-        std::vector<uint8_t> vout = package.dump();
-	    size_t out_size = vout.size();
-	    std::string out(vout.begin(), vout.end());
+        std::vector<uint8_t> out = package.dump();
+
+        if (upstream)
+            return upstream->exchange(out, server, res);
+        if (server.tcp && stream)
+            return stream->exchange(out, server, res);
 
         int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-        sockaddr_in si_other;
-	    socklen_t serverlen = sizeof(si_other);
-	    memset((char *) &si_other, 0, sizeof(si_other));
-        si_other.sin_family = AF_INET;
-        si_other.sin_port = htons(53);
-        inet_aton("8.8.8.8", &si_other.sin_addr);
+        if (sockfd == -1)
+            return -1;
+
+        timeval timeout = { RELAY_TIMEOUT, 0 };
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
-	    sendto(sockfd, out.c_str(), out_size, 0, (struct sockaddr *) &si_other, serverlen);
+        // connect() makes the kernel drop datagrams from anybody else.
+        if (connect(sockfd, (struct sockaddr *) &server, sizeof(server)) == -1 ||
+            send(sockfd, out.data(), out.size(), 0) == -1){
+            close(sockfd);
+            return -1;
+        }
+
+        while (true){
+            l = recv(sockfd, res, BUF_SIZE, 0);
+            // Stale or spoofed replies do not carry our ID.
+            if (l < 2 || memcmp(res, out.data(), 2) == 0)
+                break;
+        }
 
-	    memset(res, 0, BUF_SIZE);
-	    l = recvfrom(sockfd, res, BUF_SIZE, 0, (struct sockaddr *) &si_other, &serverlen);
-	    //std::vector<uint8_t> p(res, res + l);
-        //print_hex(p);
+        close(sockfd);
 
+        // Truncated: the whole reply only comes over TCP.
+        if (l >= 12 && (res[2] & 0x02) && stream)
+            l = stream->exchange(out, server, res);
         return l;
     }
 
-    public:
-    Resolver(Cache& cache):cache(cache){}
-    void resolve(Package& package) {
+    // What a chain lookup ended with.
+    enum {
+        Found,
+        Missing,
+        Failed
+    };
 
-        if (package.getFlagOPCode() == Package::Question_OpCode){
-            for (Question q : package.questions){
-                switch (q.qType){
-                    case Package::A_Type:
-                    case Package::CNAME_Type:
-                        std::optional<std::vector<Answer*>> ret = cache.get(q);
-                        if(ret){
+    static bool supported(uint16_t qType){
+        return recordInfo(qType).cacheable;
+    }
+
+    // Asks upstream for one link and caches every RRset of the reply that
+    // belongs to the chain starting at it, each under its own name, so a
+    // later query for any name of the chain is a hit. The RRsets are also
+    // copied to chain, for those the cache does not admit.
+    uint8_t fetch(Question link, std::vector<std::unique_ptr<Answer>>& chain){
+
+        static thread_local std::mt19937 ids(std::random_device{}());
+
+        Package query(ids());
+        query.flags = 0x0100;   // RD
+        query.addQuestion(link);
+
+        // The pool of the zone the name falls in, tried in turn.
+        std::vector<Server> servers = (forwarder ? forwarder : &defaults)->select(link.qName);
+
+        uint8_t out[TCP_BUF_SIZE];
+        ssize_t l = -1;
+        bool shared = false;
+        {
+            Trace::Span span(Tracer::Relay);
+            if (peer)
+                shared = (l = peer->ask(query.dump(), link.qName, out)) > 0;
+            for (size_t i = 0; i < servers.size() && l <= 0; i++)
+                l = relay(query, servers[i], out);
+        }
+        if (l <= 0)
+            return Package::ServerFailure_ResponseType;
+
+        uint8_t rcode = store(link, out, l, &chain);
+        if (peer && !shared && rcode == Package::Ok_ResponseType && l <= BUF_SIZE)
+            peer->tell(link.qName, out, l);
+        return rcode;
+
+    }
+
+    // Caches the RRsets of a reply to link, see fetch().
+    uint8_t store(Question link, const uint8_t* out, size_t l, std::vector<std::unique_ptr<Answer>>* chain = NULL){
+
+        try {
+
+            Package response(out, l);
+            if (response.getRCode() != Package::Ok_ResponseType)
+                return response.getRCode();
+
+            std::string owner = link.qName;
+            std::set<std::string> seen;
+
+            for (int depth = 0; depth <= MAX_CHAIN && seen.insert(owner).second; depth++){
+
+                std::vector<Answer*> rrset, cname;
+                for (Answer* a : response.answers){
+                    if (a->aName != owner)
+                        continue;
+                    if (a->aType == link.qType)
+                        rrset.push_back(a->copy());
+                    else if (a->aType == Package::CNAME_Type && cname.empty())
+                        cname.push_back(a->copy());
+                }
+
+                if (chain)
+                    for (Answer* a : rrset.empty() ? cname : rrset)
+                        chain->emplace_back(a->copy());
+
+                if (!rrset.empty() || cname.empty()){
+                    // Empty means NODATA, cached as such.
+                    cache.set(Question(owner, link.qType, link.qClass), rrset);
+                    for (Answer* a : cname)
+                        delete a;
+                    break;
+                }
+
+                owner = *cname[0]->target();
+                cache.set(Question(cname[0]->aName, Package::CNAME_Type, link.qClass), cname);
+
+            }
+
+        } catch (FormatError& e) {
+            return Package::ServerFailure_ResponseType;
+        }
+
+        return Package::Ok_ResponseType;
+
+    }
 
-                            std::cout << "Ta en cache :)" << std::endl;
-                            package.answers  =  *ret;
-                            package.ansCount = (*ret).size();
+    // Resolves one question following CNAMEs through the cache and the
+    // hosts entries, and upstream unless local is set. Answers are
+    // appended to out in chain order. With count set every link is counted
+    // once for admission, the lookups after a fetch are not.
+    int resolveChain(Question q, bool local, std::vector<Answer*>& out, uint8_t& rcode, bool count){
 
-                        }else{
+        std::string name = q.qName;
+        std::set<std::string> seen;
+        seen.insert(name);
+        bool fetched = false;
+        std::vector<std::unique_ptr<Answer>> chain;
 
-                            std::cout << "No ta en cache :(" << std::endl;
-                            // Re-Send Package to a remote server.
+        for (int links = 0; links <= MAX_CHAIN; ){
 
-                            uint8_t out[512];
-                            relay(package, out);
+            // Checked before the cache and for every CNAME target.
+            if (blocklist && blocklist->contains(name)){
+                rcode = Package::NameError_ResponseType;
+                return Failed;
+            }
 
-                            Package response(out);
-                            
-                            // Save the answers of the Package Response in cache
-                            if (response.getRCode() == Package::Ok_ResponseType){
-                                cache.set(q, response.getAnswers());
-                                for(Answer *a : response.answers){ 
-                                    package.addAnswer(a->copy());
-                                }
-                            }
+            std::optional<std::vector<Answer*>> ret, alias;
+            {
+                Trace::Span span(Tracer::Lookup);
+                ret = cache.get(Question(name, q.qType, q.qClass), count && !fetched);
+                if (!ret && q.qType != Package::CNAME_Type)
+                    alias = cache.get(Question(name, Package::CNAME_Type, q.qClass), count && !fetched);
+            }
 
-                            // So we don't want to free the answers in 
-                            // the destructor of the Package Response
+            if (ret){
+                out.insert(out.end(), ret->begin(), ret->end());
+                return Found;
+            }
 
-                            response.answers.clear();
+            if (alias && !alias->empty()){
+                out.insert(out.end(), alias->begin(), alias->end());
+                name = *(*alias)[0]->target();
+                fetched = false;
+                links++;
+                if (!seen.insert(name).second)
+                    return Found;   // loop, answer what we have
+                continue;
+            }
 
+            // A fetched link that is still missing expired or was not
+            // admitted to the cache: the rest comes from the reply.
+            if (local)
+                return Missing;
+            if (fetched){
+                for (bool next = true; next; ){
+                    next = false;
+                    for (const std::unique_ptr<Answer>& a : chain){
+                        if (a->aName != name)
+                            continue;
+                        out.push_back(a->copy());
+                        if (a->aType == Package::CNAME_Type && q.qType != Package::CNAME_Type){
+                            name = *a->target();
+                            next = seen.insert(name).second;
+                            break;
                         }
+                    }
                 }
-                break;
+                return Found;
+            }
+
+            chain.clear();
+            rcode = fetch(Question(name, q.qType, q.qClass), chain);
+            if (rcode != Package::Ok_ResponseType)
+                return Failed;
+            fetched = true;
+
+        }
+
+        return Found;
+
+    }
+
+    static void delete_all(std::vector<Answer*>& answers){
+        for (Answer* a : answers)
+            delete a;
+        answers.clear();
+    }
+
+    public:
+    Resolver(Cache& cache, std::string remote_ip = "8.8.8.8"):
+        cache(cache), remote_ip(remote_ip), blocklist(NULL), forwarder(NULL), defaults(remote_ip),
+        upstream(NULL), stream(NULL), peer(NULL), authority(NULL){}
+
+    // Misses go to upstream instead of the network, NULL restores UDP.
+    void setUpstream(Upstream* upstream){
+        this->upstream = upstream;
+    }
+
+    // Upstreams marked tcp:// and replies with TC set go through stream,
+    // NULL keeps everything on UDP.
+    void setStream(Upstream* stream){
+        this->stream = stream;
+    }
+
+    // Misses are asked to peer before upstream, NULL stops sharing.
+    void setPeer(Peer* peer){
+        this->peer = peer;
+    }
+
+    // Caches a reply fetched by another instance, as if it came from
+    // upstream. False if it is not a reply this server would cache.
+    bool learn(const uint8_t* reply, size_t length){
+
+        try {
+            Package response(reply, length);
+            if (response.getFlagQR() != Package::QR_Response || response.questions.size() != 1 ||
+                !supported(response.questions[0].qType))
+                return false;
+            return store(response.questions[0], reply, length) == Package::Ok_ResponseType;
+        } catch (FormatError& e) {
+            return false;
+        }
+
+    }
+
+    // Picks the upstreams per zone, remote_ip is used otherwise.
+    void setForwarder(Forwarder* forwarder){
+        this->forwarder = forwarder;
+    }
+
+    // Names matching a rule of the blocklist get NXDOMAIN.
+    void setBlocklist(const DomainTrie* blocklist){
+        this->blocklist = blocklist;
+    }
+
+    // Names of authority are answered by it, NULL serves none.
+    void setAuthority(const Authority* authority){
+        this->authority = authority;
+    }
+
+    // Writes to out the reply to query if the server is authoritative for
+    // its name. Returns its length, 0 when it has to be resolved. Every
+    // path calls it on the wire query before resolve() or resolveLocal().
+    size_t authoritative(const uint8_t* query, size_t len, uint8_t* out, size_t size){
+        return authority ? authority->answer(query, len, out, size) : 0;
+    }
+
+    // Answers the package from the cache (hosts entries included) without
+    // ever relaying. Returns false, leaving the package untouched, when any
+    // question misses. Its questions are counted for admission either way.
+    bool resolveLocal(Package& package) {
+
+        if (package.getFlagOPCode() != Package::Question_OpCode)
+            return false;
+
+        std::vector<Answer*> answers;
+        uint8_t rcode = Package::Ok_ResponseType;
+
+        for (Question q : package.questions){
+            if (!supported(q.qType))
+                continue;
+            uint8_t status = Package::Ok_ResponseType;
+            // Locally, only the blocklist makes a chain fail.
+            if (resolveChain(q, true, answers, status, true) == Missing){
+                delete_all(answers);
+                return false;
+            }
+            if (rcode == Package::Ok_ResponseType)
+                rcode = status;
+        }
+
+        for (Answer* a : answers)
+            package.addAnswer(a);
+        package.setFlagRCode(rcode);
+        package.setFlagQR(Package::QR_Response);
+        return true;
+
+    }
+
+    // Every question is answered, CNAME chains included, in one response.
+    // counted is set for a package resolveLocal() missed, whose questions
+    // are not counted for admission again.
+    void resolve(Package& package, bool counted = false) {
+
+        if (package.getFlagOPCode() == Package::Question_OpCode){
+
+            uint8_t rcode = Package::Ok_ResponseType;
+
+            for (Question q : package.questions){
+
+                if (!supported(q.qType))
+                    continue;
+
+                std::vector<Answer*> answers;
+                uint8_t status = Package::Ok_ResponseType;
+                resolveChain(q, false, answers, status, !counted);
+
+                for (Answer* a : answers)
+                    package.addAnswer(a);
+                if (rcode == Package::Ok_ResponseType)
+                    rcode = status;
+
             }
+
+            package.setFlagRCode(rcode);
+
         }else{
             package.setFlagRCode(Package::NotImplemented_ResponseType);
         }
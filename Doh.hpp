@@ -0,0 +1,426 @@
+#pragma once
+
+/**
+  * DNS over HTTP (RFC 8484) without TLS, for proxies that terminate it.
+  *
+  *   GET  /dns-query?dns=<base64url message>
+  *   POST /dns-query with Content-Type: application/dns-message
+  *
+  * Messages go through the same Package and Resolver as UDP queries, the
+  * rate limiter and the tracer included. Connections are HTTP/1.1 and kept
+  * alive between requests. Replies carry Cache-Control max-age set to the
+  * smallest TTL of the answers, so a caching proxy keeps them no longer
+  * than the resolver would.
+  *
+  * Cache and zone hits are answered on the event loop. Misses go to a pool
+  * of WORKERS threads, so one slow upstream never holds the loop, and come
+  * back to it to be sent: up to WORKERS misses are resolved at once while
+  * the loop goes on with every other connection.
+  *
+  * drain() stops accepting and closes connections as their replies go,
+  * for a server that hands its listening socket over: once idle() the
+  * requests it has read are all answered.
+  **/
+
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+
+#include "Dns.hpp"
+#include "RateLimit.hpp"
+#include "Sketch.hpp"
+
+namespace dns {
+
+class DohServer {
+
+    static constexpr size_t MAX_MESSAGE = 65535;
+    static constexpr int IDLE_TIMEOUT = 60;
+
+    // A request on its way from the loop to a worker and back. An empty
+    // out is a message that could not be parsed.
+    struct Job {
+        struct evhttp_request* req;
+        std::vector<uint8_t> query;
+        uint32_t client;
+        std::vector<uint8_t> out;
+        char cache[32];
+    };
+
+    Resolver& resolver;
+    RateLimiter* limiter;
+    struct evhttp* http;
+    struct evhttp_bound_socket* listener;
+
+    std::mutex lock;            // guards the queues and stopping
+    std::condition_variable wake;
+    std::deque<Job*> misses, answered;
+    bool stopping;
+    std::vector<std::thread> workers;
+    int notify[2];              // workers to the loop, a byte per answer
+    struct event* ev;
+
+    size_t inflight;            // misses not sent yet, on the loop only
+    bool draining;
+
+    static void reply(struct evhttp_request* req, int code, const char* reason) {
+        evhttp_send_reply(req, code, reason, NULL);
+    }
+
+    // IPv4 address of the client in network order, 0 for any other.
+    static uint32_t peer(struct evhttp_request* req) {
+        struct evhttp_connection* conn = evhttp_request_get_connection(req);
+        char* address = NULL;
+        ev_uint16_t port;
+        in_addr addr;
+        if (conn)
+            evhttp_connection_get_peer(conn, &address, &port);
+        return address && inet_pton(AF_INET, address, &addr) == 1 ? addr.s_addr : 0;
+    }
+
+    // Cache-Control of a reply: the smallest TTL of its answers, the
+    // negative TTL when it has none, no caching of failures.
+    static void age(Job& job, Package& package) {
+
+        // Answers are fresh copies, their TTL is what is left of them.
+        std::vector<Answer*> answers = package.getAnswers();
+        uint8_t rcode = package.getRCode();
+        long age = -1;
+        if (!answers.empty() && rcode == Package::Ok_ResponseType) {
+            age = answers[0]->aTTL;
+            for (Answer* a : answers)
+                age = std::min(age, (long) a->aTTL);
+        } else if (rcode == Package::Ok_ResponseType || rcode == Package::NameError_ResponseType) {
+            age = Cache::NEGATIVE_TTL;
+        }
+
+        if (age >= 0)
+            snprintf(job.cache, sizeof(job.cache), "max-age=%ld", age);
+        else
+            snprintf(job.cache, sizeof(job.cache), "no-store");
+
+    }
+
+    // Answers job from the zones, false when its name is not in one.
+    bool authoritative(Job& job) {
+
+        uint8_t reply[BUF_SIZE];
+        size_t n = resolver.authoritative(job.query.data(), job.query.size(), reply, sizeof(reply));
+        if (!n)
+            return false;
+        job.out.assign(reply, reply + n);
+        try {
+            Package package(reply, n);
+            age(job, package);
+        } catch (FormatError& e) {
+            snprintf(job.cache, sizeof(job.cache), "no-store");
+        }
+
+        HeavyHitters* hitters = HeavyHitters::local();
+        if (hitters && (reply[3] & 0x0F) == Package::NameError_ResponseType)
+            hitters->nxdomain(job.query.data(), job.query.size());
+        return true;
+
+    }
+
+    // Resolves the query of job into its reply, from the cache only when
+    // local is set. False when that is not enough.
+    bool resolve(Job& job, bool local) {
+
+        Trace trace;
+
+        try {
+
+            Package package(job.query.data(), job.query.size());
+            trace.mark(Tracer::Parse);
+
+            if (local) {
+                if (!resolver.resolveLocal(package))
+                    return false;
+            } else {
+                resolver.resolve(package, true);
+            }
+            trace.mark(Tracer::Resolve);
+
+            job.out = package.dump();
+            trace.mark(Tracer::Dump);
+
+            age(job, package);
+            uint8_t rcode = package.getRCode();
+
+            HeavyHitters* hitters = HeavyHitters::local();
+            if (hitters && rcode == Package::NameError_ResponseType)
+                hitters->nxdomain(job.query.data(), job.query.size());
+
+            const std::vector<Question>& questions = package.getQuestions();
+            trace.finish(job.client, questions.empty() ? "" : questions[0].qName,
+                questions.empty() ? 0 : questions[0].qType, rcode);
+
+        } catch (FormatError& e) {
+
+            job.out.clear();
+
+        }
+
+        return true;
+
+    }
+
+    // On the loop. The request may have lost its connection meanwhile,
+    // libevent then frees it rather than sending.
+    void send(Job* job) {
+
+        struct evkeyvalq* headers = evhttp_request_get_output_headers(job->req);
+        if (draining)
+            evhttp_add_header(headers, "Connection", "close");
+
+        if (job->out.empty()) {
+            reply(job->req, HTTP_BADREQUEST, "Bad Request");
+            delete job;
+            return;
+        }
+
+        evhttp_add_header(headers, "Content-Type", "application/dns-message");
+        evhttp_add_header(headers, "Cache-Control", job->cache);
+
+        struct evbuffer* body = evbuffer_new();
+        evbuffer_add(body, job->out.data(), job->out.size());
+        evhttp_send_reply(job->req, HTTP_OK, "OK", body);
+        evbuffer_free(body);
+        delete job;
+
+    }
+
+    void work() {
+
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [this]() { return stopping || !misses.empty(); });
+            if (stopping)
+                return;
+            Job* job = misses.front();
+            misses.pop_front();
+            guard.unlock();
+
+            resolve(*job, false);
+
+            guard.lock();
+            answered.push_back(job);
+            // A full pipe has bytes to wake the loop up on already.
+            ssize_t n = write(notify[1], "", 1);
+            (void) n;
+        }
+
+    }
+
+    // Sends what the workers answered.
+    static void deliver(evutil_socket_t fd, short what, void* arg) {
+
+        DohServer* self = (DohServer*) arg;
+        char bytes[256];
+        while (read(fd, bytes, sizeof(bytes)) > 0)
+            ;
+
+        std::deque<Job*> done;
+        {
+            std::lock_guard<std::mutex> guard(self->lock);
+            done.swap(self->answered);
+        }
+        for (Job* job : done) {
+            self->inflight--;
+            self->send(job);
+        }
+
+    }
+
+    static void handle(struct evhttp_request* req, void* arg) {
+
+        DohServer* self = (DohServer*) arg;
+        std::vector<uint8_t> query;
+
+        switch (evhttp_request_get_command(req)) {
+
+            case EVHTTP_REQ_GET: {
+                struct evkeyvalq params;
+                const char* q = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(req));
+                if (!q || evhttp_parse_query_str(q, &params) != 0)
+                    return reply(req, HTTP_BADREQUEST, "Bad Request");
+                const char* dns = evhttp_find_header(&params, "dns");
+                bool ok = dns && base64url(dns, query);
+                evhttp_clear_headers(&params);
+                if (!ok)
+                    return reply(req, HTTP_BADREQUEST, "Bad Request");
+                break;
+            }
+
+            case EVHTTP_REQ_POST: {
+                const char* type = evhttp_find_header(evhttp_request_get_input_headers(req), "Content-Type");
+                if (!type || strncasecmp(type, "application/dns-message", 23) != 0)
+                    return reply(req, 415, "Unsupported Media Type");
+                struct evbuffer* body = evhttp_request_get_input_buffer(req);
+                query.resize(evbuffer_get_length(body));
+                evbuffer_remove(body, query.data(), query.size());
+                break;
+            }
+
+            default:
+                return reply(req, 405, "Method Not Allowed");
+
+        }
+
+        Job* job = new Job();
+        job->req = req;
+        job->query.swap(query);
+        job->client = peer(req);
+
+        // Counted and limited as a UDP query from the same client would be,
+        // there is no truncated reply to slip over HTTP.
+        HeavyHitters* hitters = HeavyHitters::local();
+        if (hitters)
+            hitters->query(job->query.data(), job->query.size(), job->client);
+        if (self->limiter && self->limiter->enabled() &&
+            self->limiter->check(job->client, job->query.data(), job->query.size(), RateLimiter::now()) != RateLimiter::Pass) {
+            delete job;
+            return reply(req, 429, "Too Many Requests");
+        }
+
+        if (self->authoritative(*job) || self->resolve(*job, true))
+            return self->send(job);
+
+        self->inflight++;
+        std::lock_guard<std::mutex> guard(self->lock);
+        self->misses.push_back(job);
+        self->wake.notify_one();
+
+    }
+
+    public:
+
+    // Threads resolving the misses.
+    static constexpr int WORKERS = 16;
+
+    // RFC 4648 section 5 alphabet, padding optional. False if malformed.
+    static bool base64url(const char* in, std::vector<uint8_t>& out) {
+
+        uint32_t acc = 0;
+        int bits = 0;
+
+        for (const char* p = in; *p && *p != '='; p++) {
+            int v;
+            char c = *p;
+            if (c >= 'A' && c <= 'Z') v = c - 'A';
+            else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+            else if (c >= '0' && c <= '9') v = c - '0' + 52;
+            else if (c == '-') v = 62;
+            else if (c == '_') v = 63;
+            else return false;
+            acc = (acc << 6) | v;
+            bits += 6;
+            if (bits >= 8) {
+                bits -= 8;
+                out.push_back(acc >> bits);
+                if (out.size() > MAX_MESSAGE)
+                    return false;
+            }
+        }
+
+        return bits < 6;
+
+    }
+
+    // Listens on port, or accepts on fd when one is given, a listening
+    // socket inherited from the previous process.
+    DohServer(Resolver& resolver, struct event_base* base, uint16_t port, int fd = -1, const char* path = "/dns-query"):
+        resolver(resolver), limiter(NULL), http(evhttp_new(base)), listener(NULL), stopping(false), ev(NULL),
+        inflight(0), draining(false) {
+
+        notify[0] = notify[1] = -1;
+        if (!http)
+            return;
+        evhttp_set_allowed_methods(http, EVHTTP_REQ_GET | EVHTTP_REQ_POST);
+        evhttp_set_max_body_size(http, MAX_MESSAGE);
+        evhttp_set_timeout(http, IDLE_TIMEOUT);
+        evhttp_set_cb(http, path, handle, this);
+        if (fd >= 0)
+            listener = evhttp_accept_socket_with_handle(http, fd);
+        else
+            listener = evhttp_bind_socket_with_handle(http, "0.0.0.0", port);
+
+        if (listener && pipe2(notify, O_NONBLOCK | O_CLOEXEC) < 0)
+            listener = NULL;
+        if (!listener)
+            return;
+        ev = event_new(base, notify[0], EV_READ | EV_PERSIST, deliver, this);
+        event_add(ev, NULL);
+        for (int i = 0; i < WORKERS; i++)
+            workers.push_back(std::thread(&DohServer::work, this));
+
+    }
+
+    // Misses being resolved are finished first, then dropped unanswered
+    // with their connections.
+    ~DohServer() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+        for (Job* job : misses)
+            delete job;
+        for (Job* job : answered)
+            delete job;
+        if (ev)
+            event_free(ev);
+        for (int end : notify)
+            if (end >= 0)
+                close(end);
+        if (http)
+            evhttp_free(http);
+    }
+
+    DohServer(const DohServer&) = delete;
+    DohServer& operator = (const DohServer&) = delete;
+
+    bool ok() {
+        return listener != NULL || draining;
+    }
+
+    int fileno() {
+        return listener ? evhttp_bound_socket_get_fd(listener) : -1;
+    }
+
+    // Queries are limited by limiter, used from the loop only, from now
+    // on. NULL lets them all through.
+    void setLimiter(RateLimiter* limiter) {
+        this->limiter = limiter;
+    }
+
+    // Stops accepting, the listening socket is closed here only. Replies
+    // from now on close their connections.
+    void drain() {
+        draining = true;
+        if (listener)
+            evhttp_del_accept_socket(http, listener);
+        listener = NULL;
+    }
+
+    // No request read is waiting for its reply.
+    bool idle() const {
+        return inflight == 0;
+    }
+
+};
+
+};
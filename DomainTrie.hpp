@@ -0,0 +1,279 @@
+#pragma once
+
+/**
+  * Label-reversed trie of domain rules.
+  *
+  * "example.com" is stored as com -> example. Labels are interned once in
+  * a flat pool and edges live in a single open addressing table keyed by
+  * (parent node, label), so a rule costs a few dozen bytes whatever its
+  * length and a lookup is one probe per label of the queried name.
+  *
+  * Rule syntax:
+  *   example.com       the name itself
+  *   *.example.com     any name below it, not the name itself
+  *   .example.com      the name and any name below it
+  **/
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace dns {
+
+class DomainTrie {
+
+    enum {
+        EXACT = 1,
+        BELOW = 2
+    };
+
+    struct Edge {
+        uint32_t parent;
+        uint32_t label;     // offset in pool + 1, 0 for an empty slot
+        uint32_t child;
+    };
+
+    std::string pool;               // [length][bytes] per label
+    std::vector<uint32_t> labels;   // open addressing, offset + 1
+    size_t labelCount;
+    std::vector<Edge> edges;
+    size_t edgeCount;
+    std::vector<uint8_t> flags;     // per node
+    std::vector<uint32_t> values;   // per node
+    size_t ruleCount;
+
+    static char lower(char c) {
+        return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+
+    static uint64_t hashLabel(const char* label, size_t len) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i < len; i++)
+            h = (h ^ (uint8_t) lower(label[i])) * 0x100000001b3ULL;
+        return h;
+    }
+
+    static uint64_t hashEdge(uint32_t parent, uint32_t label) {
+        uint64_t h = ((uint64_t) parent << 32 | label) * 0x9E3779B97F4A7C15ULL;
+        return h ^ (h >> 29);
+    }
+
+    bool sameLabel(uint32_t id, const char* label, size_t len) const {
+        const char* stored = pool.data() + id - 1;
+        if ((uint8_t) stored[0] != len)
+            return false;
+        for (size_t i = 0; i < len; i++)
+            if (stored[1 + i] != lower(label[i]))
+                return false;
+        return true;
+    }
+
+    // Label id, 0 if the label was never stored.
+    uint32_t findLabel(const char* label, size_t len) const {
+
+        if (labels.empty())
+            return 0;
+        size_t mask = labels.size() - 1;
+        for (size_t i = hashLabel(label, len) & mask; labels[i]; i = (i + 1) & mask)
+            if (sameLabel(labels[i], label, len))
+                return labels[i];
+        return 0;
+
+    }
+
+    uint32_t addLabel(const char* label, size_t len) {
+
+        uint32_t id = findLabel(label, len);
+        if (id)
+            return id;
+
+        if ((labelCount + 1) * 4 > labels.size() * 3) {
+            std::vector<uint32_t> old;
+            old.swap(labels);
+            labels.assign(std::max((size_t) 1024, old.size() * 2), 0);
+            for (uint32_t l : old)
+                if (l)
+                    placeLabel(l);
+        }
+
+        id = pool.size() + 1;
+        pool.push_back((char) len);
+        for (size_t i = 0; i < len; i++)
+            pool.push_back(lower(label[i]));
+        placeLabel(id);
+        labelCount++;
+        return id;
+
+    }
+
+    void placeLabel(uint32_t id) {
+        size_t mask = labels.size() - 1;
+        size_t i = hashLabel(pool.data() + id, (uint8_t) pool[id - 1]) & mask;
+        while (labels[i])
+            i = (i + 1) & mask;
+        labels[i] = id;
+    }
+
+    uint32_t findChild(uint32_t parent, uint32_t label) const {
+
+        if (edges.empty())
+            return 0;
+        size_t mask = edges.size() - 1;
+        for (size_t i = hashEdge(parent, label) & mask; edges[i].label; i = (i + 1) & mask)
+            if (edges[i].parent == parent && edges[i].label == label)
+                return edges[i].child;
+        return 0;
+
+    }
+
+    void placeEdge(const Edge& edge) {
+        size_t mask = edges.size() - 1;
+        size_t i = hashEdge(edge.parent, edge.label) & mask;
+        while (edges[i].label)
+            i = (i + 1) & mask;
+        edges[i] = edge;
+    }
+
+    uint32_t addChild(uint32_t parent, uint32_t label) {
+
+        uint32_t child = findChild(parent, label);
+        if (child)
+            return child;
+
+        if ((edgeCount + 1) * 4 > edges.size() * 3) {
+            std::vector<Edge> old;
+            old.swap(edges);
+            edges.assign(std::max((size_t) 1024, old.size() * 2), Edge{ 0, 0, 0 });
+            for (const Edge& e : old)
+                if (e.label)
+                    placeEdge(e);
+        }
+
+        child = flags.size();
+        flags.push_back(0);
+        values.push_back(NONE);
+        placeEdge(Edge{ parent, label, child });
+        edgeCount++;
+        return child;
+
+    }
+
+    public:
+
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    DomainTrie(): labelCount(0), edgeCount(0), flags(1, 0), values(1, NONE), ruleCount(0) {}
+
+    // Adds a rule, see the syntax above. A later rule for the same name and
+    // kind replaces the value of the earlier one.
+    void insert(std::string rule, uint32_t value = 0) {
+
+        uint8_t kind = EXACT;
+        if (rule.compare(0, 2, "*.") == 0) {
+            kind = BELOW;
+            rule = rule.substr(2);
+        } else if (rule.compare(0, 1, ".") == 0) {
+            kind = EXACT | BELOW;
+            rule = rule.substr(1);
+        }
+        if (!rule.empty() && rule.back() == '.')
+            rule.pop_back();
+
+        uint32_t node = 0;
+        size_t end = rule.size();
+        while (end > 0) {
+            size_t dot = rule.rfind('.', end - 1);
+            size_t begin = dot == std::string::npos ? 0 : dot + 1;
+            if (end - begin > 0 && end - begin <= 63)
+                node = addChild(node, addLabel(rule.data() + begin, end - begin));
+            if (dot == std::string::npos)
+                break;
+            end = dot;
+        }
+
+        flags[node] |= kind;
+        values[node] = value;
+        ruleCount++;
+
+    }
+
+    // Value of the most specific rule matching name, NONE if none does.
+    uint32_t match(const std::string& name) const {
+
+        uint32_t best = NONE;
+        uint32_t node = 0;
+        size_t end = name.size();
+        if (end && name[end - 1] == '.')
+            end--;
+
+        while (true) {
+
+            if (end == 0) {
+                // Whole name consumed.
+                if (flags[node] & EXACT)
+                    best = values[node];
+                return best;
+            }
+
+            if (flags[node] & BELOW)
+                best = values[node];
+
+            size_t dot = name.rfind('.', end - 1);
+            size_t begin = dot == std::string::npos ? 0 : dot + 1;
+
+            uint32_t label = findLabel(name.data() + begin, end - begin);
+            if (!label)
+                return best;
+            node = findChild(node, label);
+            if (!node)
+                return best;
+
+            end = dot == std::string::npos ? 0 : dot;
+
+        }
+
+    }
+
+    bool contains(const std::string& name) const {
+        return match(name) != NONE;
+    }
+
+    size_t size() const {
+        return ruleCount;
+    }
+
+    size_t memory() const {
+        return pool.capacity() + labels.capacity() * sizeof(uint32_t) +
+            edges.capacity() * sizeof(Edge) + flags.capacity() +
+            values.capacity() * sizeof(uint32_t);
+    }
+
+    // One rule per line, '#' starts a comment. Hosts style lines
+    // ("0.0.0.0 ads.example.com") use their second field.
+    size_t load(const std::string& path, uint32_t value = 0) {
+
+        std::ifstream file(path);
+        std::string line, first, second;
+        size_t count = 0;
+
+        while (getline(file, line)) {
+            line = line.substr(0, line.find('#'));
+            std::istringstream ss(line);
+            if (!(ss >> first))
+                continue;
+            if (ss >> second)
+                first = second;
+            insert(first, value);
+            count++;
+        }
+
+        return count;
+
+    }
+
+};
+
+};
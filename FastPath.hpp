@@ -0,0 +1,446 @@
+#pragma once
+
+/**
+  * Linux fast path for cache hits.
+  *
+  * Queries are received from a PACKET_MMAP (TPACKET_V2) ring bound to one
+  * interface. Cache and hosts hits are answered in user space by rewriting
+  * the Ethernet/IPv4/UDP headers of the received frame in place and sending
+  * it back through the same packet socket. Misses go to the normal
+  * Resolver::resolve() path and are answered through the UDP socket.
+  * Queries are counted and limited first, as on the UDP socket: the ones
+  * over the limit are dropped or slipped back truncated from the ring.
+  **/
+
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "Dns.hpp"
+#include "RateLimit.hpp"
+#include "Sketch.hpp"
+#include "Trace.hpp"
+
+namespace dns {
+
+class FastPath {
+
+    static constexpr unsigned FRAME_SIZE = 2048;
+    static constexpr unsigned FRAME_COUNT = 1024;
+    static constexpr unsigned BLOCK_SIZE = 4096 * 8;
+
+    Resolver& resolver;
+    int fd;
+    int sock;
+    int ifindex;
+    uint16_t port;
+    uint8_t* ring;
+    size_t ringSize;
+    unsigned cursor;
+    bool filtered;      // sock drops what arrives on the interface
+    RateLimiter* limiter;
+
+    // ip and udp dst port <port> and not a fragment
+    void attachFilter() {
+
+        struct sock_filter code[] = {
+            BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, 12),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IP, 0, 8),
+            BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, 23),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 6),
+            BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, 20),
+            BPF_JUMP(BPF_JMP | BPF_JSET| BPF_K, 0x1fff, 4, 0),
+            BPF_STMT(BPF_LDX | BPF_B   | BPF_MSH, 14),
+            BPF_STMT(BPF_LD  | BPF_H   | BPF_IND, 16),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, port, 0, 1),
+            BPF_STMT(BPF_RET | BPF_K, 0xffff),
+            BPF_STMT(BPF_RET | BPF_K, 0),
+        };
+
+        struct sock_fprog prog;
+        prog.len = sizeof(code) / sizeof(code[0]);
+        prog.filter = code;
+
+        if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1)
+            perror("fastpath: SO_ATTACH_FILTER");
+
+    }
+
+    // Counts query among the NXDOMAIN names if out answers it so.
+    static void counted(const uint8_t* query, size_t size, const std::vector<uint8_t>& out) {
+        HeavyHitters* hitters = HeavyHitters::local();
+        if (hitters && out.size() >= 12 && (out[3] & 0x0F) == Package::NameError_ResponseType)
+            hitters->nxdomain(query, size);
+    }
+
+    static void finish(Trace& trace, const iphdr* ip, Package& package) {
+        const std::vector<Question>& questions = package.getQuestions();
+        trace.finish(ip->saddr, questions.empty() ? "" : questions[0].qName,
+            questions.empty() ? 0 : questions[0].qType, package.getRCode());
+    }
+
+    static uint16_t checksum(const uint8_t* data, size_t len) {
+
+        uint32_t sum = 0;
+        for (size_t i = 0; i + 1 < len; i += 2)
+            sum += (data[i] << 8) | data[i + 1];
+        if (len & 1)
+            sum += data[len - 1] << 8;
+        while (sum >> 16)
+            sum = (sum & 0xffff) + (sum >> 16);
+        return htons(~sum);
+
+    }
+
+    // Finds the DNS payload of an IPv4/UDP frame, false if it is not one.
+    bool locate(uint8_t* frame, size_t len, iphdr** ip, udphdr** udp, uint8_t** payload, size_t* size) {
+
+        if (len < sizeof(ether_header) + sizeof(iphdr) + sizeof(udphdr))
+            return false;
+
+        *ip = (iphdr*) (frame + sizeof(ether_header));
+        size_t ihl = (*ip)->ihl * 4;
+        if ((*ip)->version != 4 || ihl < sizeof(iphdr) ||
+            sizeof(ether_header) + ihl + sizeof(udphdr) > len)
+            return false;
+
+        // The UDP length, short frames are padded up to 60 bytes.
+        *udp = (udphdr*) ((uint8_t*) *ip + ihl);
+        *payload = (uint8_t*) *udp + sizeof(udphdr);
+        size_t ulen = ntohs((*udp)->len);
+        if (ulen < sizeof(udphdr) || ulen - sizeof(udphdr) > len - (*payload - frame))
+            return false;
+        *size = ulen - sizeof(udphdr);
+        return *size >= 12 && *size <= BUF_SIZE;
+
+    }
+
+    // Answers one frame in place. Returns the new frame length, or 0 when
+    // the query has to go through the normal resolver, which goes on with
+    // trace.
+    size_t answer(uint8_t* frame, size_t room, iphdr* ip, udphdr* udp, uint8_t* payload, size_t size, Trace& trace) {
+
+        std::vector<uint8_t> out(BUF_SIZE);
+        size_t n = resolver.authoritative(payload, size, out.data(), out.size());
+        out.resize(n);
+        try {
+            if (!n) {
+                Package package(payload, size);
+                trace.mark(Tracer::Parse);
+                if (!resolver.resolveLocal(package))
+                    return 0;
+                trace.mark(Tracer::Resolve);
+                out = package.dump(package.udpSize());
+                trace.mark(Tracer::Dump);
+                finish(trace, ip, package);
+            }
+        } catch (FormatError& e) {
+            out = Package::formatError(payload, size);
+        }
+        counted(payload, size, out);
+        return rewrite(frame, room, ip, udp, payload, out);
+
+    }
+
+    // Turns the frame into the reply out to its sender. Returns its length,
+    // 0 when it does not fit in room.
+    size_t rewrite(uint8_t* frame, size_t room, iphdr* ip, udphdr* udp, uint8_t* payload, const std::vector<uint8_t>& out) {
+
+        if (sizeof(ether_header) + sizeof(iphdr) + sizeof(udphdr) + out.size() > room)
+            return 0;
+
+        ether_header* eth = (ether_header*) frame;
+        uint8_t mac[ETH_ALEN];
+        memcpy(mac, eth->ether_dhost, ETH_ALEN);
+        memcpy(eth->ether_dhost, eth->ether_shost, ETH_ALEN);
+        memcpy(eth->ether_shost, mac, ETH_ALEN);
+
+        // Options are dropped, the reply always has a plain 20 bytes header.
+        if (ip->ihl != 5) {
+            memmove((uint8_t*) ip + sizeof(iphdr), udp, sizeof(udphdr));
+            udp = (udphdr*) ((uint8_t*) ip + sizeof(iphdr));
+            payload = (uint8_t*) udp + sizeof(udphdr);
+            ip->ihl = 5;
+        }
+        memcpy(payload, out.data(), out.size());
+
+        uint32_t addr = ip->saddr;
+        ip->saddr = ip->daddr;
+        ip->daddr = addr;
+        ip->tot_len = htons(sizeof(iphdr) + sizeof(udphdr) + out.size());
+        ip->id = 0;
+        ip->frag_off = htons(IP_DF);
+        ip->ttl = 64;
+        ip->check = 0;
+        ip->check = checksum((uint8_t*) ip, sizeof(iphdr));
+
+        uint16_t sport = udp->source;
+        udp->source = udp->dest;
+        udp->dest = sport;
+        udp->len = htons(sizeof(udphdr) + out.size());
+        udp->check = 0;
+
+        return sizeof(ether_header) + sizeof(iphdr) + sizeof(udphdr) + out.size();
+
+    }
+
+    // Hands a miss to the regular resolver, the reply leaves through the
+    // UDP socket bound to the same port.
+    void relay(iphdr* ip, udphdr* udp, uint8_t* payload, size_t size, Trace& trace) {
+
+        std::vector<uint8_t> out(BUF_SIZE);
+        size_t n = resolver.authoritative(payload, size, out.data(), out.size());
+        out.resize(n);
+        try {
+            if (!n) {
+                Package package(payload, size);
+                trace.mark(Tracer::Parse);
+                // answer() counted it already, on its way here.
+                resolver.resolve(package, true);
+                trace.mark(Tracer::Resolve);
+                out = package.dump(package.udpSize());
+                trace.mark(Tracer::Dump);
+                finish(trace, ip, package);
+            }
+        } catch (FormatError& e) {
+            out = Package::formatError(payload, size);
+        }
+        counted(payload, size, out);
+
+        sockaddr_in client;
+        memset(&client, 0, sizeof(client));
+        client.sin_family = AF_INET;
+        client.sin_addr.s_addr = ip->saddr;
+        client.sin_port = udp->source;
+
+        Tracer* tracer = Tracer::local();
+        uint64_t start = tracer ? Tracer::now() : 0;
+        if (sendto(sock, out.data(), out.size(), 0, (sockaddr*) &client, sizeof(client)) == -1)
+            perror("fastpath: sendto()");
+        if (tracer)
+            tracer->record(Tracer::Send, Tracer::now() - start);
+
+    }
+
+    public:
+
+    FastPath(Resolver& resolver, const char* ifname, uint16_t port, int sock):
+        resolver(resolver), fd(-1), sock(sock), port(port), ring(NULL), ringSize(0), cursor(0), filtered(false),
+        limiter(NULL) {
+
+        ifindex = if_nametoindex(ifname);
+        if (ifindex == 0) {
+            perror("fastpath: if_nametoindex()");
+            return;
+        }
+
+        fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_IP));
+        if (fd == -1) {
+            perror("fastpath: socket()");
+            return;
+        }
+
+        attachFilter();
+
+        int version = TPACKET_V2;
+        if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1) {
+            perror("fastpath: PACKET_VERSION");
+            close();
+            return;
+        }
+
+#ifdef PACKET_IGNORE_OUTGOING
+        int one = 1;
+        setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+#endif
+
+        tpacket_req req;
+        req.tp_block_size = BLOCK_SIZE;
+        req.tp_frame_size = FRAME_SIZE;
+        req.tp_block_nr = FRAME_COUNT * FRAME_SIZE / BLOCK_SIZE;
+        req.tp_frame_nr = FRAME_COUNT;
+        if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1) {
+            perror("fastpath: PACKET_RX_RING");
+            close();
+            return;
+        }
+
+        ringSize = (size_t) req.tp_block_size * req.tp_block_nr;
+        ring = (uint8_t*) mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ring == MAP_FAILED) {
+            perror("fastpath: mmap()");
+            ring = NULL;
+            close();
+            return;
+        }
+
+        sockaddr_ll sll;
+        memset(&sll, 0, sizeof(sll));
+        sll.sll_family = AF_PACKET;
+        sll.sll_protocol = htons(ETH_P_IP);
+        sll.sll_ifindex = ifindex;
+        if (bind(fd, (sockaddr*) &sll, sizeof(sll)) == -1) {
+            perror("fastpath: bind()");
+            close();
+            return;
+        }
+
+        // The kernel UDP socket stays bound so nobody gets ICMP port
+        // unreachable, but drops what arrives on the interface: the ring
+        // sees those queries. The socket still answers the other
+        // interfaces, loopback included.
+        struct sock_filter drop[] = {
+            BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, (uint32_t) (SKF_AD_OFF + SKF_AD_IFINDEX)),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t) ifindex, 0, 1),
+            BPF_STMT(BPF_RET | BPF_K, 0),
+            BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+        };
+        struct sock_fprog prog = { sizeof(drop) / sizeof(drop[0]), drop };
+        if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1)
+            perror("fastpath: SO_ATTACH_FILTER (udp)");
+        else
+            filtered = true;
+
+    }
+
+    ~FastPath() {
+        detach();
+        close();
+    }
+
+    bool ok() {
+        return fd != -1;
+    }
+
+    int fileno() {
+        return fd;
+    }
+
+    // Gives the UDP socket every query back.
+    void detach() {
+        int zero = 0;
+        if (filtered && setsockopt(sock, SOL_SOCKET, SO_DETACH_FILTER, &zero, sizeof(zero)) == -1)
+            perror("fastpath: SO_DETACH_FILTER (udp)");
+        filtered = false;
+    }
+
+    // Queries are limited by limiter, used from the loop of poll() only,
+    // from now on. NULL lets them all through.
+    void setLimiter(RateLimiter* limiter) {
+        this->limiter = limiter;
+    }
+
+    // Handles one frame received on the interface of size len, in a
+    // buffer of room bytes. Returns the length of the reply written over
+    // it for the ring, 0 when there is none: not a query, dropped, or
+    // relayed through the UDP socket.
+    size_t handle(uint8_t* frame, size_t len, size_t room) {
+
+        iphdr* ip;
+        udphdr* udp;
+        uint8_t* payload;
+        size_t size;
+        if (!locate(frame, len, &ip, &udp, &payload, &size))
+            return 0;
+
+        // Counted before rate limiting, which the counts help tune.
+        HeavyHitters* hitters = HeavyHitters::local();
+        if (hitters)
+            hitters->query(payload, size, ip->saddr);
+
+        if (limiter && limiter->enabled()) {
+            switch (limiter->check(ip->saddr, payload, size, RateLimiter::now())) {
+                case RateLimiter::Pass:
+                    break;
+                case RateLimiter::Drop:
+                    return 0;
+                case RateLimiter::Slip: {
+                    size = RateLimiter::truncate(payload, size);
+                    if (!size)
+                        return 0;
+                    std::vector<uint8_t> out(payload, payload + size);
+                    return rewrite(frame, room, ip, udp, payload, out);
+                }
+            }
+        }
+
+        Trace trace;
+        size_t n = answer(frame, room, ip, udp, payload, size, trace);
+        if (!n)
+            relay(ip, udp, payload, size, trace);
+        return n;
+
+    }
+
+    // After a handoff the UDP socket and its filter are the next
+    // server's, which takes them off or attaches its own.
+    void release() {
+        filtered = false;
+    }
+
+    void close() {
+        if (ring)
+            munmap(ring, ringSize);
+        ring = NULL;
+        if (fd != -1)
+            ::close(fd);
+        fd = -1;
+    }
+
+    // Drains every frame the kernel has handed over to user space. Taking
+    // a frame off the ring is traced as the receive of a datagram is, the
+    // ring send as its reply.
+    void poll() {
+
+        Tracer* tracer = Tracer::local();
+        uint64_t start = tracer ? Tracer::now() : 0;
+
+        while (true) {
+
+            tpacket2_hdr* hdr = (tpacket2_hdr*) (ring + (size_t) cursor * FRAME_SIZE);
+            if (!(hdr->tp_status & TP_STATUS_USER))
+                break;
+            if (tracer)
+                tracer->record(Tracer::Recv, Tracer::now() - start);
+
+            uint8_t* frame = (uint8_t*) hdr + hdr->tp_mac;
+            sockaddr_ll* sll = (sockaddr_ll*) ((uint8_t*) hdr + TPACKET_ALIGN(sizeof(tpacket2_hdr)));
+
+            if (sll->sll_pkttype != PACKET_OUTGOING && hdr->tp_snaplen == hdr->tp_len) {
+
+                size_t len = handle(frame, hdr->tp_snaplen, FRAME_SIZE - hdr->tp_mac);
+                if (len) {
+                    sockaddr_ll to;
+                    memset(&to, 0, sizeof(to));
+                    to.sll_family = AF_PACKET;
+                    to.sll_ifindex = ifindex;
+                    to.sll_halen = ETH_ALEN;
+                    memcpy(to.sll_addr, ((ether_header*) frame)->ether_dhost, ETH_ALEN);
+                    if (tracer)
+                        start = Tracer::now();
+                    if (sendto(fd, frame, len, 0, (sockaddr*) &to, sizeof(to)) == -1)
+                        perror("fastpath: sendto()");
+                    if (tracer)
+                        tracer->record(Tracer::Send, Tracer::now() - start);
+                }
+
+            }
+
+            hdr->tp_status = TP_STATUS_KERNEL;
+            __sync_synchronize();
+            cursor = (cursor + 1) % FRAME_COUNT;
+            if (tracer)
+                start = Tracer::now();
+
+        }
+
+    }
+
+};
+
+};
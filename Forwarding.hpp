@@ -0,0 +1,202 @@
+#pragma once
+
+/**
+  * Conditional forwarding: which upstream servers get a query.
+  *
+  * The table maps zones to pools of upstreams with the same DomainTrie
+  * the blocklist uses, so the longest matching zone is found in one walk
+  * over the labels of the name. Config file, one zone per line:
+  *
+  *   # zone          upstreams
+  *   corp.local      10.0.0.53,10.0.1.53
+  *   svc.cluster     10.96.0.10:53
+  *   lossy.net       tcp://10.0.2.53
+  *   .               8.8.8.8,1.1.1.1
+  *
+  * Upstreams written tcp://ip[:port] are asked over persistent TCP
+  * connections instead of UDP.
+  * "." is the pool for everything else. A new table can be loaded while
+  * queries run: it is swapped in atomically and the old one is retired
+  * through the epoch reclamation.
+  **/
+
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+
+#include "DomainTrie.hpp"
+#include "Rcu.hpp"
+
+namespace dns {
+
+// An upstream address and whether it is asked over TCP.
+struct Server: sockaddr_in {
+    bool tcp;
+};
+
+struct Upstreams {
+
+    std::vector<Server> servers;
+    std::atomic<unsigned> next;
+
+    Upstreams(): next(0) {}
+
+    // "[tcp://]ip[:port][,...]", false if any of them is not valid.
+    bool parse(const std::string& list) {
+
+        std::istringstream ss(list);
+        std::string item;
+
+        while (getline(ss, item, ',')) {
+
+            Server addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(53);
+            addr.tcp = item.compare(0, 6, "tcp://") == 0;
+            if (addr.tcp)
+                item = item.substr(6);
+
+            size_t colon = item.find(':');
+            if (colon != std::string::npos) {
+                int port = atoi(item.c_str() + colon + 1);
+                if (port <= 0 || port > 65535)
+                    return false;
+                addr.sin_port = htons(port);
+                item = item.substr(0, colon);
+            }
+            if (inet_pton(AF_INET, item.c_str(), &addr.sin_addr) != 1)
+                return false;
+
+            servers.push_back(addr);
+
+        }
+
+        return !servers.empty();
+
+    }
+
+};
+
+class ForwardTable {
+
+    DomainTrie zones;
+    std::vector<Upstreams*> pools;
+    Upstreams* fallback;
+
+    public:
+
+    ForwardTable(const std::string& fallback_list): fallback(new Upstreams()) {
+        fallback->parse(fallback_list);
+    }
+
+    ~ForwardTable() {
+        for (Upstreams* pool : pools)
+            delete pool;
+        delete fallback;
+    }
+
+    ForwardTable(const ForwardTable&) = delete;
+    ForwardTable& operator = (const ForwardTable&) = delete;
+
+    // Returns how many zones were read, -1 if the file cannot be opened or
+    // has an invalid line.
+    int load(const std::string& path) {
+
+        std::ifstream file(path);
+        if (!file.is_open())
+            return -1;
+
+        std::string line, zone, list;
+        int count = 0;
+
+        while (getline(file, line)) {
+
+            line = line.substr(0, line.find('#'));
+            std::istringstream ss(line);
+            if (!(ss >> zone))
+                continue;
+            Upstreams* pool = new Upstreams();
+            if (!(ss >> list) || !pool->parse(list)) {
+                delete pool;
+                return -1;
+            }
+
+            if (zone == ".") {
+                delete fallback;
+                fallback = pool;
+            } else {
+                if (zone.back() == '.')
+                    zone.pop_back();
+                zones.insert("." + zone, pools.size());
+                pools.push_back(pool);
+            }
+            count++;
+
+        }
+
+        return count;
+
+    }
+
+    Upstreams& select(const std::string& name) {
+        uint32_t pool = zones.match(name);
+        return pool == DomainTrie::NONE ? *fallback : *pools[pool];
+    }
+
+};
+
+class Forwarder {
+
+    std::atomic<ForwardTable*> table;
+    std::string fallback;
+    Epoch& epoch;
+
+    public:
+
+    Forwarder(const std::string& fallback):
+        table(new ForwardTable(fallback)), fallback(fallback), epoch(Epoch::instance()) {}
+
+    ~Forwarder() {
+        delete table.load();
+    }
+
+    // Swaps in the table read from path. The running one is kept if the
+    // file is not valid. Returns the number of zones, -1 on error.
+    int reload(const std::string& path) {
+
+        ForwardTable* fresh = new ForwardTable(fallback);
+        int zones = fresh->load(path);
+        if (zones < 0) {
+            delete fresh;
+            return -1;
+        }
+
+        ForwardTable* old = table.exchange(fresh);
+        epoch.retire([old]() { delete old; });
+        return zones;
+
+    }
+
+    // Upstreams for name in the order they should be tried. The first
+    // one rotates from query to query.
+    std::vector<Server> select(const std::string& name) {
+
+        Epoch::Guard guard(epoch);
+        Upstreams& pool = table.load()->select(name);
+
+        std::vector<Server> servers;
+        size_t n = pool.servers.size();
+        unsigned first = pool.next.fetch_add(1, std::memory_order_relaxed);
+        for (size_t i = 0; i < n; i++)
+            servers.push_back(pool.servers[(first + i) % n]);
+        return servers;
+
+    }
+
+};
+
+};
@@ -0,0 +1,424 @@
+#pragma once
+
+/**
+  * Binary upgrades without dropping queries or the cache.
+  *
+  * A server started with -U PATH listens on the Unix socket PATH. A new
+  * binary started with the same PATH connects to it before it binds
+  * anything and takes over:
+  *
+  *   new -> old   "JFFDNSH1", the name of its shared cache, if any
+  *   old -> new   "JFFDNSH1", how many sockets of each kind, and the
+  *                listening sockets themselves (SCM_RIGHTS)
+  *   old -> new   the cache as a Snapshot, unless both map the same
+  *                shared cache, then end of stream
+  *   new -> old   one byte, once the new one answers on the sockets
+  *
+  * The sockets are the same ones in both processes, so the queries queued
+  * in them are read by one or the other and none is lost. Socket filters
+  * go with them and belong to the process that attached them: take()
+  * clears them, the new one attaches its own. On the byte the old one
+  * stops accepting DoH connections, finishes the DoH requests it has read
+  * closing their connections, then stops as on SIGTERM: its threads
+  * finish the query they are on, upstream included, and it exits. A DoH
+  * client that sends on a kept alive connection meanwhile sees it closed
+  * and asks again on a new one. If the new one dies before sending the
+  * byte, the old one goes on as if nothing had happened.
+  *
+  * Only processes of the same user are served.
+  **/
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+#include <event2/event.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Snapshot.hpp"
+
+namespace dns {
+
+class Handoff {
+
+    static constexpr const char* MAGIC = "JFFDNSH1";
+    // SCM_RIGHTS takes at most 253 descriptors per message.
+    static constexpr size_t MAX_SOCKETS = 240;
+
+    // Just enough of a streambuf for Snapshot to write to and read from
+    // the connection.
+    class Stream: public std::streambuf {
+
+        int fd;
+        char in[1 << 16], out[1 << 16];
+
+        int_type underflow() override {
+            ssize_t n;
+            do {
+                n = recv(fd, in, sizeof(in), 0);
+            } while (n < 0 && errno == EINTR);
+            if (n <= 0)
+                return traits_type::eof();
+            setg(in, in, in + n);
+            return traits_type::to_int_type(*gptr());
+        }
+
+        int_type overflow(int_type c) override {
+            if (c != traits_type::eof()) {
+                *pptr() = c;
+                pbump(1);
+            }
+            return sync() == 0 ? traits_type::not_eof(c) : traits_type::eof();
+        }
+
+        int sync() override {
+            for (char* p = pbase(); p < pptr(); ) {
+                ssize_t n = send(fd, p, pptr() - p, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return -1;
+                p += n;
+            }
+            setp(out, out + sizeof(out) - 1);
+            return 0;
+        }
+
+        public:
+
+        Stream(int fd): fd(fd) {
+            setp(out, out + sizeof(out) - 1);
+        }
+
+    };
+
+    public:
+
+    // Listening sockets handed from one process to the next, -1 when the
+    // server does not have the kind.
+    struct Sockets {
+        std::vector<int> udp;
+        int doh = -1;
+        int peer = -1;
+    };
+
+    private:
+
+    std::string path;
+    std::string failure;
+    int fd;                     // listening, or connected to the old one
+    bool streamed;
+    struct event* ev;
+
+    Cache* cache;
+    std::string shared;
+    Sockets sockets;
+    std::function<void()> done;
+    std::thread transfer;
+    std::atomic<int> client;    // connection of the transfer under way
+    std::atomic<bool> handed;
+
+    static bool readFull(int fd, void* buffer, size_t size) {
+        uint8_t* p = (uint8_t*) buffer;
+        while (size) {
+            ssize_t n = recv(fd, p, size, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    static bool writeFull(int fd, const void* buffer, size_t size) {
+        const uint8_t* p = (const uint8_t*) buffer;
+        while (size) {
+            ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    bool address(sockaddr_un& addr) {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+            failure = "the socket path is empty or too long";
+            return false;
+        }
+        memcpy(addr.sun_path, path.data(), path.size());
+        return true;
+    }
+
+    bool disconnect() {
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+        return false;
+    }
+
+    // Old side. Whether the other end took the sockets over.
+    bool offer(int conn) {
+
+        char magic[8];
+        uint8_t length;
+        if (!readFull(conn, magic, 8) || memcmp(magic, MAGIC, 8) != 0 || !readFull(conn, &length, 1))
+            return false;
+        std::string name(length, '\0');
+        if (length && !readFull(conn, &name[0], length))
+            return false;
+
+        bool stream = shared.empty() || name != shared;
+        std::vector<int> fds(sockets.udp);
+        if (sockets.doh >= 0)
+            fds.push_back(sockets.doh);
+        if (sockets.peer >= 0)
+            fds.push_back(sockets.peer);
+
+        uint8_t header[12];
+        memcpy(header, MAGIC, 8);
+        header[8] = sockets.udp.size();
+        header[9] = sockets.doh >= 0;
+        header[10] = sockets.peer >= 0;
+        header[11] = stream;
+
+        iovec iov = { header, sizeof(header) };
+        std::vector<char> control(CMSG_SPACE(fds.size() * sizeof(int)));
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+        if (sendmsg(conn, &msg, MSG_NOSIGNAL) != (ssize_t) sizeof(header))
+            return false;
+
+        if (stream) {
+            Stream buffer(conn);
+            std::ostream out(&buffer);
+            Snapshot::save(*cache, out);
+            if (!out)
+                return false;
+        }
+        shutdown(conn, SHUT_WR);
+
+        char ready;
+        return readFull(conn, &ready, 1);
+
+    }
+
+    // On its own thread, so the loops keep answering meanwhile.
+    void give(int conn) {
+
+        if (offer(conn)) {
+            handed = true;
+            done();
+        }
+        client = -1;
+        close(conn);
+
+    }
+
+    static void accept(evutil_socket_t fd, short what, void* arg) {
+
+        Handoff* self = (Handoff*) arg;
+        int conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0)
+            return;
+
+        ucred peer;
+        socklen_t size = sizeof(peer);
+        if (self->handed || self->client >= 0 ||
+            getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &peer, &size) < 0 || peer.uid != getuid()) {
+            close(conn);
+            return;
+        }
+
+        if (self->transfer.joinable())
+            self->transfer.join();
+        self->client = conn;
+        self->transfer = std::thread(&Handoff::give, self, conn);
+
+    }
+
+    public:
+
+    Handoff(const std::string& path):
+        path(path), fd(-1), streamed(false), ev(NULL), cache(NULL), client(-1), handed(false) {}
+
+    ~Handoff() {
+        if (ev)
+            event_free(ev);
+        int conn = client;
+        if (conn >= 0)
+            shutdown(conn, SHUT_RDWR);
+        if (transfer.joinable())
+            transfer.join();
+        if (fd >= 0) {
+            close(fd);
+            // The path belongs to the next process once handed over.
+            if (ev && !handed)
+                unlink(path.c_str());
+        }
+    }
+
+    Handoff(const Handoff&) = delete;
+    Handoff& operator = (const Handoff&) = delete;
+
+    // New side. Connects to a server listening on the path and gets its
+    // sockets. shared is the name of the shared cache of this process,
+    // empty if it has none. False if no server listens there.
+    bool take(const std::string& shared, Sockets& sockets) {
+
+        sockaddr_un addr;
+        if (!address(addr))
+            return false;
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+            failure = strerror(errno);
+            return disconnect();
+        }
+
+        std::string hello(MAGIC);
+        hello += (char) std::min(shared.size(), (size_t) 255);
+        hello += shared.substr(0, 255);
+        if (!writeFull(fd, hello.data(), hello.size())) {
+            failure = "the server closed the connection";
+            return disconnect();
+        }
+
+        uint8_t header[12];
+        iovec iov = { header, sizeof(header) };
+        std::vector<char> control(CMSG_SPACE(MAX_SOCKETS * sizeof(int)));
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+
+        ssize_t n;
+        do {
+            n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+        } while (n < 0 && errno == EINTR);
+
+        std::vector<int> fds;
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* data = (const int*) CMSG_DATA(cmsg);
+            fds.insert(fds.end(), data, data + count);
+        }
+
+        if (n != sizeof(header) || memcmp(header, MAGIC, 8) != 0 ||
+            fds.size() != (size_t) header[8] + header[9] + header[10]) {
+            for (int s : fds)
+                close(s);
+            failure = "the server sent no sockets";
+            return disconnect();
+        }
+
+        // The old process may drop some queries with a filter of its own,
+        // for its fast path, which this one may not run.
+        int zero = 0;
+        for (int s : fds)
+            setsockopt(s, SOL_SOCKET, SO_DETACH_FILTER, &zero, sizeof(zero));
+
+        sockets.udp.assign(fds.begin(), fds.begin() + header[8]);
+        sockets.doh = header[9] ? fds[header[8]] : -1;
+        sockets.peer = header[10] ? fds[header[8] + header[9]] : -1;
+        streamed = header[11];
+        return true;
+
+    }
+
+    // New side, after take(). Loads the cache sent by the old server,
+    // returns how many elements, 0 when the cache is shared.
+    size_t receive(Cache& cache) {
+        if (fd < 0 || !streamed)
+            return 0;
+        Stream buffer(fd);
+        std::istream in(&buffer);
+        return Snapshot::load(cache, in);
+    }
+
+    // New side, once it answers on the sockets: tells the old server to
+    // stop.
+    bool ready() {
+        bool ok = fd >= 0 && writeFull(fd, "R", 1);
+        disconnect();
+        return ok;
+    }
+
+    // Old side. Waits on base for the next binary, hands it sockets and
+    // cache, and calls done once it has taken over. shared is the name of
+    // the shared cache of this process, empty if it has none.
+    bool listen(struct event_base* base, Cache& cache, const std::string& shared,
+        const Sockets& sockets, std::function<void()> done) {
+
+        if (sockets.udp.size() + 2 > MAX_SOCKETS) {
+            failure = "too many sockets to hand over";
+            return false;
+        }
+        this->cache = &cache;
+        this->shared = shared;
+        this->sockets = sockets;
+        this->done = done;
+
+        sockaddr_un addr;
+        if (!address(addr))
+            return false;
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        // A socket left by a process that did not hand over is stale.
+        unlink(path.c_str());
+        if (fd < 0 || bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+            chmod(path.c_str(), 0600) < 0 || ::listen(fd, 4) < 0) {
+            failure = strerror(errno);
+            return false;
+        }
+        evutil_make_socket_nonblocking(fd);
+        ev = event_new(base, fd, EV_READ | EV_PERSIST, accept, this);
+        event_add(ev, NULL);
+        return true;
+
+    }
+
+    // New side, after take(). False when both map the same shared cache.
+    bool streams() const {
+        return streamed;
+    }
+
+    bool taken() const {
+        return handed;
+    }
+
+    const std::string& error() const {
+        return failure;
+    }
+
+};
+
+};
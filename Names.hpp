@@ -0,0 +1,227 @@
+#pragma once
+
+/**
+  * Interned domain names, shared by suffix.
+  *
+  * A name is a chain of labels from its first one to the top level, each
+  * a node pointing to the node of its parent:
+  *
+  *   d1.cloudfront.net --> cloudfront.net --> net
+  *   d2.cloudfront.net ----^
+  *
+  * so the text of a suffix is kept once whatever the number of names
+  * under it, and a cached name costs one node for its first label. Nodes
+  * are found by (parent, label) in an open addressing table and counted:
+  * each name handed out holds a reference to its first node, each node
+  * one to its parent, and release() frees the nodes left unreferenced.
+  *
+  * Nodes never change once made. Readers walk a chain without the lock
+  * while they hold a reference to it, directly or through a cache element
+  * the epoch keeps alive. intern() and release() take the lock.
+  **/
+
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace dns {
+
+struct Label {
+
+    const Label* parent;    // NULL for a top level label
+    uint32_t refs;
+    uint32_t hash;
+    uint16_t length;
+
+    const char* text() const {
+        return (const char*) (this + 1);
+    }
+
+    static void operator delete(void* p) {
+        ::operator delete(p);
+    }
+
+};
+
+class Names {
+
+    std::mutex lock;
+    std::vector<Label*> slots;
+    size_t used;
+    size_t bytes;
+
+    static uint32_t hash(const Label* parent, const char* text, size_t length) {
+        uint64_t h = 14695981039346656037ULL ^ ((uintptr_t) parent * 0x9E3779B97F4A7C15ULL);
+        for (size_t i = 0; i < length; i++)
+            h = (h ^ (uint8_t) text[i]) * 1099511628211ULL;
+        return h ^ h >> 32;
+    }
+
+    // Called with the lock held.
+    void grow() {
+
+        std::vector<Label*> old(slots.size() * 2, nullptr);
+        old.swap(slots);
+        for (Label* node : old) {
+            if (!node)
+                continue;
+            size_t i = node->hash & (slots.size() - 1);
+            while (slots[i])
+                i = (i + 1) & (slots.size() - 1);
+            slots[i] = node;
+        }
+
+    }
+
+    // Called with the lock held. The node for text under parent, made if
+    // missing, in which case it takes a reference to parent.
+    Label* child(Label* parent, const char* text, size_t length) {
+
+        uint32_t h = hash(parent, text, length);
+        size_t mask = slots.size() - 1;
+        size_t i = h & mask;
+
+        for (Label* node; (node = slots[i]); i = (i + 1) & mask)
+            if (node->hash == h && node->parent == parent && node->length == length &&
+                memcmp(node->text(), text, length) == 0)
+                return node;
+
+        Label* node = new (::operator new(sizeof(Label) + length)) Label{ parent, 0, h, (uint16_t) length };
+        memcpy((char*) node->text(), text, length);
+        if (parent)
+            parent->refs++;
+        bytes += sizeof(Label) + length;
+
+        slots[i] = node;
+        if (++used * 4 > slots.size() * 3)
+            grow();
+        return node;
+
+    }
+
+    // Called with the lock held. Linear probing, so the entries after the
+    // hole that hash before it are shifted back, no tombstones.
+    void erase(Label* node) {
+
+        size_t mask = slots.size() - 1;
+        size_t i = node->hash & mask;
+        while (slots[i] != node)
+            i = (i + 1) & mask;
+
+        for (size_t j = (i + 1) & mask; slots[j]; j = (j + 1) & mask) {
+            size_t home = slots[j]->hash & mask;
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                slots[i] = slots[j];
+                i = j;
+            }
+        }
+        slots[i] = nullptr;
+        used--;
+        bytes -= sizeof(Label) + node->length;
+
+    }
+
+    public:
+
+    Names(): slots(1024, nullptr), used(0), bytes(0) {}
+
+    Names(const Names&) = delete;
+    Names& operator = (const Names&) = delete;
+
+    // One table for the process: caches share their suffixes. Never freed,
+    // elements retired late may still release names at exit.
+    static Names& instance() {
+        static Names* names = new Names();
+        return *names;
+    }
+
+    // The interned name, with a reference the caller gives back through
+    // release(). NULL for the empty name.
+    const Label* intern(const std::string& name) {
+
+        if (name.empty())
+            return NULL;
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        // From the last label to the first, each under the one before.
+        Label* node = NULL;
+        size_t stop = name.size();
+        while (true) {
+            size_t dot = stop ? name.rfind('.', stop - 1) : std::string::npos;
+            size_t begin = dot == std::string::npos ? 0 : dot + 1;
+            node = child(node, name.data() + begin, stop - begin);
+            if (dot == std::string::npos)
+                break;
+            stop = dot;
+        }
+        node->refs++;
+        return node;
+
+    }
+
+    void release(const Label* name) {
+
+        if (!name)
+            return;
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        Label* node = (Label*) name;
+        while (node && --node->refs == 0) {
+            Label* parent = (Label*) node->parent;
+            erase(node);
+            delete node;
+            node = parent;
+        }
+
+    }
+
+    // Whether name spells the chain, without building its text.
+    static bool equals(const Label* node, const std::string& name) {
+
+        if (!node)
+            return name.empty();
+
+        size_t pos = 0;
+        while (true) {
+            if (pos + node->length > name.size() || memcmp(name.data() + pos, node->text(), node->length) != 0)
+                return false;
+            pos += node->length;
+            node = node->parent;
+            if (!node)
+                return pos == name.size();
+            if (pos >= name.size() || name[pos] != '.')
+                return false;
+            pos++;
+        }
+
+    }
+
+    static std::string str(const Label* node) {
+        std::string name;
+        for (const Label* first = node; node; node = node->parent) {
+            if (node != first)
+                name += '.';
+            name.append(node->text(), node->length);
+        }
+        return name;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> guard(lock);
+        return used;
+    }
+
+    // Bytes of the nodes and of the table.
+    size_t memory() {
+        std::lock_guard<std::mutex> guard(lock);
+        return bytes + slots.size() * sizeof(Label*);
+    }
+
+};
+
+};
@@ -0,0 +1,403 @@
+#pragma once
+
+/**
+  * Cache sharing between the server instances of a site.
+  *
+  * Every instance is given the same list of peer addresses, its own
+  * included, and places them on a consistent hash ring, VNODES points
+  * each. The owner of a name is the peer of the first point after the
+  * hash of the name, so all of them agree on it and adding or removing
+  * a peer moves only the names of its arcs.
+  *
+  * The protocol is plain DNS over UDP on the peer port:
+  *
+  *   query     asked to the owner on a miss, answered from its cache
+  *             only, REFUSED if it does not have the name
+  *   response  a reply from upstream pushed to the owner, which caches
+  *             it as if it had fetched it
+  *
+  * So a name is fetched upstream about once per TTL for the whole site:
+  * the first instance to miss asks the owner, fetches it and hands it
+  * over, the others get it from the owner. Datagrams are only taken from
+  * the addresses of the list, ports included: queries and pushes both go
+  * out of the peer socket, and replies to queries are handed back to the
+  * thread that asked. A peer that does not answer in TIMEOUT_MS is left
+  * out for DOWN_SECONDS and its names go straight upstream.
+  *
+  * The peer socket has its own thread and event base. It only answers
+  * from the cache and the zones, so no upstream that is slow to reply
+  * ever holds an answer to a peer. drain() has that thread stop reading
+  * it, for a server that hands the socket over: the replies to the asks
+  * of the next one then all go to it.
+  **/
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <event2/event.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "Dns.hpp"
+#include "Forwarding.hpp"
+
+namespace dns {
+
+class Peers: public Peer {
+
+    static constexpr int VNODES = 64;
+    static constexpr int TIMEOUT_MS = 100;
+    static constexpr int DOWN_SECONDS = 10;
+    static constexpr int STOP_CHECK_MS = 200;
+
+    // A query asked to node, waiting for its reply in res.
+    struct Pending {
+        int node;
+        const std::vector<uint8_t>* query;
+        uint8_t* res;
+        ssize_t length;
+    };
+
+    std::vector<sockaddr_in> nodes;
+    std::unique_ptr<std::atomic<time_t>[]> down;
+    std::vector<std::pair<uint64_t, int>> ring;
+    int self;
+    std::string failure;
+
+    Resolver* resolver;
+    int sock;
+    struct event_base* base;
+    struct event* ev;
+    struct event* stop;
+    std::thread thread;
+    std::atomic<bool> stopping;
+    std::atomic<bool> draining;
+    bool drained;               // guarded by lock
+
+    std::mutex lock;            // guards pending
+    std::condition_variable replied;
+    std::vector<Pending*> pending;
+    std::atomic<uint16_t> ids;
+
+    std::atomic<uint64_t> asked, hits, told, served, learned;
+
+    // The read event is removed from the peer thread: the base is not
+    // shared with the thread that calls drain().
+    void stopReading() {
+        event_del(ev);
+        std::lock_guard<std::mutex> guard(lock);
+        drained = true;
+        replied.notify_all();
+    }
+
+    static uint64_t hash(const char* data, size_t size) {
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t i = 0; i < size; i++)
+            h = (h ^ (uint8_t) data[i]) * 1099511628211ULL;
+        // FNV alone leaves close strings close on the ring.
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    static bool same(const sockaddr_in& a, const sockaddr_in& b) {
+        return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+    }
+
+    // Index of the peer at from, -1 if none is.
+    int known(const sockaddr_in& from) const {
+        for (size_t i = 0; i < nodes.size(); i++)
+            if (same(nodes[i], from))
+                return i;
+        return -1;
+    }
+
+    // Hands a response from node to the ask() waiting for it. False when
+    // none is, the response is then a push.
+    bool deliver(int node, const uint8_t* buffer, size_t l) {
+
+        std::lock_guard<std::mutex> guard(lock);
+        for (Pending* p : pending) {
+            const std::vector<uint8_t>& q = *p->query;
+            if (p->node != node || p->length >= 0 || l < q.size() ||
+                memcmp(buffer, q.data(), 2) != 0 || memcmp(buffer + 12, q.data() + 12, q.size() - 12) != 0)
+                continue;
+            memcpy(p->res, buffer, l);
+            p->length = l;
+            replied.notify_all();
+            return true;
+        }
+        return false;
+
+    }
+
+    static void handle(evutil_socket_t fd, short what, void* arg) {
+
+        Peers* self = (Peers*) arg;
+        uint8_t buffer[BUF_SIZE];
+        sockaddr_in from;
+        socklen_t fromlen = sizeof(from);
+
+        // Left in the socket for the server it was handed to.
+        if (self->draining) {
+            self->stopReading();
+            return;
+        }
+
+        ssize_t l = recvfrom(fd, buffer, sizeof(buffer), 0, (struct sockaddr*) &from, &fromlen);
+        int node = l < 12 ? -1 : self->known(from);
+        if (node < 0)
+            return;
+
+        if (buffer[2] & 0x80) {
+            if (!self->deliver(node, buffer, l) && self->resolver->learn(buffer, l))
+                self->learned++;
+            return;
+        }
+
+        std::vector<uint8_t> out(BUF_SIZE);
+        size_t n = self->resolver->authoritative(buffer, l, out.data(), out.size());
+        out.resize(n);
+        try {
+            if (!n) {
+                Package package(buffer, l);
+                if (self->resolver->resolveLocal(package))
+                    out = package.dump(package.udpSize());
+            }
+        } catch (FormatError& e) {
+            return;
+        }
+        if (!out.empty())
+            self->served++;
+
+        // Not in the cache: the asker goes upstream and tells us.
+        if (out.empty()) {
+            out.assign(buffer, buffer + l);
+            out[2] |= 0x80;
+            out[3] = (out[3] & 0xF0) | Package::Refused_ResponseType;
+        }
+        sendto(fd, out.data(), out.size(), 0, (struct sockaddr*) &from, fromlen);
+
+    }
+
+    static void stop_cb(evutil_socket_t fd, short what, void* arg) {
+        Peers* self = (Peers*) arg;
+        if (self->draining && !self->drained)
+            self->stopReading();
+        if (self->stopping)
+            event_base_loopbreak(self->base);
+    }
+
+    void run() {
+        event_base_dispatch(base);
+    }
+
+    // Index of the peer owning name, -1 if it is this one or is down.
+    int peerFor(const std::string& name) const {
+
+        if (ring.empty() || draining)
+            return -1;
+        int node = owner(name);
+        if (node == self || down[node].load(std::memory_order_relaxed) > time(NULL))
+            return -1;
+        return node;
+
+    }
+
+    public:
+
+    struct Stats {
+        uint64_t asked, hits, told, served, learned;
+    };
+
+    // address is the peer address of this instance, list every peer
+    // address of the site, both "ip:port". address must be in the list.
+    Peers(const std::string& address, const std::string& list):
+        self(-1), resolver(NULL), sock(-1), base(NULL), ev(NULL), stop(NULL), stopping(false), draining(false), drained(false), ids(0),
+        asked(0), hits(0), told(0), served(0), learned(0) {
+
+        Upstreams me, all;
+        if (!me.parse(address) || me.servers.size() != 1 || !all.parse(list)) {
+            failure = "peers are given as ip:port";
+            return;
+        }
+
+        for (const sockaddr_in& addr : all.servers) {
+            bool duplicate = false;
+            for (const sockaddr_in& node : nodes)
+                duplicate |= same(node, addr);
+            if (!duplicate)
+                nodes.push_back(addr);
+        }
+        for (size_t i = 0; i < nodes.size(); i++)
+            if (same(nodes[i], me.servers[0]))
+                self = i;
+        if (self < 0) {
+            failure = address + " is not in the peer list";
+            return;
+        }
+
+        down.reset(new std::atomic<time_t>[nodes.size()]);
+        for (size_t i = 0; i < nodes.size(); i++) {
+            down[i] = 0;
+            char point[32];
+            for (int v = 0; v < VNODES; v++) {
+                int n = snprintf(point, sizeof(point), "%08x:%04x#%d",
+                    ntohl(nodes[i].sin_addr.s_addr), ntohs(nodes[i].sin_port), v);
+                ring.push_back(std::make_pair(hash(point, n), (int) i));
+            }
+        }
+        std::sort(ring.begin(), ring.end());
+
+    }
+
+    ~Peers() {
+        stopping = true;
+        if (thread.joinable())
+            thread.join();
+        if (ev)
+            event_free(ev);
+        if (stop)
+            event_free(stop);
+        if (base)
+            event_base_free(base);
+        if (sock >= 0)
+            close(sock);
+    }
+
+    Peers(const Peers&) = delete;
+    Peers& operator = (const Peers&) = delete;
+
+    // Answers other peers from the cache of resolver, on the port of self
+    // or on fd, a socket inherited already bound to it, from a thread of
+    // its own.
+    bool listen(Resolver& resolver, int fd = -1) {
+
+        this->resolver = &resolver;
+        sock = fd >= 0 ? fd : socket(AF_INET, SOCK_DGRAM, 0);
+        if (sock < 0 || (fd < 0 && bind(sock, (struct sockaddr*) &nodes[self], sizeof(sockaddr_in)) < 0)) {
+            failure = std::string("cannot bind the peer port: ") + strerror(errno);
+            return false;
+        }
+        evutil_make_socket_nonblocking(sock);
+
+        base = event_base_new();
+        if (!base) {
+            failure = "cannot create the peer event base";
+            return false;
+        }
+        timeval interval = { 0, STOP_CHECK_MS * 1000 };
+        ev = event_new(base, sock, EV_READ | EV_PERSIST, handle, this);
+        stop = event_new(base, -1, EV_PERSIST, stop_cb, this);
+        event_add(ev, NULL);
+        event_add(stop, &interval);
+        thread = std::thread(&Peers::run, this);
+        return true;
+
+    }
+
+    // Stops reading the peer socket and asking or telling peers, once
+    // it is handed to the next server. Returns when the peer thread no
+    // longer reads it.
+    void drain() {
+        draining = true;
+        if (!thread.joinable())
+            return;
+        std::unique_lock<std::mutex> guard(lock);
+        replied.wait_for(guard, std::chrono::milliseconds(2 * STOP_CHECK_MS), [this]() { return drained; });
+    }
+
+    bool ok() const {
+        return failure.empty();
+    }
+
+    int fileno() const {
+        return sock;
+    }
+
+    const std::string& error() const {
+        return failure;
+    }
+
+    size_t size() const {
+        return nodes.size();
+    }
+
+    // Index in the list of the peer owning name, whether up or not.
+    int owner(const std::string& name) const {
+        std::string key(name);
+        std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+        uint64_t h = hash(key.data(), key.size());
+        auto it = std::lower_bound(ring.begin(), ring.end(), std::make_pair(h, -1));
+        return (it == ring.end() ? ring.begin() : it)->second;
+    }
+
+    ssize_t ask(const std::vector<uint8_t>& query, const std::string& name, uint8_t* res) override {
+
+        int node = peerFor(name);
+        if (node < 0 || sock < 0 || query.size() < 12)
+            return -1;
+        asked++;
+
+        // Asked from the peer port, under an id of this instance so that
+        // concurrent asks for one name get their own replies.
+        std::vector<uint8_t> ask(query);
+        uint16_t id = ids++;
+        ask[0] = id >> 8;
+        ask[1] = id & 0xFF;
+
+        Pending p = { node, &ask, res, -1 };
+        ssize_t l = -1;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            pending.push_back(&p);
+            guard.unlock();
+            bool sent = sendto(sock, ask.data(), ask.size(), 0, (struct sockaddr*) &nodes[node], sizeof(sockaddr_in)) != -1;
+            guard.lock();
+            if (sent)
+                replied.wait_for(guard, std::chrono::milliseconds(TIMEOUT_MS), [&p]() { return p.length >= 0; });
+            pending.erase(std::find(pending.begin(), pending.end(), &p));
+            l = p.length;
+        }
+        if (l >= 2)
+            memcpy(res, query.data(), 2);
+
+        if (l < 12) {
+            down[node] = time(NULL) + DOWN_SECONDS;
+            return -1;
+        }
+        if ((res[3] & 0x0F) != Package::Ok_ResponseType)
+            return -1;
+        hits++;
+        return l;
+
+    }
+
+    void tell(const std::string& name, const uint8_t* reply, size_t length) override {
+
+        int node = peerFor(name);
+        if (node < 0 || sock < 0)
+            return;
+        if (sendto(sock, reply, length, 0, (struct sockaddr*) &nodes[node], sizeof(sockaddr_in)) > 0)
+            told++;
+
+    }
+
+    Stats stats() const {
+        return Stats{ asked, hits, told, served, learned };
+    }
+
+};
+
+};
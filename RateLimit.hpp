@@ -0,0 +1,169 @@
+#pragma once
+
+/**
+  * Per-client rate limiting and response rate limiting (RRL).
+  *
+  * Both limiters run on the raw datagram, before Package parses it. State
+  * is a fixed table of token buckets indexed by a hash of the key; keys
+  * that collide share a bucket, which can only make limiting stricter, so
+  * memory stays constant whatever the number of sources.
+  **/
+
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include <arpa/inet.h>
+
+namespace dns {
+
+class RateLimiter {
+
+    struct Bucket {
+        uint32_t tokens;    // thousandths of a query
+        uint32_t stamp;     // ms
+        uint32_t dropped;
+    };
+
+    unsigned clientRate;
+    unsigned responseRate;
+    unsigned slip;
+    size_t mask;
+    std::vector<Bucket> clients;
+    std::vector<Bucket> responses;
+
+    static uint32_t prefix(uint32_t addr) {
+        // IPv4 /24, addr in network order
+        return ntohl(addr) & 0xFFFFFF00;
+    }
+
+    static uint64_t mix(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    // Refills the bucket and takes one token from it.
+    static bool take(Bucket& b, unsigned rate, uint32_t now) {
+
+        uint64_t tokens = b.tokens + (uint64_t) (uint32_t) (now - b.stamp) * rate;
+        uint64_t burst = (uint64_t) rate * 1000;
+        if (tokens > burst)
+            tokens = burst;
+        b.stamp = now;
+
+        if (tokens < 1000) {
+            b.tokens = tokens;
+            return false;
+        }
+        b.tokens = tokens - 1000;
+        return true;
+
+    }
+
+    // Length of the question section starting at 12, 0 if malformed.
+    static size_t question(const uint8_t* buf, size_t len) {
+
+        size_t i = 12;
+        while (i < len && buf[i] != 0) {
+            if (buf[i] > 63)
+                return 0;
+            i += buf[i] + 1;
+        }
+        if (i + 5 > len)
+            return 0;
+        return i + 5 - 12;
+
+    }
+
+    public:
+
+    enum Verdict {
+        Pass,
+        Drop,
+        Slip
+    };
+
+    // Rates are per second, 0 disables the limiter. Every slip-th
+    // response over the limit is answered truncated instead of dropped.
+    RateLimiter(unsigned clientRate, unsigned responseRate, unsigned slip, size_t buckets = 1 << 16):
+        clientRate(clientRate), responseRate(responseRate), slip(slip), mask(buckets - 1),
+        clients(clientRate ? buckets : 0), responses(responseRate ? buckets : 0) {
+
+        uint32_t t = now();
+        for (Bucket& b : clients)
+            b = { clientRate * 1000, t, 0 };
+        for (Bucket& b : responses)
+            b = { responseRate * 1000, t, 0 };
+
+    }
+
+    static uint32_t now() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    bool enabled() {
+        return clientRate || responseRate;
+    }
+
+    // addr is the IPv4 source in network order, now in ms.
+    Verdict check(uint32_t addr, const uint8_t* buf, size_t len, uint32_t now) {
+
+        uint64_t source = prefix(addr);
+
+        if (clientRate && !take(clients[mix(source) & mask], clientRate, now))
+            return Drop;
+
+        if (!responseRate)
+            return Pass;
+
+        // Responses are identified by client prefix, qname, qtype and
+        // qclass, the same query always gets the same response from this
+        // server. Only the letters of the name are folded to lower case.
+        size_t qlen = question(buf, len);
+        if (qlen == 0)
+            return Pass;
+
+        uint64_t h = mix(source);
+        size_t type = 12 + qlen - 4;
+        for (size_t i = 12; i < type; i++) {
+            uint8_t c = buf[i];
+            h = (h ^ (c >= 'A' && c <= 'Z' ? c | 0x20 : c)) * 0x100000001b3ULL;
+        }
+        for (size_t i = type; i < type + 4; i++)
+            h = (h ^ buf[i]) * 0x100000001b3ULL;
+
+        Bucket& b = responses[mix(h) & mask];
+        if (take(b, responseRate, now))
+            return Pass;
+
+        if (slip && ++b.dropped % slip == 0)
+            return Slip;
+        return Drop;
+
+    }
+
+    // Turns the query in buf into an empty TC=1 response, in place.
+    // Returns its length, 0 if the query is malformed.
+    static size_t truncate(uint8_t* buf, size_t len) {
+
+        size_t qlen = question(buf, len);
+        if (qlen == 0)
+            return 0;
+
+        buf[2] = (buf[2] & 0x79) | 0x82;   // QR, TC, keep opcode and RD
+        buf[3] = 0;
+        const uint8_t counts[8] = { 0, 1, 0, 0, 0, 0, 0, 0 };
+        memcpy(buf + 4, counts, sizeof(counts));
+        return 12 + qlen;
+
+    }
+
+};
+
+};
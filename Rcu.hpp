@@ -0,0 +1,161 @@
+#pragma once
+
+/**
+  * Epoch based reclamation for read-mostly structures.
+  *
+  * Readers announce the global epoch they started in and never block or
+  * retry. Writers unlink an object, retire it, and it is freed once every
+  * reader that could still see it has left its read section.
+  *
+  * Each reading thread holds one of SLOTS slots for its lifetime. A thread
+  * finding none free aborts: a reader it does not announce could have an
+  * object freed under it.
+  **/
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace dns {
+
+class Epoch {
+
+    public:
+
+    // Threads that can read at once, over the life of each.
+    static constexpr int SLOTS = 256;
+
+    private:
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> active;
+        std::atomic<bool> used;
+    };
+
+    std::atomic<uint64_t> global;
+    Slot slots[SLOTS];
+
+    std::mutex lock;
+    std::vector<std::pair<uint64_t, std::function<void()>>> retired;
+
+    // One slot per thread, given back when the thread exits.
+    struct Owner {
+        Slot* slot = nullptr;
+        int depth = 0;
+        ~Owner() {
+            if (slot)
+                slot->used.store(false, std::memory_order_release);
+        }
+    };
+
+    Slot* mine(Owner& owner) {
+
+        if (owner.slot)
+            return owner.slot;
+
+        for (int i = 0; i < SLOTS; i++) {
+            bool expected = false;
+            if (slots[i].used.compare_exchange_strong(expected, true)) {
+                owner.slot = &slots[i];
+                return owner.slot;
+            }
+        }
+        fprintf(stderr, "epoch: more than %d threads read at once\n", SLOTS);
+        abort();
+
+    }
+
+    static Owner& owner() {
+        static thread_local Owner owner;
+        return owner;
+    }
+
+    Epoch(): global(1) {
+        for (int i = 0; i < SLOTS; i++) {
+            slots[i].active.store(0);
+            slots[i].used.store(false);
+        }
+    }
+
+    public:
+
+    static Epoch& instance() {
+        static Epoch epoch;
+        return epoch;
+    }
+
+    class Guard {
+        Epoch& epoch;
+        public:
+        Guard(Epoch& epoch): epoch(epoch) { epoch.enter(); }
+        ~Guard() { epoch.leave(); }
+        Guard(const Guard&) = delete;
+        Guard& operator = (const Guard&) = delete;
+    };
+
+    void enter() {
+        Owner& o = owner();
+        if (o.depth++ == 0) {
+            mine(o)->active.store(global.load());
+            // The epoch is visible to reclaim() before anything is read
+            // under it, not only in the order of the seq_cst operations.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+
+    void leave() {
+        Owner& o = owner();
+        if (--o.depth == 0)
+            o.slot->active.store(0, std::memory_order_release);
+    }
+
+    // The object must already be unreachable for new readers.
+    void retire(std::function<void()> deleter) {
+
+        uint64_t epoch = global.fetch_add(1);
+        bool full;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            retired.push_back(std::make_pair(epoch, deleter));
+            full = retired.size() >= 64;
+        }
+        if (full)
+            reclaim();
+
+    }
+
+    // Frees everything no reader can reach anymore.
+    void reclaim() {
+
+        uint64_t oldest = global.load();
+        for (int i = 0; i < SLOTS; i++) {
+            uint64_t active = slots[i].active.load();
+            if (active && active < oldest)
+                oldest = active;
+        }
+
+        std::vector<std::function<void()>> ready;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = std::partition(retired.begin(), retired.end(),
+                [oldest](const std::pair<uint64_t, std::function<void()>>& r) {
+                    return r.first >= oldest;
+                });
+            for (auto r = it; r != retired.end(); ++r)
+                ready.push_back(r->second);
+            retired.erase(it, retired.end());
+        }
+
+        for (auto& deleter : ready)
+            deleter();
+
+    }
+
+};
+
+};
@@ -0,0 +1,223 @@
+#pragma once
+
+/**
+  * Batched replies.
+  *
+  * Datagrams queued during one event loop iteration are sent together by
+  * flush() with a single sendmmsg(). Replies to the same peer are grouped
+  * and, where their sizes allow it, sent as one UDP GSO (UDP_SEGMENT)
+  * message the kernel cuts back into datagrams: every segment has the size
+  * of the first one, only the last may be shorter.
+  **/
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+namespace dns {
+
+class SendQueue {
+
+    public:
+
+    static constexpr size_t MAX_DATAGRAMS = 64;
+    static constexpr size_t MAX_SEGMENTS = 64;     // UDP_MAX_SEGMENTS
+    static constexpr size_t DATAGRAM_SIZE = 512;
+
+    private:
+
+    struct Datagram {
+        sockaddr_in to;
+        uint16_t length;
+        uint8_t data[DATAGRAM_SIZE];
+    };
+
+    int sock;
+    bool gso;
+    size_t count;
+    Datagram queue[MAX_DATAGRAMS];
+    size_t order[MAX_DATAGRAMS];
+
+    mmsghdr msgs[MAX_DATAGRAMS];
+    iovec iovs[MAX_DATAGRAMS];
+    char controls[MAX_DATAGRAMS][CMSG_SPACE(sizeof(uint16_t))];
+
+    uint64_t calls;
+    uint64_t sent;
+
+    static bool samePeer(const sockaddr_in& a, const sockaddr_in& b) {
+        return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+    }
+
+    // Fills msgs from the queue, peers grouped. Returns how many messages.
+    size_t build(bool segment) {
+
+        for (size_t i = 0; i < count; i++)
+            order[i] = i;
+        std::stable_sort(order, order + count, [this](size_t a, size_t b) {
+            const sockaddr_in& x = queue[a].to;
+            const sockaddr_in& y = queue[b].to;
+            if (x.sin_addr.s_addr != y.sin_addr.s_addr)
+                return x.sin_addr.s_addr < y.sin_addr.s_addr;
+            return x.sin_port < y.sin_port;
+        });
+
+        size_t n = 0;
+        size_t i = 0;
+
+        while (i < count) {
+
+            Datagram& first = queue[order[i]];
+            size_t segments = 1;
+
+            if (segment) {
+                while (i + segments < count && segments < MAX_SEGMENTS) {
+                    Datagram& next = queue[order[i + segments]];
+                    if (!samePeer(next.to, first.to) || next.length > first.length)
+                        break;
+                    segments++;
+                    if (next.length < first.length)
+                        break;  // a shorter one can only be the last
+                }
+            }
+
+            mmsghdr& m = msgs[n];
+            memset(&m, 0, sizeof(m));
+            m.msg_hdr.msg_name = &first.to;
+            m.msg_hdr.msg_namelen = sizeof(first.to);
+            m.msg_hdr.msg_iov = &iovs[i];
+            m.msg_hdr.msg_iovlen = segments;
+            for (size_t s = 0; s < segments; s++) {
+                Datagram& d = queue[order[i + s]];
+                iovs[i + s].iov_base = d.data;
+                iovs[i + s].iov_len = d.length;
+            }
+
+            if (segments > 1) {
+                m.msg_hdr.msg_control = controls[n];
+                m.msg_hdr.msg_controllen = sizeof(controls[n]);
+                cmsghdr* cm = CMSG_FIRSTHDR(&m.msg_hdr);
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t size = first.length;
+                memcpy(CMSG_DATA(cm), &size, sizeof(size));
+            }
+
+            n++;
+            i += segments;
+
+        }
+
+        return n;
+
+    }
+
+    public:
+
+    SendQueue(int sock, bool gso = true):
+        sock(sock), gso(gso), count(0), calls(0), sent(0) {}
+
+    SendQueue(const SendQueue&) = delete;
+    SendQueue& operator = (const SendQueue&) = delete;
+
+    // Copies the datagram, flushing first when the queue is full. Longer
+    // ones than DATAGRAM_SIZE, replies to EDNS queries, are sent right away.
+    bool push(const sockaddr_in& to, const uint8_t* data, size_t length) {
+
+        if (length > DATAGRAM_SIZE) {
+            calls++;
+            sent++;
+            return sendto(sock, data, length, 0, (const sockaddr*) &to, sizeof(to)) != -1;
+        }
+        if (count == MAX_DATAGRAMS)
+            flush();
+
+        Datagram& d = queue[count++];
+        d.to = to;
+        d.length = length;
+        memcpy(d.data, data, length);
+        return true;
+
+    }
+
+    // Sends everything queued. Returns false if a send failed, a datagram
+    // that could not be sent is dropped as a lost one would be.
+    bool flush() {
+
+        if (count == 0)
+            return true;
+
+        size_t n = build(gso);
+        size_t done = 0;
+        bool ok = true;
+
+        while (done < n) {
+
+            int r = sendmmsg(sock, msgs + done, n - done, 0);
+            calls++;
+
+            if (r > 0) {
+                done += r;
+                continue;
+            }
+            if (r == -1 && errno == EINTR)
+                continue;
+
+            // Without GSO support (EINVAL, EIO) everything still waiting is
+            // sent again one datagram per message.
+            if (gso && (errno == EINVAL || errno == EIO || errno == ENOPROTOOPT)) {
+                gso = false;
+                size_t skip = 0;
+                for (size_t m = 0; m < done; m++)
+                    skip += msgs[m].msg_hdr.msg_iovlen;
+                std::vector<Datagram> left;
+                for (size_t i = skip; i < count; i++)
+                    left.push_back(queue[order[i]]);
+                std::copy(left.begin(), left.end(), queue);
+                count = left.size();
+                sent += skip;
+                return flush();
+            }
+
+            // The first message failed, the others may still go out.
+            ok = false;
+            done++;
+
+        }
+
+        sent += count;
+        count = 0;
+        return ok;
+
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    // Send calls made and datagrams handed to them so far.
+    uint64_t syscalls() const {
+        return calls;
+    }
+
+    uint64_t datagrams() const {
+        return sent;
+    }
+
+};
+
+};
@@ -0,0 +1,435 @@
+#pragma once
+
+/**
+  * Cache shared by the server processes of a host.
+  *
+  * RRsets live in a named POSIX shared memory segment with a fixed layout
+  * and no pointers, so each process maps it wherever it likes:
+  *
+  *   header | buckets | slots
+  *
+  * A question hashes to one bucket, which guards WAYS slots with a robust
+  * process shared mutex. It is kept in the slot holding the same question,
+  * else in a free or expired one, else in the one expiring first. Slots
+  * are fixed size records:
+  *
+  *   hash, expiry, type, class, name length, data length, name,
+  *   per record: u16 length, record as Package::putAnswer() writes it
+  *
+  * RRsets that do not fit in a slot are not shared.
+  *
+  * A process dying while it holds a bucket leaves its mutex with a dead
+  * owner. The next one to lock it empties the slots of that bucket, which
+  * may be half written, and carries on, every other bucket stays warm for
+  * the worker that replaces it. The segment outlives the processes, remove
+  * /dev/shm/NAME to start cold.
+  **/
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Dns.hpp"
+
+namespace dns {
+
+class SharedCache: public CacheStore {
+
+    static constexpr const char* MAGIC = "JFFDNSM1";
+    static constexpr uint32_t WAYS = 8;
+    static constexpr size_t SLOT_BYTES = 512;
+
+    struct Header {
+        char magic[8];
+        uint32_t buckets;
+        uint32_t ways;
+        uint32_t slotBytes;
+        std::atomic<uint32_t> ready;        // set once the creator is done
+        std::atomic<uint64_t> recovered;    // buckets emptied after a crash
+    };
+
+    struct alignas(64) Bucket {
+        pthread_mutex_t lock;
+    };
+
+    struct Slot {
+        uint64_t hash;
+        int64_t expires;        // 0 when free
+        uint16_t type;
+        uint16_t klass;
+        uint16_t nameLength;
+        uint16_t dataLength;
+        uint8_t data[SLOT_BYTES - 24];
+    };
+
+    static_assert(sizeof(Slot) == SLOT_BYTES, "slots are fixed size");
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared atomics must be lock free");
+
+    int fd;
+    uint8_t* base;
+    size_t length;
+    Header* header;
+    Bucket* buckets;
+    Slot* slots;
+    uint32_t mask;
+    std::string lastError;
+
+    static size_t bucketsOffset() {
+        return (sizeof(Header) + 63) & ~(size_t) 63;
+    }
+
+    static size_t bytesFor(uint32_t count) {
+        return bucketsOffset() + count * (sizeof(Bucket) + WAYS * sizeof(Slot));
+    }
+
+    // FNV-1a, the same in every process whatever its build.
+    static uint64_t hash(const Question& q) {
+        uint64_t h = 14695981039346656037ULL;
+        for (char c : q.qName)
+            h = (h ^ (uint8_t) c) * 1099511628211ULL;
+        return h ^ (((uint64_t) q.qType << 16 | q.qClass) * 0x9E3779B97F4A7C15ULL);
+    }
+
+    bool fail(const std::string& what) {
+        lastError = what + ": " + strerror(errno);
+        return false;
+    }
+
+    bool map(size_t size) {
+        void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+            return fail("mmap");
+        base = (uint8_t*) p;
+        length = size;
+        header = (Header*) base;
+        return true;
+    }
+
+    void attach() {
+        buckets = (Bucket*) (base + bucketsOffset());
+        slots = (Slot*) (base + bucketsOffset() + header->buckets * sizeof(Bucket));
+        mask = header->buckets - 1;
+    }
+
+    bool create(size_t bytes) {
+
+        uint32_t count = 1;
+        while (bytesFor(count * 2) <= bytes && count < (1u << 30))
+            count *= 2;
+
+        if (ftruncate(fd, bytesFor(count)) != 0)
+            return fail("ftruncate");
+        if (!map(bytesFor(count)))
+            return false;
+
+        header->buckets = count;
+        header->ways = WAYS;
+        header->slotBytes = SLOT_BYTES;
+        header->recovered.store(0, std::memory_order_relaxed);
+        attach();
+
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        for (uint32_t i = 0; i < count; i++)
+            pthread_mutex_init(&buckets[i].lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+
+        // ftruncate() zeroed the slots, every one is free.
+        memcpy(header->magic, MAGIC, 8);
+        header->ready.store(1, std::memory_order_release);
+        return true;
+
+    }
+
+    // Waits a little for a creator that may still be laying it out.
+    bool open() {
+
+        struct stat st;
+        for (int tries = 0; ; tries++) {
+            if (fstat(fd, &st) != 0)
+                return fail("fstat");
+            if ((size_t) st.st_size >= bucketsOffset())
+                break;
+            if (tries == 200) {
+                lastError = "segment left empty by its creator, remove it";
+                return false;
+            }
+            usleep(10000);
+        }
+
+        if (!map(st.st_size))
+            return false;
+
+        for (int tries = 0; !header->ready.load(std::memory_order_acquire); tries++) {
+            if (tries == 200) {
+                lastError = "segment never initialized by its creator, remove it";
+                return false;
+            }
+            usleep(10000);
+        }
+
+        if (memcmp(header->magic, MAGIC, 8) != 0 || header->ways != WAYS ||
+            header->slotBytes != SLOT_BYTES || !header->buckets ||
+            (header->buckets & (header->buckets - 1)) || bytesFor(header->buckets) != length) {
+            lastError = "segment has another layout, remove it";
+            return false;
+        }
+
+        attach();
+        return true;
+
+    }
+
+    // Holds the bucket of a hash. Recovers it if its last owner died.
+    class Locked {
+
+        pthread_mutex_t* lock;
+
+        public:
+
+        Slot* ways;
+
+        Locked(SharedCache& cache, uint64_t h) {
+            uint32_t b = (h >> 32) & cache.mask;
+            lock = &cache.buckets[b].lock;
+            ways = cache.slots + (size_t) b * WAYS;
+            if (pthread_mutex_lock(lock) == EOWNERDEAD) {
+                for (uint32_t i = 0; i < WAYS; i++)
+                    ways[i].expires = 0;
+                cache.header->recovered.fetch_add(1, std::memory_order_relaxed);
+                pthread_mutex_consistent(lock);
+            }
+        }
+
+        ~Locked() {
+            pthread_mutex_unlock(lock);
+        }
+
+        Locked(const Locked&) = delete;
+        Locked& operator = (const Locked&) = delete;
+
+    };
+
+    static bool matches(const Slot& s, uint64_t h, const Question& q) {
+        return s.expires && s.hash == h && s.type == q.qType && s.klass == q.qClass &&
+            s.nameLength == q.qName.size() && memcmp(s.data, q.qName.data(), s.nameLength) == 0;
+    }
+
+    // Records of a slot copied out of it, decoded with the bucket unlocked.
+    static bool decode(const uint8_t* data, size_t size, uint32_t ttl, std::vector<Answer*>& answers) {
+
+        size_t first = answers.size();
+        try {
+            for (size_t i = 0; i + 2 <= size; ) {
+                size_t len = data[i] << 8 | data[i + 1];
+                if (i + 2 + len > size)
+                    throw FormatError("record past the end of the slot");
+                Answer* a = Package::getAnswer(data + i + 2, len);
+                if (a) {
+                    a->aTTL = ttl;
+                    answers.push_back(a);
+                }
+                i += 2 + len;
+            }
+        } catch (FormatError& e) {
+            for (size_t i = first; i < answers.size(); i++)
+                delete answers[i];
+            answers.resize(first);
+            return false;
+        }
+        return true;
+
+    }
+
+    public:
+
+    // Opens the segment called name, creating it with about bytes if it
+    // does not exist yet. An existing segment keeps its own size.
+    SharedCache(std::string name, size_t bytes):
+        fd(-1), base(NULL), length(0), header(NULL), buckets(NULL), slots(NULL), mask(0) {
+
+        if (name.empty() || name[0] != '/')
+            name = "/" + name;
+
+        fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0) {
+            if (!create(bytes))
+                shm_unlink(name.c_str());
+            return;
+        }
+        if (errno != EEXIST) {
+            fail("shm_open " + name);
+            return;
+        }
+
+        fd = shm_open(name.c_str(), O_RDWR, 0600);
+        if (fd < 0) {
+            fail("shm_open " + name);
+            return;
+        }
+        if (!open() && base) {
+            munmap(base, length);
+            base = NULL;
+        }
+
+    }
+
+    ~SharedCache() {
+        if (base)
+            munmap(base, length);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    SharedCache(const SharedCache&) = delete;
+    SharedCache& operator = (const SharedCache&) = delete;
+
+    bool ok() const {
+        return base && slots;
+    }
+
+    const std::string& error() const {
+        return lastError;
+    }
+
+    size_t capacity() const {
+        return (size_t) header->buckets * WAYS;
+    }
+
+    size_t bytes() const {
+        return length;
+    }
+
+    // Buckets emptied because a process died holding them, ever.
+    uint64_t recovered() const {
+        return header->recovered.load(std::memory_order_relaxed);
+    }
+
+    bool get(const Question& question, time_t now, std::vector<Answer*>& answers) {
+
+        uint64_t h = hash(question);
+        uint8_t data[sizeof(Slot::data)];
+        size_t size;
+        time_t expires;
+
+        {
+            Locked bucket(*this, h);
+            Slot* s = NULL;
+            for (uint32_t i = 0; i < WAYS && !s; i++)
+                if (matches(bucket.ways[i], h, question))
+                    s = &bucket.ways[i];
+            if (!s)
+                return false;
+            if (s->expires <= now) {
+                s->expires = 0;
+                return false;
+            }
+            expires = s->expires;
+            size = s->dataLength;
+            memcpy(data, s->data + s->nameLength, size);
+        }
+
+        return decode(data, size, expires - now, answers);
+
+    }
+
+    void put(const Question& question, const std::vector<Answer*>& answers, time_t expires) {
+
+        std::vector<uint8_t> data, rr;
+        for (Answer* a : answers) {
+            rr.clear();
+            Package::putAnswer(rr, a);
+            data.push_back(rr.size() >> 8);
+            data.push_back(rr.size());
+            data.insert(data.end(), rr.begin(), rr.end());
+        }
+        if (question.qName.size() + data.size() > sizeof(Slot::data))
+            return;
+
+        uint64_t h = hash(question);
+        time_t now = time(NULL);
+        Locked bucket(*this, h);
+
+        Slot* target = NULL;
+        for (uint32_t i = 0; i < WAYS && !target; i++)
+            if (matches(bucket.ways[i], h, question))
+                target = &bucket.ways[i];
+        for (uint32_t i = 0; i < WAYS && !target; i++)
+            if (bucket.ways[i].expires <= now)
+                target = &bucket.ways[i];
+        if (!target) {
+            target = &bucket.ways[0];
+            for (uint32_t i = 1; i < WAYS; i++)
+                if (bucket.ways[i].expires < target->expires)
+                    target = &bucket.ways[i];
+        }
+
+        target->hash = h;
+        target->type = question.qType;
+        target->klass = question.qClass;
+        target->nameLength = question.qName.size();
+        target->dataLength = data.size();
+        memcpy(target->data, question.qName.data(), question.qName.size());
+        memcpy(target->data + question.qName.size(), data.data(), data.size());
+        target->expires = expires;
+
+    }
+
+    void forEach(time_t now,
+        const std::function<void(const Question&, const std::vector<Answer*>&, time_t)>& f) {
+
+        struct Copy {
+            Question question;
+            time_t expires;
+            std::vector<uint8_t> data;
+        };
+
+        for (uint32_t b = 0; b <= mask; b++) {
+
+            std::vector<Copy> copies;
+            {
+                Locked bucket(*this, (uint64_t) b << 32);
+                for (uint32_t i = 0; i < WAYS; i++) {
+                    Slot& s = bucket.ways[i];
+                    if (s.expires <= now)
+                        continue;
+                    copies.push_back(Copy{
+                        Question(std::string((const char*) s.data, s.nameLength), s.type, s.klass),
+                        (time_t) s.expires,
+                        std::vector<uint8_t>(s.data + s.nameLength, s.data + s.nameLength + s.dataLength) });
+                }
+            }
+
+            for (Copy& c : copies) {
+                std::vector<Answer*> answers;
+                if (decode(c.data.data(), c.data.size(), c.expires - now, answers))
+                    f(c.question, answers, c.expires);
+                for (Answer* a : answers)
+                    delete a;
+            }
+
+        }
+
+    }
+
+    void expire(time_t now) {
+        for (uint32_t b = 0; b <= mask; b++) {
+            Locked bucket(*this, (uint64_t) b << 32);
+            for (uint32_t i = 0; i < WAYS; i++)
+                if (bucket.ways[i].expires <= now)
+                    bucket.ways[i].expires = 0;
+        }
+    }
+
+};
+
+};
@@ -0,0 +1,477 @@
+#pragma once
+
+/**
+  * Heavy hitters of the query stream in constant memory.
+  *
+  * A Count-Min sketch counts every key in DEPTH rows of counters, the
+  * estimate being the smallest of its counters, never below the true
+  * count. Updates are conservative: only the counters at the minimum are
+  * raised, which keeps the overestimate small.
+  *
+  * TopK keeps the k heaviest keys Space-Saving style: a tracked key counts
+  * up in its slot only, an untracked one in the sketch, and replaces the
+  * lightest slot once the sketch says it is heavier, so the stream of
+  * one-off keys costs a sketch update and no slot churn. Counts are upper
+  * bounds.
+  *
+  * Each thread has its own HeavyHitters for query names, client /24s and
+  * NXDOMAIN names, so the hot path shares nothing. Counts are halved every
+  * window, tick() starting one, which each thread applies on its next
+  * query: a key's weight halves every window it does not show up in.
+  * dump() merges every thread.
+  *
+  * TinyLfu is a sketch shared by the threads, of small atomic counters,
+  * fed once per client question and name of its CNAME chain, hit or miss.
+  * The cache takes an RRset in only once its name was asked threshold
+  * times in the window, one-hit wonders never make it in.
+  **/
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+
+#include "Dns.hpp"
+
+namespace dns {
+
+template <class Counter>
+class CountMin {
+
+    static constexpr int DEPTH = 4;
+
+    std::unique_ptr<Counter[]> counters;
+    size_t mask;
+
+    static uint32_t load(const uint32_t& c) {
+        return c;
+    }
+
+    static void store(uint32_t& c, uint32_t v) {
+        c = v;
+    }
+
+    // Shared by threads: racing increments may be lost, fine for a sketch.
+    // Saturated counters, those of the names hit most, are not written
+    // again, so their lines stay shared between the readers' caches.
+    static uint32_t load(const std::atomic<uint8_t>& c) {
+        return c.load(std::memory_order_relaxed);
+    }
+
+    static void store(std::atomic<uint8_t>& c, uint32_t v) {
+        if (v <= 255)
+            c.store(v, std::memory_order_relaxed);
+    }
+
+    // Column of row for h, two halves of the hash combined per row.
+    size_t column(uint64_t h, int row) const {
+        uint64_t step = (h >> 32) | 1;
+        return ((h + row * step) & mask) + row * (mask + 1);
+    }
+
+    public:
+
+    // width is rounded up to a power of two.
+    CountMin(size_t width) {
+        size_t size = 64;
+        while (size < width)
+            size <<= 1;
+        mask = size - 1;
+        counters.reset(new Counter[size * DEPTH]);
+        for (size_t i = 0; i < size * DEPTH; i++)
+            store(counters[i], 0);
+    }
+
+    // Counts h once more and returns its new estimate.
+    uint32_t add(uint64_t h) {
+        uint32_t least = estimate(h);
+        for (int row = 0; row < DEPTH; row++) {
+            Counter& c = counters[column(h, row)];
+            if (load(c) == least)
+                store(c, least + 1);
+        }
+        return least + 1;
+    }
+
+    uint32_t estimate(uint64_t h) const {
+        uint32_t least = UINT32_MAX;
+        for (int row = 0; row < DEPTH; row++)
+            least = std::min(least, load(counters[column(h, row)]));
+        return least;
+    }
+
+    void halve() {
+        for (size_t i = 0; i < (mask + 1) * DEPTH; i++)
+            store(counters[i], load(counters[i]) >> 1);
+    }
+
+    size_t memory() const {
+        return (mask + 1) * DEPTH * sizeof(Counter);
+    }
+
+};
+
+class TopK {
+
+    struct Slot {
+        uint64_t hash;
+        std::atomic<uint32_t> count;
+        std::string key;
+    };
+
+    CountMin<uint32_t> sketch;
+    std::unique_ptr<Slot[]> slots;
+    size_t capacity, used;
+    std::vector<int> index;     // slot of a hash, linear probing, -1 empty
+    uint32_t floor;             // lightest slot once full, maybe stale low
+    std::mutex lock;            // held to change slots and to read them
+
+    int find(uint64_t h) const {
+        size_t mask = index.size() - 1;
+        for (size_t i = h & mask; index[i] >= 0; i = (i + 1) & mask)
+            if (slots[index[i]].hash == h)
+                return index[i];
+        return -1;
+    }
+
+    void link(uint64_t h, int slot) {
+        size_t mask = index.size() - 1;
+        size_t i = h & mask;
+        while (index[i] >= 0)
+            i = (i + 1) & mask;
+        index[i] = slot;
+    }
+
+    // Backward shift, as in Names.
+    void unlink(uint64_t h) {
+        size_t mask = index.size() - 1;
+        size_t i = h & mask;
+        while (slots[index[i]].hash != h)
+            i = (i + 1) & mask;
+        for (size_t j = (i + 1) & mask; index[j] >= 0; j = (j + 1) & mask) {
+            size_t home = slots[index[j]].hash & mask;
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                index[i] = index[j];
+                i = j;
+            }
+        }
+        index[i] = -1;
+    }
+
+    // Called with the lock held.
+    size_t lightest() const {
+        size_t least = 0;
+        for (size_t i = 1; i < used; i++)
+            if (slots[i].count.load(std::memory_order_relaxed) < slots[least].count.load(std::memory_order_relaxed))
+                least = i;
+        return least;
+    }
+
+    public:
+
+    TopK(size_t k, size_t width):
+        sketch(width), slots(new Slot[k]), capacity(k), used(0), floor(0) {
+        size_t size = 16;
+        while (size < k * 2)
+            size <<= 1;
+        index.assign(size, -1);
+    }
+
+    TopK(const TopK&) = delete;
+    TopK& operator = (const TopK&) = delete;
+
+    // Counts the key of hash h. key() spells it, called only when the key
+    // takes a slot. Only the owning thread adds.
+    template <class Key>
+    void add(uint64_t h, Key key) {
+
+        int slot = find(h);
+        if (slot >= 0) {
+            std::atomic<uint32_t>& count = slots[slot].count;
+            count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return;
+        }
+        uint32_t estimate = sketch.add(h);
+        if (used == capacity && estimate <= floor)
+            return;
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (used < capacity) {
+            slot = used++;
+        } else {
+            slot = lightest();
+            uint32_t least = slots[slot].count.load(std::memory_order_relaxed);
+            if (estimate <= least) {
+                floor = least;
+                return;
+            }
+            unlink(slots[slot].hash);
+        }
+        slots[slot].hash = h;
+        slots[slot].count.store(estimate, std::memory_order_relaxed);
+        slots[slot].key = key();
+        link(h, slot);
+        if (used == capacity)
+            floor = slots[lightest()].count.load(std::memory_order_relaxed);
+
+    }
+
+    // Halves the sketch and the slots, by the owning thread.
+    void decay() {
+        sketch.halve();
+        std::lock_guard<std::mutex> guard(lock);
+        for (size_t i = 0; i < used; i++)
+            slots[i].count.store(slots[i].count.load(std::memory_order_relaxed) >> 1, std::memory_order_relaxed);
+        floor = used == capacity ? slots[lightest()].count.load(std::memory_order_relaxed) : 0;
+    }
+
+    // Adds the tracked keys and their counts to totals, from any thread.
+    void collect(std::map<std::string, uint64_t>& totals) {
+        std::lock_guard<std::mutex> guard(lock);
+        for (size_t i = 0; i < used; i++)
+            totals[slots[i].key] += slots[i].count.load(std::memory_order_relaxed);
+    }
+
+    // By the owning thread.
+    uint32_t estimate(uint64_t h) const {
+        int slot = find(h);
+        return slot >= 0 ? slots[slot].count.load(std::memory_order_relaxed) : sketch.estimate(h);
+    }
+
+    size_t memory() const {
+        return sketch.memory() + capacity * sizeof(Slot) + index.size() * sizeof(int);
+    }
+
+};
+
+class HeavyHitters {
+
+    // Sketch columns per row: error about 2/WIDTH of the window's count.
+    static constexpr size_t WIDTH = 4096;
+
+    TopK names, clients, nxdomains;
+    uint32_t window;
+
+    static size_t& capacity() {
+        static size_t k = 0;
+        return k;
+    }
+
+    static std::atomic<uint32_t>& clock() {
+        static std::atomic<uint32_t> windows(0);
+        return windows;
+    }
+
+    static std::mutex& registryLock() {
+        static std::mutex lock;
+        return lock;
+    }
+
+    static std::vector<HeavyHitters*>& registry() {
+        static std::vector<HeavyHitters*> all;
+        return all;
+    }
+
+    // Eight bytes of a name with A-Z folded to lower case, all at once.
+    static uint64_t fold(uint64_t x) {
+        uint64_t low = x & 0x7F7F7F7F7F7F7F7FULL;
+        uint64_t upper = (low + 0x3F3F3F3F3F3F3F3FULL) & ~(low + 0x2525252525252525ULL) & ~x & 0x8080808080808080ULL;
+        return x | upper >> 2;
+    }
+
+    // Hash of the question name, case folded, eight bytes a step, and its
+    // length in the query. 0 length if it runs past the end.
+    static uint64_t hashName(const uint8_t* query, size_t len, size_t& size) {
+
+        size_t p = 12;
+        while (p < len && query[p] && query[p] < 64)
+            p += query[p] + 1;
+        if (p >= len || query[p]) {
+            size = 0;
+            return 0;
+        }
+        size = p - 12;
+
+        uint64_t h = size * 0x9E3779B97F4A7C15ULL;
+        for (size_t i = 0; i < size; i += 8) {
+            // Whole words while the datagram has them, the bytes past the
+            // name masked off.
+            uint64_t word = 0;
+            if (12 + i + 8 <= len)
+                memcpy(&word, query + 12 + i, 8);
+            else
+                for (size_t j = 0; j < 8 && 12 + i + j < len; j++)
+                    word |= (uint64_t) query[12 + i + j] << (8 * j);
+            if (size - i < 8)
+                word &= ~0ULL >> (8 * (8 - (size - i)));
+            h = (h ^ fold(word)) * 0xff51afd7ed558ccdULL;
+            h ^= h >> 32;
+        }
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        return h ^ h >> 33;
+
+    }
+
+    static std::string spell(const uint8_t* name) {
+        std::string text;
+        for (const uint8_t* p = name; *p; p += *p + 1) {
+            if (!text.empty())
+                text += '.';
+            for (int i = 1; i <= *p; i++)
+                text += tolower(p[i]);
+        }
+        return text;
+    }
+
+    void catchUp() {
+        uint32_t now = clock().load(std::memory_order_relaxed);
+        // More than a few windows behind halves everything to 0 anyway.
+        for (int i = 0; window != now && i < 32; i++, window++) {
+            names.decay();
+            clients.decay();
+            nxdomains.decay();
+        }
+        window = now;
+    }
+
+    static void print(FILE* out, const char* title, const std::map<std::string, uint64_t>& totals) {
+        std::vector<std::pair<uint64_t, std::string>> sorted;
+        for (const auto& entry : totals)
+            if (entry.second)
+                sorted.push_back(std::make_pair(entry.second, entry.first));
+        std::sort(sorted.rbegin(), sorted.rend());
+        if (sorted.size() > capacity())
+            sorted.resize(capacity());
+        fprintf(out, "%s:\n", title);
+        for (const auto& entry : sorted)
+            fprintf(out, "  %10lu  %s\n", (unsigned long) entry.first, entry.second.c_str());
+    }
+
+    HeavyHitters(size_t k):
+        names(k, WIDTH), clients(k, WIDTH), nxdomains(k, WIDTH), window(clock().load()) {}
+
+    public:
+
+    // Tracks the k heaviest of each kind from now on, in every thread.
+    static void enable(size_t k) {
+        capacity() = k;
+    }
+
+    // The trackers of the calling thread, NULL when tracking is off.
+    static HeavyHitters* local() {
+        static thread_local HeavyHitters* hitters = NULL;
+        if (!capacity())
+            return NULL;
+        if (!hitters) {
+            hitters = new HeavyHitters(capacity());
+            std::lock_guard<std::mutex> guard(registryLock());
+            registry().push_back(hitters);
+        }
+        return hitters;
+    }
+
+    // Starts a window: every count is halved before the next one is taken.
+    static void tick() {
+        clock().fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // A query from client, in network order, on the wire.
+    void query(const uint8_t* wire, size_t len, uint32_t client) {
+
+        catchUp();
+
+        size_t size;
+        uint64_t h = hashName(wire, len, size);
+        if (size)
+            names.add(h, [wire]() { return spell(wire + 12); });
+
+        uint32_t prefix = ntohl(client) & 0xFFFFFF00;
+        uint64_t c = (prefix + 1) * 0x9E3779B97F4A7C15ULL;
+        clients.add(c ^ c >> 29, [prefix]() {
+            char text[INET_ADDRSTRLEN + 3];
+            uint32_t addr = htonl(prefix);
+            inet_ntop(AF_INET, &addr, text, INET_ADDRSTRLEN);
+            return std::string(text) + "/24";
+        });
+
+    }
+
+    // A query answered NXDOMAIN.
+    void nxdomain(const uint8_t* wire, size_t len) {
+        size_t size;
+        uint64_t h = hashName(wire, len, size);
+        if (size)
+            nxdomains.add(h, [wire]() { return spell(wire + 12); });
+    }
+
+    // Estimated count of the query name in the window.
+    uint32_t estimate(const uint8_t* wire, size_t len) {
+        size_t size;
+        return names.estimate(hashName(wire, len, size));
+    }
+
+    // The heaviest keys of every kind over all threads.
+    static void dump(FILE* out) {
+
+        std::map<std::string, uint64_t> names, clients, nxdomains;
+        size_t memory = 0;
+        {
+            std::lock_guard<std::mutex> guard(registryLock());
+            for (HeavyHitters* h : registry()) {
+                h->names.collect(names);
+                h->clients.collect(clients);
+                h->nxdomains.collect(nxdomains);
+                memory += h->names.memory() + h->clients.memory() + h->nxdomains.memory();
+            }
+        }
+
+        fprintf(out, "heavy hitters, top %zu, counts halved every window (%zu bytes):\n", capacity(), memory);
+        print(out, "names", names);
+        print(out, "clients", clients);
+        print(out, "nxdomain", nxdomains);
+        fflush(out);
+
+    }
+
+};
+
+class TinyLfu: public Admission {
+
+    CountMin<std::atomic<uint8_t>> sketch;
+    uint32_t threshold;
+
+    public:
+
+    // Admits RRsets whose name was looked up threshold times or more. width
+    // around the number of names cached in a window keeps mistakes rare.
+    TinyLfu(uint32_t threshold, size_t width = 1 << 16): sketch(width), threshold(threshold) {}
+
+    void record(size_t hash) override {
+        sketch.add(hash);
+    }
+
+    bool admit(size_t hash) override {
+        return sketch.estimate(hash) >= threshold;
+    }
+
+    // Starts a window, from any thread.
+    void decay() {
+        sketch.halve();
+    }
+
+    size_t memory() const {
+        return sketch.memory();
+    }
+
+};
+
+};
@@ -0,0 +1,198 @@
+#pragma once
+
+/**
+  * Cache snapshots for warm restarts.
+  *
+  * Layout, all integers big endian:
+  *
+  *   "JFFDNSC1"
+  *   per element:
+  *     u8 name length, name, u16 type, u16 class, u64 absolute expiry,
+  *     u16 record count, per record: u16 length, record in wire format
+  *
+  * Expiry times are absolute, so TTLs keep counting down while the server
+  * is stopped and elements that expired in between are dropped on load.
+  **/
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Dns.hpp"
+
+namespace dns {
+
+class Snapshot {
+
+    static constexpr const char* MAGIC = "JFFDNSC1";
+
+    static void put(std::vector<uint8_t>& out, uint64_t value, int bytes) {
+        for (int i = bytes - 1; i >= 0; i--)
+            out.push_back(value >> (8 * i));
+    }
+
+    static bool get(std::istream& in, uint64_t& value, int bytes) {
+        uint8_t buf[8];
+        if (!in.read((char*) buf, bytes))
+            return false;
+        value = 0;
+        for (int i = 0; i < bytes; i++)
+            value = (value << 8) | buf[i];
+        return true;
+    }
+
+    public:
+
+    // Writes every element that can still expire. Returns how many.
+    static size_t save(Cache& cache, std::ostream& out) {
+
+        size_t count = 0;
+        std::vector<uint8_t> buf;
+
+        out.write(MAGIC, 8);
+
+        cache.forEach([&](const Question& q, const std::vector<Answer*>& answers, time_t expires) {
+
+            if (q.qName.size() > MAX_NAME || answers.size() > 0xFFFF)
+                return;
+
+            buf.clear();
+            put(buf, q.qName.size(), 1);
+            buf.insert(buf.end(), q.qName.begin(), q.qName.end());
+            put(buf, q.qType, 2);
+            put(buf, q.qClass, 2);
+            put(buf, expires, 8);
+            put(buf, answers.size(), 2);
+
+            std::vector<uint8_t> rr;
+            for (Answer* a : answers) {
+                rr.clear();
+                Package::putAnswer(rr, a);
+                put(buf, rr.size(), 2);
+                buf.insert(buf.end(), rr.begin(), rr.end());
+            }
+
+            out.write((const char*) buf.data(), buf.size());
+            count++;
+
+        });
+
+        out.flush();
+        return count;
+
+    }
+
+    // Loads elements until the end of the stream or the first corrupt one,
+    // skipping the expired ones. Returns how many were loaded.
+    static size_t load(Cache& cache, std::istream& in) {
+
+        char magic[8];
+        if (!in.read(magic, 8) || memcmp(magic, MAGIC, 8) != 0)
+            return 0;
+
+        size_t count = 0;
+        time_t now = time(NULL);
+        std::vector<uint8_t> rr;
+
+        while (true) {
+
+            uint64_t len, type, klass, expires, records;
+            if (!get(in, len, 1))
+                break;
+
+            std::string name(len, '\0');
+            if (!in.read(&name[0], len) ||
+                !get(in, type, 2) || !get(in, klass, 2) ||
+                !get(in, expires, 8) || !get(in, records, 2))
+                break;
+
+            std::vector<Answer*> answers;
+            bool ok = true;
+
+            for (uint64_t i = 0; i < records && ok; i++) {
+                uint64_t size;
+                ok = get(in, size, 2);
+                if (!ok)
+                    break;
+                rr.resize(size);
+                ok = (bool) in.read((char*) rr.data(), size);
+                if (!ok)
+                    break;
+                try {
+                    Answer* a = Package::getAnswer(rr.data(), rr.size());
+                    if (a)
+                        answers.push_back(a);
+                } catch (FormatError& e) {
+                    ok = false;
+                }
+            }
+
+            if (!ok) {
+                for (Answer* a : answers)
+                    delete a;
+                break;
+            }
+
+            if ((time_t) expires <= now) {
+                for (Answer* a : answers)
+                    delete a;
+                continue;
+            }
+
+            cache.set(Question(name, type, klass), answers, expires);
+            count++;
+
+        }
+
+        return count;
+
+    }
+
+    // Flushes the data of path to disk.
+    static bool sync(const std::string& path, int flags) {
+        int fd = open(path.c_str(), flags);
+        if (fd < 0)
+            return false;
+        bool synced = fsync(fd) == 0;
+        close(fd);
+        return synced;
+    }
+
+    // Written to a temporary file first and synced before it replaces the
+    // snapshot, a crash never leaves a half written one behind.
+    static bool save(Cache& cache, const std::string& path) {
+
+        std::string tmp = path + ".tmp";
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out.is_open())
+            return false;
+
+        save(cache, out);
+        out.flush();
+        out.close();
+        if (out.fail() || !sync(tmp, O_WRONLY) || rename(tmp.c_str(), path.c_str()) != 0) {
+            remove(tmp.c_str());
+            return false;
+        }
+
+        // And the rename itself, in the directory.
+        size_t slash = path.rfind('/');
+        sync(slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash), O_RDONLY | O_DIRECTORY);
+        return true;
+
+    }
+
+    static size_t load(Cache& cache, const std::string& path) {
+
+        std::ifstream in(path, std::ios::binary);
+        if (!in.is_open())
+            return 0;
+        return load(cache, in);
+
+    }
+
+};
+
+};
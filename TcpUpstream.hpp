@@ -0,0 +1,281 @@
+#pragma once
+
+/**
+  * Upstream queries over persistent, pipelined TCP connections (RFC 7766).
+  *
+  * Each upstream gets CONNECTIONS connections, opened on first use and
+  * again whenever the server closes them. A query is written on the one
+  * with the fewest queries in flight, under an ID unique on it, and the
+  * caller sleeps until a reader thread, one per connection, gets the
+  * reply with that ID, in whatever order the server sends them:
+  *
+  *   caller:  frame query, new ID -> write -> wait
+  *   reader:  read frame -> pending[ID] -> copy reply, old ID -> wake
+  *
+  * When a connection breaks, its queries in flight are retried once on a
+  * fresh one. A reply that does not come in RELAY_TIMEOUT is given up.
+  **/
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "Dns.hpp"
+
+namespace dns {
+
+class TcpUpstream: public Upstream {
+
+    static constexpr int CONNECTIONS = 2;
+
+    struct Pending {
+        uint16_t id;            // the caller's
+        uint8_t* res;
+        ssize_t length;
+        bool done;
+        std::condition_variable wake;
+    };
+
+    struct Connection {
+        std::mutex lock;        // guards everything below
+        sockaddr_in server;
+        int fd = -1;
+        uint16_t next = 0;
+        std::unordered_map<uint16_t, Pending*> pending;
+        std::thread reader;
+        std::condition_variable closed;
+        unsigned closes = 0;
+    };
+
+    std::mutex lock;            // guards pools
+    std::map<uint64_t, std::vector<Connection*>> pools;
+    std::atomic<uint64_t> queries, connects, retries;
+
+    static bool readFull(int fd, uint8_t* buffer, size_t size) {
+        while (size) {
+            ssize_t n = recv(fd, buffer, size, 0);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR)
+                    continue;
+                return false;
+            }
+            buffer += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    static bool writeFull(int fd, const uint8_t* buffer, size_t size) {
+        while (size) {
+            ssize_t n = send(fd, buffer, size, MSG_NOSIGNAL);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR)
+                    continue;
+                return false;
+            }
+            buffer += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    // Hands replies to their callers until the connection breaks, then
+    // fails whatever is still in flight.
+    static void read(Connection* c, int fd) {
+
+        std::vector<uint8_t> reply(TCP_BUF_SIZE);
+        uint8_t length[2];
+
+        while (readFull(fd, length, 2)) {
+            size_t size = length[0] << 8 | length[1];
+            if (size < 12 || !readFull(fd, reply.data(), size))
+                break;
+            std::lock_guard<std::mutex> guard(c->lock);
+            auto it = c->pending.find(reply[0] << 8 | reply[1]);
+            if (it == c->pending.end())
+                continue;       // given up already
+            Pending* p = it->second;
+            memcpy(p->res, reply.data(), size);
+            p->res[0] = p->id >> 8;
+            p->res[1] = p->id;
+            p->length = size;
+            p->done = true;
+            p->wake.notify_one();
+            c->pending.erase(it);
+        }
+
+        std::lock_guard<std::mutex> guard(c->lock);
+        c->fd = -1;
+        close(fd);
+        c->closes++;
+        c->closed.notify_all();
+        for (auto& entry : c->pending) {
+            entry.second->done = true;
+            entry.second->wake.notify_one();
+        }
+        c->pending.clear();
+
+    }
+
+    // With c locked. Opens the connection if it is not open.
+    bool open(Connection* c) {
+
+        if (c->fd >= 0)
+            return true;
+        if (c->reader.joinable())
+            c->reader.join();
+
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            return false;
+        // connect() gives up after SO_SNDTIMEO too.
+        timeval timeout = { RELAY_TIMEOUT, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(fd, (struct sockaddr*) &c->server, sizeof(sockaddr_in)) == -1) {
+            close(fd);
+            return false;
+        }
+
+        c->fd = fd;
+        c->reader = std::thread(read, c, fd);
+        connects++;
+        return true;
+
+    }
+
+    std::vector<Connection*>& pool(const sockaddr_in& server) {
+
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<Connection*>& connections =
+            pools[(uint64_t) server.sin_addr.s_addr << 16 | server.sin_port];
+        if (connections.empty()) {
+            for (int i = 0; i < CONNECTIONS; i++) {
+                connections.push_back(new Connection());
+                connections.back()->server = server;
+            }
+        }
+        return connections;
+
+    }
+
+    // Returns the reply length, -1 on timeout, -2 if the connection broke
+    // before the reply came.
+    ssize_t attempt(Connection* c, const std::vector<uint8_t>& query, uint8_t* res) {
+
+        Pending p;
+        p.id = query[0] << 8 | query[1];
+        p.res = res;
+        p.length = -2;
+        p.done = false;
+
+        std::unique_lock<std::mutex> guard(c->lock);
+        if (!open(c))
+            return -1;
+
+        uint16_t id;
+        do {
+            id = c->next++;
+        } while (c->pending.count(id));
+
+        std::vector<uint8_t> frame(query.size() + 2);
+        frame[0] = query.size() >> 8;
+        frame[1] = query.size();
+        memcpy(frame.data() + 2, query.data(), query.size());
+        frame[2] = id >> 8;
+        frame[3] = id;
+
+        c->pending[id] = &p;
+        if (!writeFull(c->fd, frame.data(), frame.size())) {
+            // The reader sees it too, fails the others and closes it.
+            // Another caller may have reconnected by the time we wake.
+            unsigned closes = c->closes;
+            c->pending.erase(id);
+            shutdown(c->fd, SHUT_RDWR);
+            c->closed.wait(guard, [c, closes]() { return c->closes != closes; });
+            return -2;
+        }
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(RELAY_TIMEOUT);
+        if (!p.wake.wait_until(guard, deadline, [&p]() { return p.done; })) {
+            c->pending.erase(id);
+            return -1;
+        }
+        return p.length;
+
+    }
+
+    public:
+
+    struct Stats {
+        uint64_t queries, connects, retries;
+    };
+
+    TcpUpstream(): queries(0), connects(0), retries(0) {}
+
+    ~TcpUpstream() {
+        for (auto& entry : pools) {
+            for (Connection* c : entry.second) {
+                {
+                    std::lock_guard<std::mutex> guard(c->lock);
+                    if (c->fd >= 0)
+                        shutdown(c->fd, SHUT_RDWR);
+                }
+                if (c->reader.joinable())
+                    c->reader.join();
+                delete c;
+            }
+        }
+    }
+
+    TcpUpstream(const TcpUpstream&) = delete;
+    TcpUpstream& operator = (const TcpUpstream&) = delete;
+
+    ssize_t exchange(const std::vector<uint8_t>& query, const sockaddr_in& server, uint8_t* res) override {
+
+        if (query.size() < 12 || query.size() > TCP_BUF_SIZE)
+            return -1;
+        queries++;
+
+        std::vector<Connection*>& connections = pool(server);
+
+        // The one with the fewest queries waiting, racy but only a hint.
+        Connection* best = connections[0];
+        size_t least = SIZE_MAX;
+        for (Connection* c : connections) {
+            std::lock_guard<std::mutex> guard(c->lock);
+            size_t load = c->fd < 0 ? 0 : c->pending.size();
+            if (load < least) {
+                least = load;
+                best = c;
+            }
+        }
+
+        ssize_t l = attempt(best, query, res);
+        if (l == -2) {
+            retries++;
+            l = attempt(best, query, res);
+        }
+        return l < 0 ? -1 : l;
+
+    }
+
+    Stats stats() const {
+        return Stats{ queries, connects, retries };
+    }
+
+};
+
+};
@@ -0,0 +1,346 @@
+#pragma once
+
+/**
+  * Latency tracing of the query path.
+  *
+  * Each thread gets its own Tracer with one histogram per stage, so the
+  * hot path never shares a cache line. Histograms are log-linear like HDR
+  * ones: 16 buckets per power of two, every value within 6.25%. Queries
+  * slower than the threshold are kept whole, stage by stage, in a ring of
+  * the latest ones. dump() merges every thread into one report.
+  *
+  * Tracing off costs one thread local load and a branch per hook.
+  **/
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+
+namespace dns {
+
+class Histogram {
+
+    static constexpr int SUB_BITS = 4;
+    static constexpr int SUBS = 1 << SUB_BITS;
+    static constexpr size_t SIZE = (64 - SUB_BITS + 1) * SUBS;
+
+    // Written by one thread, read by dump() from another one.
+    std::atomic<uint64_t> counts[SIZE];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> largest;
+
+    static size_t index(uint64_t v) {
+        if (v < SUBS)
+            return v;
+        int e = 63 - __builtin_clzll(v);
+        return (e - SUB_BITS + 1) * SUBS + ((v >> (e - SUB_BITS)) & (SUBS - 1));
+    }
+
+    // Middle of the values bucket i holds.
+    static uint64_t value(size_t i) {
+        if (i < SUBS)
+            return i;
+        int e = i / SUBS + SUB_BITS - 1;
+        uint64_t low = (uint64_t) (SUBS + i % SUBS) << (e - SUB_BITS);
+        return low + ((uint64_t) 1 << (e - SUB_BITS)) / 2;
+    }
+
+    static void add(std::atomic<uint64_t>& counter, uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    public:
+
+    Histogram() {
+        for (std::atomic<uint64_t>& c : counts)
+            c.store(0, std::memory_order_relaxed);
+        total.store(0, std::memory_order_relaxed);
+        largest.store(0, std::memory_order_relaxed);
+    }
+
+    // Only from the owning thread.
+    void record(uint64_t v) {
+        add(counts[index(v)], 1);
+        add(total, 1);
+        if (v > largest.load(std::memory_order_relaxed))
+            largest.store(v, std::memory_order_relaxed);
+    }
+
+    void merge(const Histogram& other) {
+        for (size_t i = 0; i < SIZE; i++)
+            add(counts[i], other.counts[i].load(std::memory_order_relaxed));
+        add(total, other.total.load(std::memory_order_relaxed));
+        if (other.largest.load(std::memory_order_relaxed) > largest.load(std::memory_order_relaxed))
+            largest.store(other.largest.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    uint64_t count() const {
+        return total.load(std::memory_order_relaxed);
+    }
+
+    uint64_t max() const {
+        return largest.load(std::memory_order_relaxed);
+    }
+
+    // Value below which a fraction q of the recorded ones fall.
+    uint64_t percentile(double q) const {
+        uint64_t n = count();
+        if (n == 0)
+            return 0;
+        uint64_t rank = (uint64_t) (q * n);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < SIZE; i++) {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen > rank)
+                return std::min(value(i), max());
+        }
+        return max();
+    }
+
+};
+
+class Tracer {
+
+    public:
+
+    enum Stage {
+        Recv,       // per recvmmsg() call
+        Parse,
+        Resolve,    // Lookup and Relay included
+        Lookup,
+        Relay,
+        Dump,
+        Send,       // per sendmmsg() flush
+        Total,      // Parse to Dump of one query
+        STAGES
+    };
+
+    static constexpr size_t RING = 64;
+
+    struct Slow {
+        time_t when;
+        uint32_t client;
+        char name[64];
+        uint16_t type;
+        uint8_t rcode;
+        uint64_t ns[STAGES];
+    };
+
+    private:
+
+    Histogram histograms[STAGES];
+    std::mutex ringLock;
+    Slow ring[RING];
+    size_t slowCount;
+
+    static bool& enabledFlag() {
+        static bool enabled = false;
+        return enabled;
+    }
+
+    static uint64_t& threshold() {
+        static uint64_t ns = 0;
+        return ns;
+    }
+
+    static std::mutex& registryLock() {
+        static std::mutex lock;
+        return lock;
+    }
+
+    static std::vector<Tracer*>& registry() {
+        static std::vector<Tracer*> tracers;
+        return tracers;
+    }
+
+    Tracer(): slowCount(0) {}
+
+    public:
+
+    // Turns tracing on for every thread. Queries taking slowUs or more are
+    // kept in the ring, 0 keeps none.
+    static void enable(uint64_t slowUs) {
+        threshold() = slowUs * 1000;
+        enabledFlag() = true;
+    }
+
+    static uint64_t now() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    // The tracer of the calling thread, NULL when tracing is off.
+    static Tracer* local() {
+        static thread_local Tracer* tracer = NULL;
+        if (!enabledFlag())
+            return NULL;
+        if (!tracer) {
+            tracer = new Tracer();
+            std::lock_guard<std::mutex> guard(registryLock());
+            registry().push_back(tracer);
+        }
+        return tracer;
+    }
+
+    void record(Stage stage, uint64_t ns) {
+        histograms[stage].record(ns);
+    }
+
+    // True if a query of ns should be kept by slow().
+    bool isSlow(uint64_t ns) const {
+        return threshold() && ns >= threshold();
+    }
+
+    void slow(const Slow& trace) {
+        std::lock_guard<std::mutex> guard(ringLock);
+        ring[slowCount++ % RING] = trace;
+    }
+
+    // Percentiles of every stage over all threads, then the slow queries.
+    static void dump(FILE* out) {
+
+        static const char* names[STAGES] = {
+            "recv", "parse", "resolve", "lookup", "relay", "dump", "send", "total" };
+
+        std::lock_guard<std::mutex> guard(registryLock());
+
+        Histogram* merged = new Histogram[STAGES];
+        std::vector<Slow> slow;
+        for (Tracer* t : registry()) {
+            for (int s = 0; s < STAGES; s++)
+                merged[s].merge(t->histograms[s]);
+            std::lock_guard<std::mutex> ring(t->ringLock);
+            size_t first = t->slowCount > RING ? t->slowCount - RING : 0;
+            for (size_t i = first; i < t->slowCount; i++)
+                slow.push_back(t->ring[i % RING]);
+        }
+
+        fprintf(out, "%-8s %10s %9s %9s %9s %9s %9s  (us)\n",
+            "stage", "count", "p50", "p90", "p99", "p99.9", "max");
+        for (int s = 0; s < STAGES; s++)
+            fprintf(out, "%-8s %10lu %9.1f %9.1f %9.1f %9.1f %9.1f\n", names[s],
+                (unsigned long) merged[s].count(),
+                merged[s].percentile(0.5) / 1e3, merged[s].percentile(0.9) / 1e3,
+                merged[s].percentile(0.99) / 1e3, merged[s].percentile(0.999) / 1e3,
+                merged[s].max() / 1e3);
+        delete[] merged;
+
+        std::sort(slow.begin(), slow.end(), [](const Slow& a, const Slow& b) {
+            return a.when < b.when;
+        });
+        fprintf(out, "slow queries (%lu us or more), latest %zu:\n",
+            (unsigned long) (threshold() / 1000), slow.size());
+        for (const Slow& q : slow) {
+            char when[32], client[INET_ADDRSTRLEN];
+            strftime(when, sizeof(when), "%F %T", localtime(&q.when));
+            inet_ntop(AF_INET, &q.client, client, sizeof(client));
+            fprintf(out, "  %s %s %s type %u rcode %u:", when, client, q.name, q.type, q.rcode);
+            for (int s = Parse; s <= Total; s++)
+                if (s != Send)
+                    fprintf(out, " %s=%.1f", names[s], q.ns[s] / 1e3);
+            fprintf(out, "\n");
+        }
+        fflush(out);
+
+    }
+
+};
+
+// Stage times of the query the thread is answering. The resolver adds its
+// Lookup and Relay times through Span.
+class Trace {
+
+    Tracer* tracer;
+    uint64_t start;
+    uint64_t last;
+    uint64_t ns[Tracer::STAGES];
+
+    static Trace*& current() {
+        static thread_local Trace* trace = NULL;
+        return trace;
+    }
+
+    public:
+
+    Trace(): tracer(Tracer::local()) {
+        if (tracer) {
+            start = last = Tracer::now();
+            for (uint64_t& n : ns)
+                n = 0;
+            current() = this;
+        }
+    }
+
+    ~Trace() {
+        if (tracer)
+            current() = NULL;
+    }
+
+    Trace(const Trace&) = delete;
+    Trace& operator = (const Trace&) = delete;
+
+    // Charges the time since the previous mark to stage.
+    void mark(Tracer::Stage stage) {
+        if (tracer) {
+            uint64_t t = Tracer::now();
+            ns[stage] += t - last;
+            last = t;
+        }
+    }
+
+    // Records every stage of the query, and the query itself if slow.
+    void finish(uint32_t client, const std::string& name, uint16_t type, uint8_t rcode) {
+
+        if (!tracer)
+            return;
+
+        ns[Tracer::Total] = last - start;
+        for (int s = Tracer::Parse; s <= Tracer::Total; s++)
+            if (s != Tracer::Send)
+                tracer->record((Tracer::Stage) s, ns[s]);
+
+        if (tracer->isSlow(ns[Tracer::Total])) {
+            Tracer::Slow slow;
+            slow.when = time(NULL);
+            slow.client = client;
+            snprintf(slow.name, sizeof(slow.name), "%s", name.c_str());
+            slow.type = type;
+            slow.rcode = rcode;
+            memcpy(slow.ns, ns, sizeof(ns));
+            tracer->slow(slow);
+        }
+
+    }
+
+    // Times the enclosing scope as stage of the current query, if traced.
+    class Span {
+
+        Trace* trace;
+        Tracer::Stage stage;
+        uint64_t start;
+
+        public:
+
+        Span(Tracer::Stage stage): trace(current()), stage(stage) {
+            if (trace)
+                start = Tracer::now();
+        }
+
+        ~Span() {
+            if (trace)
+                trace->ns[stage] += Tracer::now() - start;
+        }
+
+    };
+
+};
+
+};
@@ -0,0 +1,903 @@
+#pragma once
+
+/**
+  * Authoritative zones read from RFC 1035 master files.
+  *
+  *   $ORIGIN corp.example.
+  *   $TTL 1h
+  *   @       IN SOA  ns1 hostmaster ( 2024010101 2h 30m 2w 5m )
+  *           IN NS   ns1
+  *           IN MX   10 mail
+  *   ns1     IN A    10.0.0.1
+  *   mail        A   10.0.0.2
+  *   www         CNAME mail
+  *   dev         NS  ns.dev        ; delegated, ns.dev A is glue
+  *   ns.dev      A   10.0.1.1
+  *
+  * Every reply is compiled when the zone is loaded: for each name and type
+  * the answer, authority and additional sections in wire format, with the
+  * AA flag, and per name the reply to any other type (NODATA with the SOA,
+  * an in zone CNAME chain or a referral). Names below a zone that do not
+  * exist share its NXDOMAIN reply. A query is answered with one hash
+  * lookup and a copy of its header and question, Package is not involved.
+  *
+  * Owner names equal to the query name point to the question, the rest
+  * are not compressed. Replies over BUF_SIZE are sent truncated. Zones are
+  * read once at start, wildcards and $INCLUDE are not supported.
+  **/
+
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+
+#include "Dns.hpp"
+
+namespace dns {
+
+class Zones: public Authority {
+
+    // Everything after the question, and the header fields that go with it.
+    struct Reply {
+        uint16_t flags;         // QR, AA and RCODE, RD comes from the query
+        uint16_t counts[3];     // answer, authority and additional records
+        std::vector<uint8_t> body;
+    };
+
+    // Every name is one record of the arena, integers in host order:
+    //
+    //   key length (2), key, zone (4), delegated (1), replies (1),
+    //   per reply its type (2) and offset from the record (4),
+    //   the replies
+    //
+    // and each reply is
+    //
+    //   body length (2), flags and counts in wire order (8), body
+    //
+    // The first reply is for any type not found after it, and the only one
+    // used when the name is delegated. The index is open addressed, so a
+    // query reads one slot, the head of one record and one reply.
+    static constexpr size_t PACKED = 10;
+
+    struct Slot {
+        uint32_t hash;
+        uint32_t offset;        // of the record plus one, 0 when free
+    };
+
+    struct Zone {
+        std::string origin;
+        std::string nxdomain;
+    };
+
+    static void pack(std::string& out, const Reply& reply) {
+        uint16_t length = reply.body.size();
+        uint8_t header[PACKED] = {
+            0, 0,
+            (uint8_t) (reply.flags >> 8), (uint8_t) reply.flags,
+            (uint8_t) (reply.counts[0] >> 8), (uint8_t) reply.counts[0],
+            (uint8_t) (reply.counts[1] >> 8), (uint8_t) reply.counts[1],
+            (uint8_t) (reply.counts[2] >> 8), (uint8_t) reply.counts[2] };
+        memcpy(header, &length, 2);
+        out.append((const char*) header, PACKED);
+        out.append((const char*) reply.body.data(), reply.body.size());
+    }
+
+    template <class T>
+    static T read(const char* p) {
+        T v;
+        memcpy(&v, p, sizeof(T));
+        return v;
+    }
+
+    // FNV-1a.
+    static uint32_t hash(const char* key, size_t len) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < len; i++)
+            h = (h ^ (uint8_t) key[i]) * 16777619u;
+        return h;
+    }
+
+    // The record of key, NULL if there is none.
+    const char* lookup(const char* key, size_t len) const {
+        if (slots.empty())
+            return NULL;
+        uint32_t h = hash(key, len);
+        size_t mask = slots.size() - 1;
+        for (size_t i = h & mask; slots[i].offset; i = (i + 1) & mask) {
+            if (slots[i].hash != h)
+                continue;
+            const char* r = arena.data() + slots[i].offset - 1;
+            if (read<uint16_t>(r) == len && memcmp(r + 2, key, len) == 0)
+                return r;
+        }
+        return NULL;
+    }
+
+    static uint32_t recordZone(const char* r) {
+        return read<uint32_t>(r + 2 + read<uint16_t>(r));
+    }
+
+    // The reply of the record for qtype.
+    static const char* recordReply(const char* r, uint16_t qtype) {
+        const char* head = r + 2 + read<uint16_t>(r) + 4;
+        bool delegated = head[0];
+        uint8_t count = head[1];
+        const char* directory = head + 2;
+        if (!delegated)
+            for (uint8_t i = 1; i < count; i++)
+                if (read<uint16_t>(directory + 6 * i) == qtype)
+                    return r + read<uint32_t>(directory + 6 * i + 2);
+        return r + read<uint32_t>(directory + 2);
+    }
+
+    static bool recordDelegated(const char* r) {
+        return r[2 + read<uint16_t>(r) + 4];
+    }
+
+    void grow() {
+        std::vector<Slot> old(std::max<size_t>(slots.size() * 2, 1024), Slot{ 0, 0 });
+        old.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (Slot& s : old) {
+            if (!s.offset)
+                continue;
+            size_t i = s.hash & mask;
+            while (slots[i].offset)
+                i = (i + 1) & mask;
+            slots[i] = s;
+        }
+    }
+
+    // Appends the record of key. A name already loaded from another zone is
+    // replaced only if the new zone is more specific, a child zone loaded
+    // with its parent answers for its own apex.
+    void insert(const std::string& key, uint32_t zone, bool delegated,
+        const std::vector<std::pair<uint16_t, Reply>>& replies) {
+
+        if (const char* r = lookup(key.data(), key.size()))
+            if (zones[recordZone(r)].origin.size() >= zones[zone].origin.size())
+                return;
+
+        if ((used + 1) * 2 > slots.size())
+            grow();
+
+        uint32_t offset = arena.size() + 1;
+        uint16_t keyLength = key.size();
+        uint8_t head[2] = { delegated, (uint8_t) replies.size() };
+        arena.append((const char*) &keyLength, 2);
+        arena.append(key);
+        arena.append((const char*) &zone, 4);
+        arena.append((const char*) head, 2);
+
+        uint32_t at = 2 + key.size() + 6 + 6 * replies.size();
+        for (const std::pair<uint16_t, Reply>& r : replies) {
+            arena.append((const char*) &r.first, 2);
+            arena.append((const char*) &at, 4);
+            at += PACKED + r.second.body.size();
+        }
+        for (const std::pair<uint16_t, Reply>& r : replies)
+            pack(arena, r.second);
+
+        uint32_t h = hash(key.data(), key.size());
+        size_t mask = slots.size() - 1;
+        size_t i = h & mask;
+        for (; slots[i].offset; i = (i + 1) & mask) {
+            const char* r = arena.data() + slots[i].offset - 1;
+            if (slots[i].hash == h && read<uint16_t>(r) == key.size() &&
+                memcmp(r + 2, key.data(), key.size()) == 0)
+                break;  // replaced, the old record stays unused in the arena
+        }
+        if (!slots[i].offset)
+            used++;
+        slots[i] = Slot{ h, offset };
+
+    }
+
+    // RRsets of one zone being loaded, by lower case name and type.
+    struct Records {
+
+        std::map<std::string, std::map<uint16_t, std::vector<Answer*>>> names;
+
+        ~Records() {
+            for (auto& name : names)
+                for (auto& rrset : name.second)
+                    for (Answer* a : rrset.second)
+                        delete a;
+        }
+
+        const std::vector<Answer*>* find(const std::string& name, uint16_t type) const {
+            auto n = names.find(name);
+            if (n == names.end())
+                return NULL;
+            auto r = n->second.find(type);
+            return r == n->second.end() ? NULL : &r->second;
+        }
+
+    };
+
+    // Keys are names in lower case wire format, so the key of a parent is
+    // a suffix of the key of its children.
+    std::vector<Slot> slots;
+    size_t used;
+    std::string arena;
+    std::vector<Zone> zones;
+    std::string lastError;
+
+    static std::string lower(std::string s) {
+        for (char& c : s)
+            c = tolower((unsigned char) c);
+        return s;
+    }
+
+    static std::string key(const std::string& name) {
+        std::vector<uint8_t> wire;
+        encodeDomain(wire, name);
+        return std::string(wire.begin(), wire.end());
+    }
+
+    static std::string parent(const std::string& name) {
+        size_t dot = name.find('.');
+        return dot == std::string::npos ? "" : name.substr(dot + 1);
+    }
+
+    static bool below(const std::string& name, const std::string& origin) {
+        return name == origin || (name.size() > origin.size() &&
+            name.compare(name.size() - origin.size(), origin.size(), origin) == 0 &&
+            name[name.size() - origin.size() - 1] == '.');
+    }
+
+    // Master file text split in entries, each with the line it starts on.
+    // Parentheses join lines, quotes keep spaces, ';' starts a comment.
+    struct Entry {
+        size_t line;
+        bool continued;     // starts with blank: same owner as the last one
+        std::vector<std::string> fields;
+    };
+
+    static bool tokenize(std::istream& in, std::vector<Entry>& entries, size_t& errorLine) {
+
+        std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        size_t line = 1, depth = 0;
+        Entry entry = { 1, false, {} };
+        bool atStart = true;
+
+        for (size_t i = 0; i <= text.size(); i++) {
+
+            char c = i < text.size() ? text[i] : '\n';
+
+            if (atStart) {
+                entry.line = line;
+                entry.continued = c == ' ' || c == '\t';
+                atStart = false;
+            }
+
+            if (c == ';') {
+                while (i < text.size() && text[i] != '\n')
+                    i++;
+                c = '\n';
+            }
+
+            if (c == '\n') {
+                if (depth == 0) {
+                    if (!entry.fields.empty())
+                        entries.push_back(entry);
+                    entry.fields.clear();
+                    atStart = true;
+                }
+                line++;
+            } else if (c == '(') {
+                depth++;
+            } else if (c == ')') {
+                if (depth == 0) {
+                    errorLine = line;
+                    return false;
+                }
+                depth--;
+            } else if (c == '"') {
+                std::string field;
+                for (i++; i < text.size() && text[i] != '"'; i++) {
+                    if (text[i] == '\\' && i + 1 < text.size())
+                        i++;
+                    if (text[i] == '\n')
+                        line++;
+                    field += text[i];
+                }
+                if (i >= text.size()) {
+                    errorLine = line;
+                    return false;
+                }
+                entry.fields.push_back(field);
+            } else if (!isspace((unsigned char) c)) {
+                size_t end = i;
+                while (end < text.size() && !isspace((unsigned char) text[end]) &&
+                    !strchr("();\"", text[end]))
+                    end++;
+                entry.fields.push_back(text.substr(i, end - i));
+                i = end - 1;
+            }
+
+        }
+
+        errorLine = line;
+        return depth == 0;
+
+    }
+
+    // "3600", "1h", "2w3d" in seconds, false if malformed.
+    static bool parseTTL(const std::string& s, uint32_t& ttl) {
+
+        if (s.empty() || !isdigit((unsigned char) s[0]))
+            return false;
+        uint64_t total = 0, value = 0;
+        bool suffixed = false;
+
+        for (size_t i = 0; i < s.size(); i++) {
+            char c = tolower((unsigned char) s[i]);
+            if (isdigit((unsigned char) c)) {
+                value = value * 10 + (c - '0');
+                if (value > UINT32_MAX)
+                    return false;
+                continue;
+            }
+            static const char units[] = "smhdw";
+            static const uint32_t seconds[] = { 1, 60, 3600, 86400, 604800 };
+            const char* u = c ? strchr(units, c) : NULL;
+            if (!u || !isdigit((unsigned char) s[i - 1]))
+                return false;
+            total += value * seconds[u - units];
+            value = 0;
+            suffixed = true;
+        }
+
+        if (suffixed && isdigit((unsigned char) s.back()))
+            return false;
+        total += value;
+        if (total > UINT32_MAX)
+            return false;
+        ttl = total;
+        return true;
+
+    }
+
+    static bool parseNumber(const std::string& s, uint32_t max, uint32_t& value) {
+        char* end;
+        if (s.empty() || !isdigit((unsigned char) s[0]))
+            return false;
+        unsigned long v = strtoul(s.c_str(), &end, 10);
+        if (*end || v > max)
+            return false;
+        value = v;
+        return true;
+    }
+
+    // Relative names are completed with origin, "@" is the origin itself.
+    static bool absolute(const std::string& name, const std::string& origin, std::string& out) {
+        if (name.empty())
+            return false;
+        if (name == "@" && !origin.empty())
+            out = origin;
+        else if (name.back() == '.')
+            out = name.substr(0, name.size() - 1);
+        else if (origin.empty())
+            return false;
+        else
+            out = name + "." + origin;
+        out = lower(out);
+        return out.size() <= MAX_NAME;
+    }
+
+    static uint16_t parseType(const std::string& s) {
+        std::string upper = s;
+        for (char& c : upper)
+            c = toupper((unsigned char) c);
+        for (uint16_t type = 1; type < RECORDS.size(); type++)
+            if (RECORDS[type].read && upper == RECORDS[type].name)
+                return type;
+        return 0;
+    }
+
+    // RDATA in presentation format into an Answer, NULL if malformed.
+    static Answer* parseRData(const std::string& owner, uint16_t type, uint32_t ttl,
+        const std::vector<std::string>& f, const std::string& origin) {
+
+        std::string name;
+        uint32_t n[5];
+
+        switch (type) {
+
+            case Types::A_Type: {
+                uint8_t addr[4];
+                if (f.size() != 1 || inet_pton(AF_INET, f[0].c_str(), addr) != 1)
+                    return NULL;
+                A_Answer* a = new A_Answer(owner, type, Package::IN_Class, ttl);
+                a->setRData(addr[0], addr[1], addr[2], addr[3]);
+                return a;
+            }
+
+            case Types::AAAA_Type: {
+                uint8_t addr[16];
+                if (f.size() != 1 || inet_pton(AF_INET6, f[0].c_str(), addr) != 1)
+                    return NULL;
+                AAAA_Answer* a = new AAAA_Answer(owner, type, Package::IN_Class, ttl);
+                a->setRData(addr);
+                return a;
+            }
+
+            case Types::NS_Type:
+            case Types::CNAME_Type:
+            case Types::PTR_Type: {
+                if (f.size() != 1 || !absolute(f[0], origin, name))
+                    return NULL;
+                CNAME_Answer* a = new CNAME_Answer(owner, type, Package::IN_Class, ttl);
+                a->setRData(name);
+                return a;
+            }
+
+            case Types::MX_Type: {
+                if (f.size() != 2 || !parseNumber(f[0], 65535, n[0]) || !absolute(f[1], origin, name))
+                    return NULL;
+                MX_Answer* a = new MX_Answer(owner, type, Package::IN_Class, ttl);
+                a->preference = n[0];
+                a->exchange = name;
+                return a;
+            }
+
+            case Types::TXT_Type: {
+                if (f.empty())
+                    return NULL;
+                TXT_Answer* a = new TXT_Answer(owner, type, Package::IN_Class, ttl);
+                a->strings = f;
+                return a;
+            }
+
+            case Types::SRV_Type: {
+                if (f.size() != 4 || !parseNumber(f[0], 65535, n[0]) || !parseNumber(f[1], 65535, n[1]) ||
+                    !parseNumber(f[2], 65535, n[2]) || !absolute(f[3], origin, name))
+                    return NULL;
+                SRV_Answer* a = new SRV_Answer(owner, type, Package::IN_Class, ttl);
+                a->priority = n[0];
+                a->weight = n[1];
+                a->port = n[2];
+                a->target = name;
+                return a;
+            }
+
+            case Types::SOA_Type: {
+                std::string rname;
+                if (f.size() != 7 || !absolute(f[0], origin, name) || !absolute(f[1], origin, rname) ||
+                    !parseNumber(f[2], UINT32_MAX, n[0]))
+                    return NULL;
+                for (int i = 1; i < 5; i++)
+                    if (!parseTTL(f[i + 2], n[i]))
+                        return NULL;
+                SOA_Answer* a = new SOA_Answer(owner, type, Package::IN_Class, ttl);
+                a->mname = name;
+                a->rname = rname;
+                a->serial = n[0];
+                a->refresh = n[1];
+                a->retry = n[2];
+                a->expire = n[3];
+                a->minimum = n[4];
+                return a;
+            }
+
+        }
+
+        return NULL;
+
+    }
+
+    // Appends one record, its owner as a pointer to the question if it is
+    // the query name.
+    static void putRecord(std::vector<uint8_t>& out, Answer* a, const std::string& qname) {
+
+        if (a->aName == qname) {
+            out.push_back(0xC0);
+            out.push_back(12);
+        } else {
+            encodeDomain(out, a->aName);
+        }
+        Package::put16bits(out, a->aType);
+        Package::put16bits(out, a->aClass);
+        Package::put32bits(out, a->aTTL);
+
+        size_t length = out.size();
+        Package::put16bits(out, 0);
+        a->putRData(out);
+        uint16_t rdlength = out.size() - length - 2;
+        out[length] = rdlength >> 8;
+        out[length + 1] = rdlength;
+
+    }
+
+    // The answer section always goes in whole. Authority and additional
+    // records are left out once they would not fit in BUF_SIZE, so the
+    // reply is only truncated when its answers alone do not fit.
+    static Reply compile(const std::string& qname, uint16_t flags, const std::vector<Answer*>& answer,
+        const std::vector<Answer*>& authority, const std::vector<Answer*>& additional) {
+
+        Reply reply;
+        reply.flags = flags;
+        reply.counts[0] = reply.counts[1] = reply.counts[2] = 0;
+
+        // Shared replies (empty qname) leave room for the longest name.
+        size_t room = BUF_SIZE - 12 - 4 - (qname.empty() ? MAX_NAME + 2 : qname.size() + 2);
+
+        for (Answer* a : answer) {
+            putRecord(reply.body, a, qname);
+            reply.counts[0]++;
+        }
+
+        const std::vector<Answer*>* sections[2] = { &authority, &additional };
+        for (int s = 0; s < 2; s++) {
+            for (Answer* a : *sections[s]) {
+                size_t before = reply.body.size();
+                putRecord(reply.body, a, qname);
+                if (reply.body.size() > room) {
+                    reply.body.resize(before);
+                    return reply;
+                }
+                reply.counts[s + 1]++;
+            }
+        }
+
+        return reply;
+
+    }
+
+    // A and AAAA records of the names NS, MX and SRV records point to.
+    static std::vector<Answer*> glue(const Records& records, const std::vector<Answer*>& from) {
+
+        std::vector<Answer*> out;
+        std::set<std::string> seen;
+
+        for (Answer* a : from) {
+            std::string target;
+            if (a->aType == Types::NS_Type)
+                target = *a->target();
+            else if (a->aType == Types::MX_Type)
+                target = ((MX_Answer*) a)->exchange;
+            else if (a->aType == Types::SRV_Type)
+                target = ((SRV_Answer*) a)->target;
+            else
+                continue;
+            if (!seen.insert(target).second)
+                continue;
+            for (uint16_t type : { (uint16_t) Types::A_Type, (uint16_t) Types::AAAA_Type })
+                if (const std::vector<Answer*>* rrset = records.find(target, type))
+                    out.insert(out.end(), rrset->begin(), rrset->end());
+        }
+
+        return out;
+
+    }
+
+    static std::vector<Answer*> concat(std::vector<Answer*> a, const std::vector<Answer*>& b) {
+        a.insert(a.end(), b.begin(), b.end());
+        return a;
+    }
+
+    // Nearest name at or above name, below the origin, that has NS records.
+    static std::string cutOf(const Records& records, std::string name, const std::string& origin) {
+        for (; name != origin && !name.empty(); name = parent(name))
+            if (records.find(name, Types::NS_Type))
+                return name;
+        return "";
+    }
+
+    void compileZone(const Records& records, const std::string& origin) {
+
+        static const uint16_t AA = 0x8400;          // QR and AA
+        static const uint16_t REFERRAL = 0x8000;
+
+        uint32_t index = zones.size();
+        SOA_Answer* soa = (SOA_Answer*) (*records.find(origin, Types::SOA_Type))[0];
+        const std::vector<Answer*>* apexNS = records.find(origin, Types::NS_Type);
+        std::vector<Answer*> authority = apexNS ? *apexNS : std::vector<Answer*>();
+
+        // Negative answers are cached for the SOA minimum (RFC 2308).
+        SOA_Answer negative(*soa);
+        negative.aTTL = std::min(soa->aTTL, soa->minimum);
+        std::vector<Answer*> soaSection = { &negative };
+
+        Zone zone;
+        zone.origin = origin;
+        pack(zone.nxdomain, compile("", AA | Package::NameError_ResponseType, {}, soaSection, {}));
+        zones.push_back(zone);
+
+        // Names with records and the empty ones between them and the origin.
+        std::set<std::string> names;
+        for (auto& name : records.names)
+            for (std::string n = name.first; below(n, origin) && names.insert(n).second; n = parent(n))
+                if (n == origin)
+                    break;
+
+        for (const std::string& name : names) {
+
+            bool delegated = false;
+            Reply other;
+            std::vector<std::pair<uint16_t, Reply>> replies;
+            replies.push_back(std::make_pair(0, Reply()));
+
+            std::string cut = cutOf(records, name, origin);
+            auto rrsets = records.names.find(name);
+
+            if (!cut.empty()) {
+
+                const std::vector<Answer*>& ns = *records.find(cut, Types::NS_Type);
+                delegated = true;
+                // Shared with every name below it: no pointer to the question.
+                other = compile("", REFERRAL, {}, ns, glue(records, ns));
+
+            } else if (rrsets == records.names.end()) {
+
+                other = compile(name, AA, {}, soaSection, {});
+
+            } else {
+
+                for (auto& rrset : rrsets->second) {
+                    const std::vector<Answer*>& answer = rrset.second;
+                    bool apexNSQuery = name == origin && rrset.first == Types::NS_Type;
+                    std::vector<Answer*> auth = apexNSQuery ? std::vector<Answer*>() : authority;
+                    replies.push_back(std::make_pair(rrset.first,
+                        compile(name, AA, answer, auth, glue(records, concat(answer, auth)))));
+                }
+
+                const std::vector<Answer*>* cname = records.find(name, Types::CNAME_Type);
+                if (!cname) {
+                    other = compile(name, AA, {}, soaSection, {});
+                } else {
+                    // Follows the chain while it stays in the zone and above
+                    // any cut, then adds the RRsets found at its end.
+                    std::vector<Answer*> chain = *cname;
+                    std::set<std::string> seen = { name };
+                    std::string target = *(*cname)[0]->target();
+                    for (int links = 0; links < MAX_CHAIN && below(target, origin) &&
+                        cutOf(records, target, origin).empty() && seen.insert(target).second; links++) {
+                        const std::vector<Answer*>* next = records.find(target, Types::CNAME_Type);
+                        if (!next)
+                            break;
+                        chain.insert(chain.end(), next->begin(), next->end());
+                        target = *(*next)[0]->target();
+                    }
+                    other = compile(name, AA, chain, authority, glue(records, authority));
+                    auto end = records.names.find(target);
+                    if (end != records.names.end() && below(target, origin) &&
+                        cutOf(records, target, origin).empty())
+                        for (auto& rrset : end->second)
+                            if (rrset.first != Types::CNAME_Type) {
+                                std::vector<Answer*> answer = concat(chain, rrset.second);
+                                replies.push_back(std::make_pair(rrset.first,
+                                    compile(name, AA, answer, authority, glue(records, concat(answer, authority)))));
+                            }
+                }
+
+            }
+
+            replies[0].second = other;
+            insert(key(name), index, delegated, replies);
+
+        }
+
+    }
+
+    // The packed reply for qtype at the name qkey, NULL if not in a zone.
+    const char* find(uint16_t qtype, const char* qkey, size_t len) const {
+
+        if (const char* r = lookup(qkey, len))
+            return recordReply(r, qtype);
+
+        // The closest existing ancestor tells a referral from NXDOMAIN.
+        for (size_t i = 0; i < len && qkey[i]; ) {
+            i += (uint8_t) qkey[i] + 1;
+            if (const char* r = lookup(qkey + i, len - i))
+                return recordDelegated(r) ? recordReply(r, 0) : zones[recordZone(r)].nxdomain.data();
+        }
+
+        return NULL;
+
+    }
+
+    public:
+
+    Zones(): used(0) {}
+
+    Zones(const Zones&) = delete;
+    Zones& operator = (const Zones&) = delete;
+
+    // Reads one master file and compiles its replies. Returns the number
+    // of records, -1 on error, see error().
+    int load(const std::string& path) {
+        std::ifstream file(path);
+        if (!file.is_open()) {
+            lastError = path + ": cannot open";
+            return -1;
+        }
+        return load(file, path);
+    }
+
+    // Same from a stream, path only names it in errors.
+    int load(std::istream& file, const std::string& path) {
+
+        std::vector<Entry> entries;
+        size_t errorLine = 0;
+        if (!tokenize(file, entries, errorLine)) {
+            lastError = path + ":" + std::to_string(errorLine) + ": unbalanced parentheses or quotes";
+            return -1;
+        }
+
+        Records records;
+        std::string origin, owner, apex;
+        uint32_t defaultTTL = 3600;
+        int count = 0;
+
+        for (Entry& e : entries) {
+
+            std::string where = path + ":" + std::to_string(e.line) + ": ";
+            std::vector<std::string>& f = e.fields;
+
+            if (f[0][0] == '$') {
+                if (f[0] == "$ORIGIN" && f.size() == 2 && absolute(f[1], origin, origin))
+                    continue;
+                if (f[0] == "$TTL" && f.size() == 2 && parseTTL(f[1], defaultTTL))
+                    continue;
+                lastError = where + "bad or unsupported directive " + f[0];
+                return -1;
+            }
+
+            size_t i = 0;
+            if (!e.continued && !absolute(f[i++], origin, owner)) {
+                lastError = where + "relative owner without $ORIGIN";
+                return -1;
+            }
+            if (owner.empty()) {
+                lastError = where + "no owner";
+                return -1;
+            }
+
+            // TTL and class, both optional and in any order, then the type.
+            uint32_t ttl = defaultTTL;
+            for (int k = 0; k < 2 && i < f.size(); k++) {
+                if (lower(f[i]) == "in")
+                    i++;
+                else if (parseTTL(f[i], ttl))
+                    i++;
+            }
+            if (i >= f.size()) {
+                lastError = where + "no type";
+                return -1;
+            }
+            uint16_t type = parseType(f[i]);
+            if (!type) {
+                lastError = where + "unsupported type or class " + f[i];
+                return -1;
+            }
+
+            std::vector<std::string> rdata(f.begin() + i + 1, f.end());
+            Answer* a = parseRData(owner, type, ttl, rdata, origin);
+            if (!a) {
+                lastError = where + "bad " + recordInfo(type).name + " record";
+                return -1;
+            }
+            if (type == Types::SOA_Type) {
+                if (!apex.empty()) {
+                    delete a;
+                    lastError = where + "second SOA";
+                    return -1;
+                }
+                apex = owner;
+            }
+            records.names[owner][type].push_back(a);
+            count++;
+
+        }
+
+        if (apex.empty()) {
+            lastError = path + ": no SOA record";
+            return -1;
+        }
+        for (auto& name : records.names) {
+            if (!below(name.first, apex)) {
+                lastError = path + ": " + name.first + " is out of zone " + apex;
+                return -1;
+            }
+            if (name.second.count(Types::CNAME_Type) && name.second.size() > 1) {
+                lastError = path + ": " + name.first + " has a CNAME and other records";
+                return -1;
+            }
+        }
+
+        compileZone(records, apex);
+        arena.shrink_to_fit();
+        return count;
+
+    }
+
+    // What the last load() failed on.
+    const std::string& error() const {
+        return lastError;
+    }
+
+    bool empty() const {
+        return zones.empty();
+    }
+
+    // Names with compiled replies, empty ones between records included.
+    size_t size() const {
+        return used;
+    }
+
+    // Bytes of compiled replies and keys.
+    size_t memory() const {
+        return arena.capacity() + slots.capacity() * sizeof(Slot);
+    }
+
+    // Writes to out the reply to query if its name is in a loaded zone.
+    // Returns its length, 0 if the query is not for a zone, not a single
+    // IN question, or not a standard query; those go to the resolver.
+    size_t answer(const uint8_t* query, size_t len, uint8_t* out, size_t size) const override {
+
+        // QR, opcode 0, one question and nothing else but EDNS.
+        if (len < 12 || (query[2] & 0xF8) || query[4] || query[5] != 1 ||
+            query[6] || query[7] || query[8] || query[9])
+            return 0;
+
+        char qkey[MAX_NAME + 2];
+        size_t qlen = 0;
+
+        size_t i = 12;
+        while (true) {
+            if (i >= len)
+                return 0;
+            uint8_t label = query[i];
+            if (label > 63 || i + label + 1 > len || qlen + label + 1 > MAX_NAME + 1)
+                return 0;   // pointers have no place in a question
+            qkey[qlen++] = label;
+            for (size_t k = i + 1; k <= i + label; k++) {
+                uint8_t c = query[k];
+                qkey[qlen++] = c >= 'A' && c <= 'Z' ? c + 32 : c;
+            }
+            i += label + 1;
+            if (!label)
+                break;
+        }
+        if (i + 4 > len)
+            return 0;
+        uint16_t qtype = query[i] << 8 | query[i + 1];
+        uint16_t qclass = query[i + 2] << 8 | query[i + 3];
+        size_t question = i + 4 - 12;
+        if (qclass != Package::IN_Class)
+            return 0;
+
+        const char* reply = find(qtype, qkey, qlen);
+        if (!reply || 12 + question > size)
+            return 0;
+        size_t body = read<uint16_t>(reply);
+
+        out[0] = query[0];
+        out[1] = query[1];
+        memcpy(out + 2, reply + 2, 2);
+        out[2] |= query[2] & 0x01;     // RD
+        out[4] = 0;
+        out[5] = 1;
+        memcpy(out + 12, query + 12, question);
+
+        if (12 + question + body > size) {
+            out[2] |= 0x02;             // TC
+            memset(out + 6, 0, 6);
+            return 12 + question;
+        }
+        memcpy(out + 6, reply + 4, 6);
+        memcpy(out + 12 + question, reply + PACKED, body);
+        return 12 + question + body;
+
+    }
+
+};
+
+};
@@ -12,6 +12,24 @@ struct arguments{
   int verbose, quiet, nocache;
   char *dns;
   char *host_file;
+  char *fastpath;
+  int rate_limit, rrl, slip;
+  char *snapshot;
+  int snapshot_interval;
+  char *blocklist;
+  char *forward;
+  int threads;
+  char *cpus;
+  int trace;
+  int doh;
+  char *zones;
+  char *shared_cache;
+  int port;
+  char *peer, *peers;
+  char *upgrade;
+  int top;
+  int window;
+  int admit;
 };
 
 struct arguments arguments;
@@ -26,8 +44,29 @@ static struct argp_option options[] = {
   {"verbose",  'v', 0,      0,  "Produce verbose output" },
   {"quiet",    'q', 0,      0,  "Don't produce any output" },
   {"nocache",  'n', 0,      0,  "Disable cache" },
-  {"dns",      'd', "IP",   0,  "Primary DNS IP"},
+  {"dns",      'd', "IP",   0,  "Primary DNS [tcp://]IP[:PORT]"},
   {"host_file",'h', "FILE", 0, "Hosts file location" },
+  {"fastpath", 'x', "IFACE",0, "Answer cache hits from a packet ring on IFACE"},
+  {"rate-limit",'r', "QPS",  0, "Queries per second allowed per client /24"},
+  {"rrl",      'R', "RPS",  0, "Responses per second per client /24 and name"},
+  {"slip",     's', "N",    0, "Answer every Nth rate limited query truncated"},
+  {"snapshot", 'S', "FILE", 0, "Save the cache to FILE and load it on start"},
+  {"snapshot-interval", 'I', "SEC", 0, "Seconds between cache snapshots"},
+  {"blocklist",'b', "FILE", 0, "Answer NXDOMAIN for names matching FILE rules"},
+  {"forward",  'f', "FILE", 0, "Per zone upstreams, reloaded on SIGHUP"},
+  {"threads",  't', "N",    0, "Event loop threads, each with its own socket"},
+  {"cpus",     'c', "LIST", 0, "Pin thread i to the ith CPU of LIST (0-3,8)"},
+  {"trace",    'T', "USEC", 0, "Time every stage, keep queries over USEC, dump on SIGUSR1"},
+  {"doh",      'D', "PORT", 0, "Answer DNS over HTTP (RFC 8484, no TLS) on PORT"},
+  {"zones",    'z', "FILES",0, "Answer authoritatively from master FILEs (comma separated)"},
+  {"shared-cache",'M', "NAME[:MB]",0, "Cache in shared memory segment NAME (64MB), shared by every process using it"},
+  {"port",     'p', "PORT", 0, "Port to answer DNS queries on (1053)"},
+  {"peer",     'P', "IP:PORT",0, "Share the cache with --peers, answering them on IP:PORT"},
+  {"peers",    'L', "LIST", 0, "Peer addresses of every instance, this one included (ip:port,...)"},
+  {"upgrade",  'U', "PATH", 0, "Take the sockets and cache over from the server on Unix socket PATH, then wait there for the next one"},
+  {"top",      'K', "N",    0, "Track the N heaviest names, client /24s and NXDOMAIN names, dump on SIGUSR2"},
+  {"window",   'W', "SEC",  0, "Seconds after which --top and --admit counts are halved (60)"},
+  {"admit",    'A', "N",    0, "Cache fetched names only from their Nth lookup in a window"},
   { 0 }
 };
 
@@ -52,6 +91,69 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
     case 'h':
       arguments->host_file = arg;
       break;
+    case 'x':
+      arguments->fastpath = arg;
+      break;
+    case 'r':
+      arguments->rate_limit = atoi(arg);
+      break;
+    case 'R':
+      arguments->rrl = atoi(arg);
+      break;
+    case 's':
+      arguments->slip = atoi(arg);
+      break;
+    case 'S':
+      arguments->snapshot = arg;
+      break;
+    case 'I':
+      arguments->snapshot_interval = atoi(arg);
+      break;
+    case 'b':
+      arguments->blocklist = arg;
+      break;
+    case 'f':
+      arguments->forward = arg;
+      break;
+    case 't':
+      arguments->threads = atoi(arg);
+      break;
+    case 'c':
+      arguments->cpus = arg;
+      break;
+    case 'T':
+      arguments->trace = atoi(arg);
+      break;
+    case 'D':
+      arguments->doh = atoi(arg);
+      break;
+    case 'z':
+      arguments->zones = arg;
+      break;
+    case 'M':
+      arguments->shared_cache = arg;
+      break;
+    case 'p':
+      arguments->port = atoi(arg);
+      break;
+    case 'P':
+      arguments->peer = arg;
+      break;
+    case 'L':
+      arguments->peers = arg;
+      break;
+    case 'U':
+      arguments->upgrade = arg;
+      break;
+    case 'K':
+      arguments->top = atoi(arg);
+      break;
+    case 'W':
+      arguments->window = atoi(arg);
+      break;
+    case 'A':
+      arguments->admit = atoi(arg);
+      break;
     default:
       return ARGP_ERR_UNKNOWN;
     }
@@ -67,6 +169,27 @@ void parse_args (int argc, char **argv) {
   arguments.nocache = 0;
   arguments.host_file = (char*) "/etc/hosts";
   arguments.dns = (char*) "8.8.8.8";
+  arguments.fastpath = NULL;
+  arguments.rate_limit = 0;
+  arguments.rrl = 0;
+  arguments.slip = 2;
+  arguments.snapshot = NULL;
+  arguments.snapshot_interval = 300;
+  arguments.blocklist = NULL;
+  arguments.forward = NULL;
+  arguments.threads = 1;
+  arguments.cpus = NULL;
+  arguments.trace = -1;
+  arguments.doh = 0;
+  arguments.zones = NULL;
+  arguments.shared_cache = NULL;
+  arguments.port = 1053;
+  arguments.peer = NULL;
+  arguments.peers = NULL;
+  arguments.upgrade = NULL;
+  arguments.top = 0;
+  arguments.window = 60;
+  arguments.admit = 0;
 
   argp_parse (&argp, argc, argv, 0, 0, &arguments);
 
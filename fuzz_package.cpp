@@ -0,0 +1,59 @@
+/**
+  * Fuzz target for Package parsing and the dump() round trip.
+  *
+  * libFuzzer:  make fuzz && ./fuzz_package corpus/
+  * AFL:        afl-clang-fast++ -std=c++17 -DFUZZ_STANDALONE fuzz_package.cpp
+  *
+  * Any input must either be rejected with FormatError or parse, dump, and
+  * parse again to the very same bytes.
+  **/
+
+#include "Dns.hpp"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+
+    std::vector<uint8_t> first;
+
+    try {
+        dns::Package package(data, size);
+        first = package.dump();
+    } catch (dns::FormatError& e) {
+        std::vector<uint8_t> reply = dns::Package::formatError(data, size);
+        if (reply.size() != 12)
+            abort();
+        return 0;
+    }
+
+    // Whatever we dump has to be valid and stable.
+    dns::Package again(first.data(), first.size());
+    std::vector<uint8_t> second = again.dump();
+    if (first != second)
+        abort();
+
+    return 0;
+
+}
+
+#ifdef FUZZ_STANDALONE
+
+int main(int argc, char **argv) {
+
+    for (int i = 1; i < argc || i == 1; i++) {
+
+        std::istream* in = &std::cin;
+        std::ifstream file;
+        if (argc > 1) {
+            file.open(argv[i], std::ios::binary);
+            in = &file;
+        }
+
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(*in)), std::istreambuf_iterator<char>());
+        LLVMFuzzerTestOneInput(data.data(), data.size());
+
+    }
+
+    return 0;
+
+}
+
+#endif
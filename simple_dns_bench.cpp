@@ -0,0 +1,763 @@
+/**
+  * Simple DNS Server benchmarks
+  *
+  * ./simple_dns_bench cache [THREADS] [SECONDS]
+  *     Read-mostly cache stress: every reader does 99% hits, one writer
+  *     keeps inserting and expiring. Without then with the admission
+  *     filter, every lookup counted as a client question, for what the
+  *     shared sketch costs the readers. Build with "make tsan" to run it
+  *     under ThreadSanitizer.
+  *
+  * ./simple_dns_bench trie [RULES]
+  *     Builds a blocklist of RULES suffix/wildcard rules and reports its
+  *     memory and lookup time.
+  *
+  * ./simple_dns_bench send [PEERS] [SECONDS]
+  *     Sends 32 reply bursts over loopback to PEERS clients, one sendto()
+  *     per reply, then through SendQueue without and with GSO, and reports
+  *     syscalls per reply.
+  *
+  * ./simple_dns_bench zone [RECORDS]
+  *     Writes a zone of RECORDS A, AAAA, MX, SRV and TXT records, loads it
+  *     and answers queries from its compiled replies, then the same names
+  *     from the cache through Package and Resolver.
+  *
+  * ./simple_dns_bench tcp [QUERIES]
+  *     Resolves QUERIES distinct names from 1, 8 and 32 threads against
+  *     stub upstreams on loopback, over UDP and over the pipelined TCP
+  *     connections. The TCP stub answers in reverse order and drops the
+  *     connection every 500 queries.
+  *
+  * ./simple_dns_bench names [ENTRIES]
+  *     Caches ENTRIES RRsets of a CDN heavy corpus (cloudfront, akamai
+  *     chains, googlevideo, S3, plain sites) and reports heap bytes per
+  *     entry and the time of a hit.
+  *
+  * ./simple_dns_bench sketch [QUERIES]
+  *     Streams QUERIES queries, 70% over 100000 Zipf distributed names and
+  *     30% one-off names, through the heavy hitter trackers and reports
+  *     the time per query and how many of the true top 100 they find. Then
+  *     through the cache without and with the admission filter, for its
+  *     memory and hit ratio.
+  *
+  * ./simple_dns_bench numa [SECONDS]
+  *     Builds the cache from a thread pinned on one NUMA node and reads it
+  *     from a thread pinned on each node, then with the shard tables
+  *     interleaved over the nodes by Cache::interleave(). Shows what remote
+  *     memory costs.
+  **/
+
+#include <thread>
+#include <chrono>
+#include <random>
+#include <malloc.h>
+
+#include "Dns.hpp"
+#include "SendQueue.hpp"
+#include "Affinity.hpp"
+#include "Zone.hpp"
+#include "TcpUpstream.hpp"
+#include "Sketch.hpp"
+
+static std::string bench_name(size_t i){
+    return "host" + std::to_string(i) + ".bench.example.com";
+}
+
+static void bench_cache(unsigned max_threads, double seconds){
+
+    const size_t NAMES = 100000;
+
+    dns::Cache cache;
+    for (size_t i = 0; i < NAMES; i++){
+        dns::Answer* a = new dns::A_Answer(bench_name(i), dns::Package::A_Type, dns::Package::IN_Class, 3600);
+        a->setRData(10, i >> 16, i >> 8, i);
+        cache.set(dns::Question(bench_name(i), dns::Package::A_Type, dns::Package::IN_Class),
+            std::vector<dns::Answer*> (1, a));
+    }
+
+    dns::TinyLfu lfu(2);
+    double base = 0;
+
+    for (int admit = 0; admit < 2; admit++)
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2){
+
+        cache.setAdmission(admit ? &lfu : NULL);
+
+        std::atomic<bool> stop(false);
+        std::atomic<uint64_t> total(0), hits(0), writes(0);
+        std::vector<std::thread> readers;
+
+        for (unsigned t = 0; t < threads; t++){
+            readers.push_back(std::thread([&, t]() {
+                std::mt19937_64 rng(t);
+                uint64_t ops = 0, hit = 0;
+                while (!stop.load(std::memory_order_relaxed)){
+                    size_t i = rng() % NAMES;
+                    // One lookup in a hundred is for a name never cached.
+                    if (rng() % 100 == 0)
+                        i += NAMES;
+                    std::optional<std::vector<dns::Answer*>> ret = cache.get(
+                        dns::Question(bench_name(i), dns::Package::A_Type, dns::Package::IN_Class), true);
+                    if (ret){
+                        hit++;
+                        for (dns::Answer* a : *ret)
+                            delete a;
+                    }
+                    ops++;
+                }
+                total += ops;
+                hits += hit;
+            }));
+        }
+
+        std::thread writer([&]() {
+            std::mt19937_64 rng(42);
+            uint64_t n = 0;
+            while (!stop.load(std::memory_order_relaxed)){
+                size_t i = rng() % NAMES;
+                dns::Answer* a = new dns::A_Answer(bench_name(i), dns::Package::A_Type, dns::Package::IN_Class, 3600);
+                a->setRData(10, i >> 16, i >> 8, i);
+                cache.set(dns::Question(bench_name(i), dns::Package::A_Type, dns::Package::IN_Class),
+                    std::vector<dns::Answer*> (1, a));
+                if (++n % 1000 == 0)
+                    cache.expire();
+                std::this_thread::sleep_for(std::chrono::microseconds(10));
+            }
+            writes += n;
+        });
+
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+        stop = true;
+        for (std::thread& r : readers)
+            r.join();
+        writer.join();
+        cache.setAdmission(NULL);
+
+        double rate = total / seconds;
+        if (threads == 1 && !admit)
+            base = rate;
+
+        printf("cache: admission=%-3s threads=%2u lookups/s=%12.0f per-thread=%11.0f scaling=%5.2f hit=%5.2f%% writes=%lu\n",
+            admit ? "on" : "off", threads, rate, rate / threads, rate / base,
+            100.0 * hits / std::max<uint64_t>(total, 1), (unsigned long) writes.load());
+
+    }
+
+}
+
+static void bench_trie(size_t rules){
+
+    const char* tlds[] = { "com", "net", "org", "io", "info", "co.uk" };
+    std::mt19937_64 rng(7);
+
+    auto start = std::chrono::steady_clock::now();
+
+    dns::DomainTrie trie;
+    for (size_t i = 0; i < rules; i++){
+        std::string rule = "ads" + std::to_string(rng() % 16) + ".tracker" +
+            std::to_string(i / 4) + "." + tlds[i % 6];
+        trie.insert(i % 2 ? "*." + rule : rule);
+    }
+
+    double build = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<std::string> names;
+    for (size_t i = 0; i < 100000; i++)
+        names.push_back("cdn" + std::to_string(i) + ".ads" + std::to_string(rng() % 16) +
+            ".tracker" + std::to_string(rng() % (rules / 2)) + "." + tlds[rng() % 6]);
+
+    size_t matched = 0;
+    start = std::chrono::steady_clock::now();
+    for (int round = 0; round < 10; round++)
+        for (const std::string& name : names)
+            matched += trie.contains(name);
+    double lookup = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("trie: rules=%zu build=%.2fs memory=%.1fMB bytes/rule=%.1f lookup=%.0fns matched=%.1f%%\n",
+        trie.size(), build, trie.memory() / 1048576.0, (double) trie.memory() / trie.size(),
+        lookup * 1e9 / (names.size() * 10), 100.0 * matched / (names.size() * 10));
+
+}
+
+static void bench_send(unsigned peers, double seconds){
+
+    const size_t BURST = 32;
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    std::vector<int> socks;
+    std::vector<sockaddr_in> addrs;
+    for (unsigned p = 0; p < peers; p++){
+        int s = socket(AF_INET, SOCK_DGRAM, 0);
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(s, (sockaddr*) &addr, sizeof(addr));
+        socklen_t len = sizeof(addr);
+        getsockname(s, (sockaddr*) &addr, &len);
+        socks.push_back(s);
+        addrs.push_back(addr);
+    }
+
+    // A typical A reply, the receivers are never read so most are dropped
+    // by the kernel once their buffers fill up, as lost replies would be.
+    uint8_t reply[64];
+    memset(reply, 0x5a, sizeof(reply));
+
+    const char* modes[] = { "sendto", "sendmmsg", "sendmmsg+gso" };
+
+    for (int mode = 0; mode < 3; mode++){
+
+        dns::SendQueue queue(sock, mode == 2);
+        uint64_t replies = 0, calls = 0;
+        std::mt19937_64 rng(1);
+
+        auto start = std::chrono::steady_clock::now();
+        while (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < seconds){
+            for (size_t i = 0; i < BURST; i++){
+                const sockaddr_in& to = addrs[rng() % peers];
+                if (mode == 0){
+                    sendto(sock, reply, sizeof(reply), 0, (const sockaddr*) &to, sizeof(to));
+                    calls++;
+                }else
+                    queue.push(to, reply, sizeof(reply));
+            }
+            if (mode)
+                queue.flush();
+            replies += BURST;
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (mode)
+            calls = queue.syscalls();
+
+        printf("send: mode=%-12s peers=%u replies/s=%10.0f syscalls/reply=%.3f\n",
+            modes[mode], peers, replies / elapsed, (double) calls / replies);
+
+    }
+
+    for (int s : socks)
+        close(s);
+    close(sock);
+
+}
+
+static double bench_lookups(dns::Cache& cache, size_t names, int cpu, double seconds){
+
+    double rate = 0;
+    std::thread reader([&]() {
+        dns::Affinity::pin(cpu);
+        std::mt19937_64 rng(cpu);
+        uint64_t ops = 0;
+        auto start = std::chrono::steady_clock::now();
+        double elapsed = 0;
+        while (elapsed < seconds){
+            for (int i = 0; i < 1000; i++){
+                std::optional<std::vector<dns::Answer*>> ret = cache.get(
+                    dns::Question(bench_name(rng() % names), dns::Package::A_Type, dns::Package::IN_Class));
+                if (ret)
+                    for (dns::Answer* a : *ret)
+                        delete a;
+            }
+            ops += 1000;
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        rate = ops / elapsed;
+    });
+    reader.join();
+    return rate;
+
+}
+
+static void bench_numa(double seconds){
+
+    const size_t NAMES = 1000000;
+    std::vector<std::vector<int>> nodes = dns::Affinity::nodes();
+
+    printf("numa: %zu node(s) with CPUs\n", nodes.size());
+
+    for (size_t home = 0; home < nodes.size(); home++){
+
+        if (nodes[home].empty())
+            continue;
+
+        // Everything, tables and elements, first touched on home.
+        dns::Cache* cache = nullptr;
+        std::thread builder([&]() {
+            dns::Affinity::pin(nodes[home][0]);
+            cache = new dns::Cache();
+            for (size_t i = 0; i < NAMES; i++){
+                dns::Answer* a = new dns::A_Answer(bench_name(i), dns::Package::A_Type, dns::Package::IN_Class, 3600);
+                a->setRData(10, i >> 16, i >> 8, i);
+                cache->set(dns::Question(bench_name(i), dns::Package::A_Type, dns::Package::IN_Class),
+                    std::vector<dns::Answer*> (1, a));
+            }
+        });
+        builder.join();
+
+        for (size_t node = 0; node < nodes.size(); node++)
+            if (!nodes[node].empty())
+                printf("numa: cache on node %zu, reader on node %zu: lookups/s=%11.0f\n",
+                    home, node, bench_lookups(*cache, NAMES, nodes[node][0], seconds));
+
+        // Shard tables interleaved over the nodes, one share per node.
+        std::vector<std::thread> spread;
+        for (size_t node = 0; node < nodes.size(); node++)
+            spread.push_back(std::thread([&, node]() {
+                if (!nodes[node].empty()){
+                    dns::Affinity::pin(nodes[node][0]);
+                    cache->interleave(node, nodes.size());
+                }
+            }));
+        for (std::thread& t : spread)
+            t.join();
+
+        for (size_t node = 0; node < nodes.size(); node++)
+            if (!nodes[node].empty())
+                printf("numa: tables interleaved, elements on node %zu, reader on node %zu: lookups/s=%11.0f\n",
+                    home, node, bench_lookups(*cache, NAMES, nodes[node][0], seconds));
+
+        delete cache;
+
+    }
+
+}
+
+static void bench_zone(size_t records){
+
+    const char* path = "/tmp/simple_dns_bench.zone";
+    FILE* file = fopen(path, "w");
+    if (!file){
+        perror(path);
+        return;
+    }
+    fprintf(file, "$ORIGIN bench.example.\n$TTL 1h\n"
+        "@ SOA ns1 hostmaster 1 2h 30m 2w 5m\n@ NS ns1\n@ NS ns2\n"
+        "ns1 A 10.255.0.1\nns2 A 10.255.0.2\n");
+    size_t hosts = records / 5 + 1;
+    for (size_t i = 0; i < hosts; i++){
+        fprintf(file, "host%zu A 10.%zu.%zu.%zu\n", i, i >> 16 & 255, i >> 8 & 255, i & 255);
+        fprintf(file, " AAAA fd00::%zx:%zx\n", i >> 16, i & 0xffff);
+        fprintf(file, " MX 10 host%zu\n", (i + 1) % hosts);
+        fprintf(file, "_http._tcp.host%zu SRV 0 5 80 host%zu\n", i, i);
+        fprintf(file, "host%zu TXT \"id=%zu\"\n", i, i);
+    }
+    fclose(file);
+
+    auto start = std::chrono::steady_clock::now();
+    dns::Zones zones;
+    int loaded = zones.load(path);
+    double load = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (loaded < 0){
+        fprintf(stderr, "%s\n", zones.error().c_str());
+        return;
+    }
+
+    // 9 in 10 queries for a name of the zone, the rest NXDOMAIN.
+    std::mt19937_64 rng(7);
+    std::vector<std::vector<uint8_t>> queries;
+    std::vector<std::string> names;
+    for (size_t i = 0; i < 100000; i++){
+        size_t host = rng() % hosts;
+        std::string name = (i % 10 ? "host" : "missing") + std::to_string(host) + ".bench.example";
+        dns::Package q(i);
+        q.addQuestion(dns::Question(name, dns::Package::A_Type, dns::Package::IN_Class));
+        queries.push_back(q.dump());
+        names.push_back(name);
+    }
+
+    uint8_t out[BUF_SIZE];
+    size_t bytes = 0;
+    start = std::chrono::steady_clock::now();
+    for (int round = 0; round < 10; round++)
+        for (const std::vector<uint8_t>& q : queries)
+            bytes += zones.answer(q.data(), q.size(), out, sizeof(out));
+    double compiled = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    dns::Cache cache;
+    for (const std::string& name : names){
+        dns::A_Answer* a = new dns::A_Answer(name, dns::Package::A_Type, dns::Package::IN_Class, 3600);
+        a->setRData(10, 0, 0, 1);
+        cache.set(dns::Question(name, dns::Package::A_Type, dns::Package::IN_Class), { a });
+    }
+    dns::Resolver resolver(cache);
+    start = std::chrono::steady_clock::now();
+    for (int round = 0; round < 10; round++)
+        for (const std::vector<uint8_t>& q : queries){
+            dns::Package package(q.data(), q.size());
+            resolver.resolveLocal(package);
+            bytes += package.dump().size();
+        }
+    double generic = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("zone: records=%d names=%zu load=%.2fs memory=%.1fMB bytes/name=%.1f\n",
+        loaded, zones.size(), load, zones.memory() / 1048576.0, (double) zones.memory() / zones.size());
+    printf("zone: compiled=%.0fns/query package+resolver+dump=%.0fns/query (%zu bytes)\n",
+        compiled * 1e9 / (queries.size() * 10), generic * 1e9 / (queries.size() * 10), bytes);
+
+}
+
+// Owner names and the CNAME they point to, if any, shaped like what a
+// resolver of an office or an ISP caches.
+static std::vector<std::pair<std::string, std::string>> name_corpus(size_t entries){
+
+    static const char* regions[] = { "us-east-1", "eu-west-1", "ap-south-1", "us-west-2" };
+    static const char* words[] = { "assets", "static", "img", "media", "cdn", "files", "backup", "logs" };
+    std::mt19937_64 rng(45);
+    std::vector<std::pair<std::string, std::string>> corpus;
+    char name[128];
+
+    while (corpus.size() < entries){
+        unsigned long long r = rng();
+        switch (r % 10){
+            case 0: case 1: case 2:
+                snprintf(name, sizeof(name), "d%013llx.cloudfront.net", (r >> 8) & 0xFFFFFFFFFFFFFULL);
+                corpus.push_back({ name, "" });
+                break;
+            case 3: case 4: {
+                // www.siteN.com -> www.siteN.com.edgekey.net -> eN.x.akamaiedge.net
+                unsigned site = (r >> 8) % 1000000;
+                std::string www = "www.site" + std::to_string(site) + ".com";
+                snprintf(name, sizeof(name), "e%u.%c.akamaiedge.net", (unsigned) (r >> 32) % 100000, 'a' + (char) ((r >> 40) % 4));
+                corpus.push_back({ www, www + ".edgekey.net" });
+                corpus.push_back({ www + ".edgekey.net", name });
+                corpus.push_back({ name, "" });
+                break;
+            }
+            case 5: case 6:
+                snprintf(name, sizeof(name), "rr%u---sn-%05llx.googlevideo.com", (unsigned) (r >> 8) % 8 + 1, (r >> 16) & 0xFFFFF);
+                corpus.push_back({ name, "" });
+                break;
+            case 7: case 8:
+                snprintf(name, sizeof(name), "%s%u.s3.%s.amazonaws.com", words[(r >> 8) % 8], (unsigned) (r >> 16) % 100000, regions[(r >> 40) % 4]);
+                corpus.push_back({ name, "" });
+                break;
+            default:
+                snprintf(name, sizeof(name), "%s.example%u.org", (r >> 8) % 2 ? "api" : "mail", (unsigned) (r >> 16) % 1000000);
+                corpus.push_back({ name, "" });
+        }
+    }
+    corpus.resize(entries);
+    return corpus;
+
+}
+
+static void bench_names(size_t entries){
+
+    std::vector<std::pair<std::string, std::string>> corpus = name_corpus(entries);
+    size_t before = mallinfo2().uordblks;
+
+    dns::Cache* cache = new dns::Cache();
+    for (size_t i = 0; i < corpus.size(); i++){
+        const std::string& owner = corpus[i].first;
+        std::vector<dns::Answer*> rrset;
+        uint16_t type = corpus[i].second.empty() ? dns::Package::A_Type : dns::Package::CNAME_Type;
+        if (type == dns::Package::CNAME_Type){
+            dns::Answer* a = new dns::CNAME_Answer(owner, type, dns::Package::IN_Class, 300);
+            a->setRData(corpus[i].second);
+            rrset.push_back(a);
+        }else{
+            for (size_t n = 0; n < 1 + i % 4; n++){
+                dns::Answer* a = new dns::A_Answer(owner, type, dns::Package::IN_Class, 300);
+                a->setRData(10, i >> 16, i >> 8, n);
+                rrset.push_back(a);
+            }
+        }
+        cache->set(dns::Question(owner, type, dns::Package::IN_Class), rrset);
+    }
+    size_t after = mallinfo2().uordblks;
+
+    std::mt19937_64 rng(1);
+    size_t hits = 0, lookups = 1000000;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t n = 0; n < lookups; n++){
+        const std::pair<std::string, std::string>& entry = corpus[rng() % corpus.size()];
+        std::optional<std::vector<dns::Answer*>> ret = cache->get(dns::Question(entry.first,
+            entry.second.empty() ? dns::Package::A_Type : dns::Package::CNAME_Type, dns::Package::IN_Class));
+        if (ret){
+            hits++;
+            for (dns::Answer* a : *ret)
+                delete a;
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t text = 0;
+    for (auto& entry : corpus)
+        text += entry.first.size();
+    printf("names: entries=%zu name bytes/entry=%.1f heap=%.1fMB bytes/entry=%.1f\n",
+        entries, (double) text / entries, (after - before) / 1048576.0, (double) (after - before) / entries);
+    printf("names: hit=%.0fns (%zu of %zu found)\n", elapsed * 1e9 / lookups, hits, lookups);
+    printf("names: labels=%zu interned in %.1fMB\n", dns::Names::instance().size(),
+        dns::Names::instance().memory() / 1048576.0);
+
+    delete cache;
+
+}
+
+static void bench_sketch(size_t queries){
+
+    const size_t names = 100000, top = 100;
+
+    // 1/rank popularity, as DNS traffic roughly is.
+    std::vector<double> cdf(names);
+    double sum = 0;
+    for (size_t i = 0; i < names; i++)
+        cdf[i] = (sum += 1.0 / (i + 1));
+    std::mt19937_64 rng(1);
+    std::uniform_real_distribution<double> uniform(0, sum);
+
+    // Queries back to back, each as hot in cache as a datagram just read.
+    std::vector<std::string> stream(queries);
+    std::vector<uint8_t> wire;
+    std::vector<size_t> offsets(queries + 1);
+    std::map<std::string, uint64_t> exact;
+    for (size_t i = 0; i < queries; i++){
+        if (rng() % 10 < 3)
+            stream[i] = "once" + std::to_string(i) + ".bench.example.com";
+        else
+            stream[i] = bench_name(std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) - cdf.begin());
+        dns::Package p(i);
+        p.addQuestion(dns::Question(stream[i], dns::Package::A_Type, dns::Package::IN_Class));
+        std::vector<uint8_t> query = p.dump();
+        offsets[i] = wire.size();
+        wire.insert(wire.end(), query.begin(), query.end());
+        exact[stream[i]]++;
+    }
+    offsets[queries] = wire.size();
+
+    dns::HeavyHitters::enable(top);
+    dns::HeavyHitters* hitters = dns::HeavyHitters::local();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < queries; i++)
+        hitters->query(&wire[offsets[i]], offsets[i + 1] - offsets[i], htonl(0x0A000000 + i % 1000));
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // The true top 100 against the names dump() reports.
+    std::vector<std::pair<uint64_t, std::string>> sorted;
+    for (auto& entry : exact)
+        sorted.push_back(std::make_pair(entry.second, entry.first));
+    std::sort(sorted.rbegin(), sorted.rend());
+    std::set<std::string> truth;
+    for (size_t i = 0; i < top && i < sorted.size(); i++)
+        truth.insert(sorted[i].second);
+
+    char* report = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&report, &size);
+    dns::HeavyHitters::dump(out);
+    fclose(out);
+    std::istringstream lines(report);
+    std::string line, section;
+    size_t found = 0;
+    while (getline(lines, line)){
+        if (line.size() && line[0] != ' ')
+            section = line;
+        else if (section == "names:" && truth.count(line.substr(line.rfind(' ') + 1)))
+            found++;
+    }
+    free(report);
+
+    printf("sketch: queries=%zu distinct=%zu %.1fns/query (names, clients)\n",
+        queries, exact.size(), elapsed * 1e9 / queries);
+    printf("sketch: top %zu found %zu, heaviest %lu queries\n", top, found, (unsigned long) sorted[0].first);
+
+    for (int admit = 0; admit < 2; admit++){
+        dns::TinyLfu lfu(2);
+        size_t before = mallinfo2().uordblks;
+        dns::Cache* cache = new dns::Cache();
+        if (admit)
+            cache->setAdmission(&lfu);
+        size_t hits = 0;
+        for (size_t i = 0; i < queries; i++){
+            dns::Question q(stream[i], dns::Package::A_Type, dns::Package::IN_Class);
+            std::optional<std::vector<dns::Answer*>> ret = cache->get(q, true);
+            if (ret){
+                hits++;
+                for (dns::Answer* a : *ret)
+                    delete a;
+                continue;
+            }
+            dns::Answer* a = new dns::A_Answer(stream[i], dns::Package::A_Type, dns::Package::IN_Class, 3600);
+            a->setRData(10, i >> 16, i >> 8, i);
+            cache->set(q, std::vector<dns::Answer*> (1, a));
+        }
+        size_t after = mallinfo2().uordblks;
+        printf("sketch: admission %s: hit ratio %.1f%%, cache heap %.1fMB%s\n", admit ? "on " : "off",
+            100.0 * hits / queries, (after - before) / 1048576.0,
+            admit ? (" (+" + std::to_string(lfu.memory() >> 10) + "KB sketch)").c_str() : "");
+        delete cache;
+    }
+
+}
+
+// The query with QR set and one A record, as the stub upstreams answer.
+static std::vector<uint8_t> stub_reply(const uint8_t* query, size_t size){
+    static const uint8_t rr[] = { 0xC0, 0x0C, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4, 10, 0, 0, 1 };
+    std::vector<uint8_t> reply(query, query + size);
+    reply[2] = 0x81;
+    reply[3] = 0x80;
+    reply[7] = 1;
+    reply.insert(reply.end(), rr, rr + sizeof(rr));
+    return reply;
+}
+
+static int stub_socket(int type, uint16_t& port){
+    int fd = socket(AF_INET, type, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    bind(fd, (struct sockaddr*) &addr, sizeof(addr));
+    getsockname(fd, (struct sockaddr*) &addr, &len);
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static void bench_tcp(size_t queries){
+
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> stubs;
+    uint16_t udpPort, tcpPort;
+
+    int udp = stub_socket(SOCK_DGRAM, udpPort);
+    timeval tick = { 0, 100000 };
+    setsockopt(udp, SOL_SOCKET, SO_RCVTIMEO, &tick, sizeof(tick));
+    stubs.push_back(std::thread([&]() {
+        uint8_t buffer[BUF_SIZE];
+        sockaddr_in from;
+        while (!stop){
+            socklen_t fromlen = sizeof(from);
+            ssize_t n = recvfrom(udp, buffer, sizeof(buffer), 0, (struct sockaddr*) &from, &fromlen);
+            if (n < 12)
+                continue;
+            std::vector<uint8_t> reply = stub_reply(buffer, n);
+            sendto(udp, reply.data(), reply.size(), 0, (struct sockaddr*) &from, fromlen);
+        }
+    }));
+
+    // Every frame read in one go is answered, last first.
+    int listener = stub_socket(SOCK_STREAM, tcpPort);
+    listen(listener, 64);
+    std::vector<int> accepted;
+    std::mutex acceptedLock;
+    stubs.push_back(std::thread([&]() {
+        int fd;
+        while ((fd = accept(listener, NULL, NULL)) >= 0){
+            std::lock_guard<std::mutex> guard(acceptedLock);
+            accepted.push_back(fd);
+            stubs.push_back(std::thread([fd]() {
+                std::vector<uint8_t> in;
+                uint8_t buffer[65536];
+                size_t served = 0;
+                ssize_t n;
+                while (served < 500 && (n = recv(fd, buffer, sizeof(buffer), 0)) > 0){
+                    in.insert(in.end(), buffer, buffer + n);
+                    std::vector<std::vector<uint8_t>> replies;
+                    size_t at = 0;
+                    while (in.size() - at >= 2 && in.size() - at >= 2u + (in[at] << 8 | in[at + 1])){
+                        size_t size = in[at] << 8 | in[at + 1];
+                        replies.push_back(stub_reply(in.data() + at + 2, size));
+                        at += 2 + size;
+                    }
+                    in.erase(in.begin(), in.begin() + at);
+                    std::vector<uint8_t> out;
+                    for (auto it = replies.rbegin(); it != replies.rend(); it++){
+                        out.push_back(it->size() >> 8);
+                        out.push_back(it->size());
+                        out.insert(out.end(), it->begin(), it->end());
+                    }
+                    send(fd, out.data(), out.size(), MSG_NOSIGNAL);
+                    served += replies.size();
+                }
+                shutdown(fd, SHUT_RDWR);
+            }));
+        }
+    }));
+
+    for (int transport = 0; transport < 2; transport++){
+        for (unsigned threads : { 1, 8, 32 }){
+
+            dns::Cache cache;
+            dns::TcpUpstream stream;
+            std::string upstream = transport ? "tcp://127.0.0.1:" + std::to_string(tcpPort)
+                : "127.0.0.1:" + std::to_string(udpPort);
+            dns::Resolver resolver(cache, upstream);
+            resolver.setStream(&stream);
+
+            std::atomic<uint64_t> failed(0);
+            std::vector<std::thread> clients;
+            auto start = std::chrono::steady_clock::now();
+            for (unsigned t = 0; t < threads; t++){
+                clients.push_back(std::thread([&, t]() {
+                    for (size_t i = t; i < queries; i += threads){
+                        dns::Package package(i);
+                        package.addQuestion(dns::Question(bench_name(i), dns::Package::A_Type, dns::Package::IN_Class));
+                        resolver.resolve(package);
+                        if (package.getRCode() != dns::Package::Ok_ResponseType || package.getAnswers().empty())
+                            failed++;
+                    }
+                }));
+            }
+            for (std::thread& client : clients)
+                client.join();
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            dns::TcpUpstream::Stats stats = stream.stats();
+            printf("tcp: %s threads=%u queries/s=%.0f failed=%lu", transport ? "tcp" : "udp", threads,
+                queries / elapsed, (unsigned long) failed.load());
+            if (transport)
+                printf(" connects=%lu retries=%lu", (unsigned long) stats.connects, (unsigned long) stats.retries);
+            printf("\n");
+
+        }
+    }
+
+    stop = true;
+    shutdown(listener, SHUT_RDWR);
+    {
+        std::lock_guard<std::mutex> guard(acceptedLock);
+        for (int fd : accepted)
+            shutdown(fd, SHUT_RDWR);
+    }
+    for (size_t i = 0; i < 2; i++)
+        stubs[i].join();
+    std::lock_guard<std::mutex> guard(acceptedLock);
+    for (size_t i = 2; i < stubs.size(); i++)
+        stubs[i].join();
+    close(listener);
+    close(udp);
+
+}
+
+int main(int argc, char **argv){
+
+    std::string mode = argc > 1 ? argv[1] : "cache";
+
+    if (mode == "cache"){
+        unsigned threads = argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency();
+        double seconds = argc > 3 ? atof(argv[3]) : 2;
+        bench_cache(threads ? threads : 1, seconds);
+    }else if (mode == "trie"){
+        bench_trie(argc > 2 ? atol(argv[2]) : 1000000);
+    }else if (mode == "send"){
+        unsigned peers = argc > 2 ? atoi(argv[2]) : 4;
+        bench_send(peers ? peers : 1, argc > 3 ? atof(argv[3]) : 1);
+    }else if (mode == "zone"){
+        bench_zone(argc > 2 ? atol(argv[2]) : 500000);
+    }else if (mode == "tcp"){
+        bench_tcp(argc > 2 ? atol(argv[2]) : 20000);
+    }else if (mode == "names"){
+        bench_names(argc > 2 ? atol(argv[2]) : 1000000);
+    }else if (mode == "sketch"){
+        bench_sketch(argc > 2 ? atol(argv[2]) : 1000000);
+    }else if (mode == "numa"){
+        bench_numa(argc > 2 ? atof(argv[2]) : 1);
+    }else{
+        fprintf(stderr, "usage: %s cache [THREADS] [SECONDS] | trie [RULES] | send [PEERS] [SECONDS] | zone [RECORDS] | tcp [QUERIES] | names [ENTRIES] | sketch [QUERIES] | numa [SECONDS]\n", argv[0]);
+        return 1;
+    }
+
+    return 0;
+
+}
@@ -0,0 +1,438 @@
+/**
+  * Simple DNS Server pcap replay
+  *
+  * ./simple_dns_replay [-p PORT] [-h HOSTS] [-r] FILE.pcap
+  *
+  * Feeds the queries of a capture through Package, Resolver and Cache in
+  * process, as fast as possible or at the pace they were captured (-r).
+  * As fast as possible, the cache counts TTLs down on the capture times,
+  * so what expired during the capture expires during the replay too.
+  * Misses are answered by a simulated upstream from the responses found in
+  * the same capture, so nothing goes to the network. Reports CPU time and
+  * allocations per stage, the cache hit ratio and the rcodes returned.
+  *
+  * Queries are the UDP datagrams to PORT (53 by default), responses the
+  * ones from it. Ethernet, Linux cooked (v1 and v2), raw IP and BSD
+  * loopback captures are read, IPv4 and IPv6, fragments are skipped.
+  **/
+
+#include <getopt.h>
+#include <stdio.h>
+#include <time.h>
+#include <unordered_map>
+#include <chrono>
+#include <thread>
+
+#include "Dns.hpp"
+
+// Every allocation of the process goes through these, stages read the
+// counters before and after. Every form of new and delete is replaced, on
+// top of malloc() and free(), kept out of line so that the compiler never
+// pairs a new expression with the free() inside them.
+
+static uint64_t allocations = 0;
+static uint64_t allocated = 0;
+
+__attribute__((noinline)) static void* allocate(size_t size){
+    allocations++;
+    allocated += size;
+    void* p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+__attribute__((noinline)) static void release(void* p) noexcept {
+    free(p);
+}
+
+void* operator new(size_t size){
+    return allocate(size);
+}
+
+void* operator new[](size_t size){
+    return allocate(size);
+}
+
+void operator delete(void* p) noexcept {
+    release(p);
+}
+
+void operator delete[](void* p) noexcept {
+    release(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    release(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    release(p);
+}
+
+struct Datagram {
+    double time;
+    bool response;
+    std::vector<uint8_t> payload;
+};
+
+static uint16_t be16(const uint8_t* p){
+    return p[0] << 8 | p[1];
+}
+
+static uint32_t read32(const uint8_t* p, bool swapped){
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return swapped ? __builtin_bswap32(v) : v;
+}
+
+// Payload of a UDP datagram to or from port in frame, false if it is not
+// one.
+static bool udpPayload(const uint8_t* frame, size_t len, uint32_t linktype, uint16_t port,
+    const uint8_t*& payload, size_t& size, bool& response){
+
+    size_t offset;
+    uint16_t proto;
+
+    switch (linktype){
+        case 1:     // Ethernet
+            if (len < 14)
+                return false;
+            proto = be16(frame + 12);
+            offset = 14;
+            if (proto == 0x8100 && len >= 18){
+                proto = be16(frame + 16);
+                offset = 18;
+            }
+            break;
+        case 113:   // Linux cooked
+            if (len < 16)
+                return false;
+            proto = be16(frame + 14);
+            offset = 16;
+            break;
+        case 276:   // Linux cooked v2
+            if (len < 20)
+                return false;
+            proto = be16(frame);
+            offset = 20;
+            break;
+        case 12:
+        case 101:   // raw IP
+            if (len < 1)
+                return false;
+            proto = (frame[0] >> 4) == 6 ? 0x86DD : 0x0800;
+            offset = 0;
+            break;
+        case 0:     // BSD loopback, family in host order
+            if (len < 4)
+                return false;
+            proto = (frame[0] == 2 || frame[3] == 2) ? 0x0800 : 0x86DD;
+            offset = 4;
+            break;
+        default:
+            return false;
+    }
+
+    const uint8_t* ip = frame + offset;
+    size_t left = len - offset;
+    const uint8_t* udp;
+
+    if (proto == 0x0800){
+        if (left < 20 || (ip[0] >> 4) != 4 || ip[9] != IPPROTO_UDP)
+            return false;
+        if (be16(ip + 6) & 0x3FFF)
+            return false;   // fragment
+        size_t ihl = (ip[0] & 0x0F) * 4;
+        if (ihl < 20 || left < ihl + 8)
+            return false;
+        udp = ip + ihl;
+        left -= ihl;
+    }else if (proto == 0x86DD){
+        if (left < 48 || (ip[0] >> 4) != 6 || ip[6] != IPPROTO_UDP)
+            return false;
+        udp = ip + 40;
+        left -= 40;
+    }else
+        return false;
+
+    size_t udpLen = be16(udp + 4);
+    if (udpLen < 8 || udpLen > left)
+        return false;
+
+    if (be16(udp + 2) == port)
+        response = false;
+    else if (be16(udp) == port)
+        response = true;
+    else
+        return false;
+
+    payload = udp + 8;
+    size = udpLen - 8;
+    return true;
+
+}
+
+static bool readPcap(const char* path, uint16_t port, std::vector<Datagram>& out, size_t& skipped){
+
+    std::ifstream file(path, std::ios::binary);
+    uint8_t header[24];
+    if (!file.read((char*) header, sizeof(header)))
+        return false;
+
+    uint32_t magic;
+    memcpy(&magic, header, 4);
+    bool swapped, nano;
+    switch (magic){
+        case 0xa1b2c3d4: swapped = false; nano = false; break;
+        case 0xa1b23c4d: swapped = false; nano = true; break;
+        case 0xd4c3b2a1: swapped = true; nano = false; break;
+        case 0x4d3cb2a1: swapped = true; nano = true; break;
+        default:
+            return false;
+    }
+    uint32_t linktype = read32(header + 20, swapped) & 0xFFFF;
+
+    uint8_t record[16];
+    std::vector<uint8_t> frame;
+
+    while (file.read((char*) record, sizeof(record))){
+
+        uint32_t sec = read32(record, swapped);
+        uint32_t frac = read32(record + 4, swapped);
+        uint32_t caplen = read32(record + 8, swapped);
+        if (caplen > 262144)
+            return false;
+        frame.resize(caplen);
+        if (!file.read((char*) frame.data(), caplen))
+            break;
+
+        const uint8_t* payload;
+        size_t size;
+        bool response;
+        // Header only packets and responses without the QR bit are noise.
+        if (!udpPayload(frame.data(), caplen, linktype, port, payload, size, response) ||
+            size < 12 || response != (bool) (payload[2] & 0x80)){
+            skipped++;
+            continue;
+        }
+
+        Datagram d;
+        d.time = sec + frac / (nano ? 1e9 : 1e6);
+        d.response = response;
+        d.payload.assign(payload, payload + size);
+        out.push_back(d);
+
+    }
+
+    return true;
+
+}
+
+// "name/type/class" of the first question, lower case, empty if none.
+static std::string questionKey(const uint8_t* data, size_t size){
+
+    try {
+        dns::WireReader in(data, data + size);
+        in.need(12);
+        in.buffer += 4;
+        if (in.get16bits() == 0)
+            return "";
+        in.buffer += 6;
+        std::string name = in.decodeDomain();
+        for (char& c : name)
+            c = tolower(c);
+        uint16_t type = in.get16bits();
+        uint16_t klass = in.get16bits();
+        return name + "/" + std::to_string(type) + "/" + std::to_string(klass);
+    } catch (dns::FormatError& e) {
+        return "";
+    }
+
+}
+
+// Answers from the responses of the capture, the first one recorded for
+// a question, with the ID of the query.
+struct RecordedUpstream: public dns::Upstream {
+
+    std::unordered_map<std::string, std::vector<uint8_t>> responses;
+    uint64_t asked, answered;
+
+    RecordedUpstream(): asked(0), answered(0) {}
+
+    void record(const std::vector<uint8_t>& response){
+        std::string key = questionKey(response.data(), response.size());
+        if (!key.empty() && response.size() <= BUF_SIZE)
+            responses.emplace(key, response);
+    }
+
+    ssize_t exchange(const std::vector<uint8_t>& query, const sockaddr_in& server, uint8_t* res){
+
+        asked++;
+        auto it = responses.find(questionKey(query.data(), query.size()));
+        if (it == responses.end())
+            return -1;
+        answered++;
+        memcpy(res, it->second.data(), it->second.size());
+        memcpy(res, query.data(), 2);
+        return it->second.size();
+
+    }
+
+};
+
+struct Stage {
+    const char* name;
+    uint64_t calls;
+    double cpu;
+    uint64_t allocations;
+    uint64_t bytes;
+};
+
+static double cpuNow(){
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs f and charges its CPU time and allocations to stage.
+template <class F>
+static void measure(Stage& stage, F f){
+    uint64_t a = allocations, b = allocated;
+    double start = cpuNow();
+    f();
+    stage.cpu += cpuNow() - start;
+    stage.allocations += allocations - a;
+    stage.bytes += allocated - b;
+    stage.calls++;
+}
+
+static void printStage(const Stage& s){
+    uint64_t calls = std::max<uint64_t>(s.calls, 1);
+    printf("%-10s %10lu %10.1f %10.0f %12.1f %12.1f\n", s.name, (unsigned long) s.calls,
+        s.cpu * 1e3, s.cpu * 1e9 / calls, (double) s.allocations / calls, (double) s.bytes / calls);
+}
+
+// Time of the query being replayed, the cache clock without -r.
+static time_t captured = 0;
+
+static time_t capturedTime(time_t* t){
+    if (t)
+        *t = captured;
+    return captured;
+}
+
+int main(int argc, char **argv){
+
+    uint16_t port = 53;
+    const char* hosts = NULL;
+    bool realtime = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:h:r")) != -1){
+        switch (opt){
+            case 'p': port = atoi(optarg); break;
+            case 'h': hosts = optarg; break;
+            case 'r': realtime = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-p PORT] [-h HOSTS] [-r] FILE.pcap\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc){
+        fprintf(stderr, "usage: %s [-p PORT] [-h HOSTS] [-r] FILE.pcap\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<Datagram> capture;
+    size_t skipped = 0;
+    if (!readPcap(argv[optind], port, capture, skipped)){
+        fprintf(stderr, "%s: not a pcap file\n", argv[optind]);
+        return 1;
+    }
+
+    RecordedUpstream upstream;
+    size_t queries = 0;
+    for (Datagram& d : capture){
+        if (d.response)
+            upstream.record(d.payload);
+        else
+            queries++;
+    }
+
+    dns::Cache cache;
+    if (!realtime){
+        captured = capture.empty() ? 0 : (time_t) capture[0].time;
+        cache.setClock(capturedTime);
+    }
+    if (hosts)
+        cache.load(hosts);
+    cache.resetStats();
+    dns::Resolver resolver(cache);
+    resolver.setUpstream(&upstream);
+
+    Stage parse = { "parse", 0, 0, 0, 0 };
+    Stage resolve = { "resolve", 0, 0, 0, 0 };
+    Stage dump = { "dump", 0, 0, 0, 0 };
+    uint64_t rcodes[16] = { 0 };
+    uint64_t malformed = 0;
+
+    auto wallStart = std::chrono::steady_clock::now();
+    double first = capture.empty() ? 0 : capture[0].time;
+
+    for (Datagram& d : capture){
+
+        if (d.response)
+            continue;
+
+        if (realtime)
+            std::this_thread::sleep_until(wallStart + std::chrono::duration<double>(d.time - first));
+        else
+            captured = (time_t) d.time;
+
+        dns::Package* package = NULL;
+        measure(parse, [&]() {
+            try {
+                package = new dns::Package(d.payload.data(), d.payload.size());
+            } catch (dns::FormatError& e) {
+                package = NULL;
+            }
+        });
+        if (!package){
+            malformed++;
+            continue;
+        }
+
+        measure(resolve, [&]() { resolver.resolve(*package); });
+        measure(dump, [&]() { package->dump(); });
+
+        rcodes[package->getRCode()]++;
+        delete package;
+
+    }
+
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+    printf("replay: %zu queries, %zu recorded responses (%zu questions), %zu packets skipped, %.3fs wall\n",
+        queries, capture.size() - queries, upstream.responses.size(), skipped, wall);
+    printf("%-10s %10s %10s %10s %12s %12s\n", "stage", "calls", "cpu ms", "ns/call", "allocs/call", "bytes/call");
+    printStage(parse);
+    printStage(resolve);
+    printStage(dump);
+
+    dns::Cache::Stats stats = cache.stats();
+    uint64_t lookups = stats.hits + stats.misses;
+    printf("cache: lookups=%lu hits=%lu misses=%lu hit ratio=%.2f%%\n",
+        (unsigned long) lookups, (unsigned long) stats.hits, (unsigned long) stats.misses,
+        100.0 * stats.hits / std::max<uint64_t>(lookups, 1));
+    printf("upstream: asked=%lu answered=%lu unanswered=%lu\n",
+        (unsigned long) upstream.asked, (unsigned long) upstream.answered,
+        (unsigned long) (upstream.asked - upstream.answered));
+    printf("rcodes: noerror=%lu formerr=%lu servfail=%lu nxdomain=%lu notimp=%lu refused=%lu malformed=%lu\n",
+        (unsigned long) rcodes[0], (unsigned long) rcodes[1], (unsigned long) rcodes[2],
+        (unsigned long) rcodes[3], (unsigned long) rcodes[4], (unsigned long) rcodes[5],
+        (unsigned long) malformed);
+
+    return 0;
+
+}
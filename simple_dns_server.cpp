@@ -15,59 +15,451 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <signal.h>
+#include <errno.h>
 #include <vector>
+#include <atomic>
+#include <pthread.h>
 
-#define BUF_SIZE 256
+#define BUF_SIZE 512
 
 #include "args.h"
 #include "Dns.hpp"
+#include "Doh.hpp"
+#include "FastPath.hpp"
+#include "RateLimit.hpp"
+#include "Snapshot.hpp"
+#include "SendQueue.hpp"
+#include "Affinity.hpp"
+#include "Zone.hpp"
+#include "SharedCache.hpp"
+#include "Peers.hpp"
+#include "TcpUpstream.hpp"
+#include "Handoff.hpp"
+#include "Sketch.hpp"
+
+// Datagrams read per recvmmsg() call.
+#define RECV_BATCH 32
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+// Seconds the DoH requests read before a handoff get to be answered.
+#define DRAIN_SECONDS 5
+
+// One event loop thread with its own SO_REUSEPORT socket. The thread
+// allocates it once pinned, so its buffers sit on its NUMA node.
+struct Worker {
+	int id;
+	int cpu;	// -1 when not pinned
+	int sock;
+	struct event_base *base;
+	struct event udp_event;
+	struct event stop_event;
+	dns::SendQueue *replies;
+	dns::RateLimiter *limiter;
+	uint8_t bufs[RECV_BATCH][BUF_SIZE];
+	struct sockaddr_in clients[RECV_BATCH];
+	struct iovec iovs[RECV_BATCH];
+	struct mmsghdr msgs[RECV_BATCH];
+};
 
 dns::Cache cache;
+dns::DomainTrie blocklist;
+dns::Zones zones;
+dns::Resolver *resolver;
+dns::Forwarder *forwarder;
+dns::TcpUpstream stream;
+std::vector<int> cpus;
+std::atomic<bool> stopping(false);
+// Set once the next binary has the sockets.
+std::atomic<bool> handed(false);
+// Every listening socket, each worker's included, as handed to the next
+// binary with -U.
+dns::Handoff::Sockets listening;
+dns::TinyLfu *admission;
+dns::Peers *peers = NULL;
+
+static void answer(Worker *worker, uint8_t *query, ssize_t len, const struct sockaddr_in &client){
+
+	// Counted before rate limiting, which the counts help tune.
+	dns::HeavyHitters *hitters = dns::HeavyHitters::local();
+	if (hitters)
+		hitters->query(query, len, client.sin_addr.s_addr);
+
+	if (worker->limiter->enabled()) {
+		switch (worker->limiter->check(client.sin_addr.s_addr, query, len, dns::RateLimiter::now())) {
+			case dns::RateLimiter::Pass:
+				break;
+			case dns::RateLimiter::Drop:
+				return;
+			case dns::RateLimiter::Slip:
+				len = dns::RateLimiter::truncate(query, len);
+				if (len)
+					worker->replies->push(client, query, len);
+				return;
+		}
+	}
+
+	// Names of the loaded zones are answered from their compiled replies.
+	uint8_t reply[BUF_SIZE];
+	size_t n = resolver->authoritative(query, len, reply, sizeof(reply));
+	if (n) {
+		if (hitters && (reply[3] & 0x0F) == dns::Package::NameError_ResponseType)
+			hitters->nxdomain(query, len);
+		worker->replies->push(client, reply, n);
+		return;
+	}
+
+	std::vector<uint8_t> vout;
+	dns::Trace trace;
+
+	try {
+
+		dns::Package package(query, len);
+		trace.mark(dns::Tracer::Parse);
+
+		if (arguments.verbose)
+			package.prettyPrint();
+
+		resolver->resolve(package);
+		trace.mark(dns::Tracer::Resolve);
+
+		if (arguments.verbose)
+			package.prettyPrint();
+
+		// Answers fetched over TCP can be longer than the client takes.
+		vout = package.dump(package.udpSize());
+		trace.mark(dns::Tracer::Dump);
+		if (hitters && package.getRCode() == dns::Package::NameError_ResponseType)
+			hitters->nxdomain(query, len);
+
+		const std::vector<dns::Question>& questions = package.getQuestions();
+		trace.finish(client.sin_addr.s_addr, questions.empty() ? "" : questions[0].qName,
+			questions.empty() ? 0 : questions[0].qType, package.getRCode());
+
+	} catch (dns::FormatError& e) {
+
+		if (arguments.verbose)
+			printf("Malformed package: %s\n", e.what());
+		vout = dns::Package::formatError(query, len);
+
+	}
 
+	worker->replies->push(client, vout.data(), vout.size());
+
+}
+
+// Reads up to RECV_BATCH queries in one call and sends their replies
+// together. Anything left is read on the next loop iteration.
 static void udp_cb(const int sock, short int which, void *arg){
 
-	struct sockaddr_in server_sin;
-	socklen_t server_sz = sizeof(server_sin);
-	uint8_t buf[BUF_SIZE];
-	memset(buf, 0, BUF_SIZE);
-	
-	if (recvfrom(sock, &buf, sizeof(buf) - 1, 0, (struct sockaddr *) &server_sin, &server_sz) == -1) {
-		perror("recvfrom()");
-		event_loopbreak();
+	Worker *worker = (Worker *) arg;
+	dns::Tracer *tracer = dns::Tracer::local();
+	uint64_t start = tracer ? dns::Tracer::now() : 0;
+
+	for (int i = 0; i < RECV_BATCH; i++) {
+		worker->iovs[i].iov_base = worker->bufs[i];
+		worker->iovs[i].iov_len = BUF_SIZE;
+		memset(&worker->msgs[i], 0, sizeof(worker->msgs[i]));
+		worker->msgs[i].msg_hdr.msg_name = &worker->clients[i];
+		worker->msgs[i].msg_hdr.msg_namelen = sizeof(worker->clients[i]);
+		worker->msgs[i].msg_hdr.msg_iov = &worker->iovs[i];
+		worker->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int n = recvmmsg(sock, worker->msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+	if (n == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return;
+		perror("recvmmsg()");
+		event_base_loopbreak(worker->base);
+		return;
+	}
+	if (tracer)
+		tracer->record(dns::Tracer::Recv, dns::Tracer::now() - start);
+
+	for (int i = 0; i < n; i++)
+		answer(worker, worker->bufs[i], worker->msgs[i].msg_len, worker->clients[i]);
+
+	if (tracer)
+		start = dns::Tracer::now();
+	if (!worker->replies->flush())
+		perror("sendmmsg()");
+	if (tracer)
+		tracer->record(dns::Tracer::Send, dns::Tracer::now() - start);
+
+}
+
+// Threads other than the main one check once a second whether to stop.
+static void stop_cb(const int fd, short int which, void *arg){
+
+	Worker *worker = (Worker *) arg;
+	if (stopping)
+		event_base_loopbreak(worker->base);
+
+}
+
+// The socket of worker id, bound before the threads start. Exits if it
+// cannot be bound.
+static int open_socket(int id){
+
+	int one = 1;
+	struct sockaddr_in sin;
+
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	// Processes sharing a cache also share the port.
+	if (arguments.threads > 1 || arguments.shared_cache)
+		setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = INADDR_ANY;
+	sin.sin_port = htons(arguments.port);
+	if (bind(sock, (struct sockaddr *) &sin, sizeof(sin))) {
+		perror("bind()");
+		exit(EXIT_FAILURE);
 	}
 
-	dns::Resolver resolver(cache);
-	
-	dns::Package package(buf);
-	
-	if (arguments.verbose)
-		package.prettyPrint();
+	return sock;
+
+}
+
+// Pins the calling thread and builds its worker on base.
+static Worker *start_worker(int id, struct event_base *base){
+
+	Worker *worker;
+
+	int cpu = cpus.empty() ? -1 : cpus[id];
+	if (cpu >= 0 && !dns::Affinity::pin(cpu))
+		fprintf(stderr, "Cannot pin thread %d to CPU %d\n", id, cpu);
+
+	worker = new Worker();
+	worker->id = id;
+	worker->cpu = cpu;
+	worker->base = base;
+	worker->limiter = new dns::RateLimiter(arguments.rate_limit, arguments.rrl, arguments.slip);
+
+	worker->sock = listening.udp[id];
+	// Lets the kernel hand this socket the queries whose RX queue
+	// interrupts land on the same CPU.
+	if (cpu >= 0)
+		setsockopt(worker->sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+
+	worker->replies = new dns::SendQueue(worker->sock);
+
+	// Pinned threads interleave the shard tables over their nodes.
+	if (cpu >= 0)
+		cache.interleave(id, arguments.threads);
+
+	event_set(&worker->udp_event, worker->sock, EV_READ|EV_PERSIST, udp_cb, worker);
+	event_base_set(base, &worker->udp_event);
+	event_add(&worker->udp_event, 0);
+
+	return worker;
+
+}
+
+static void stop_worker(Worker *worker){
+
+	event_del(&worker->udp_event);
+	close(worker->sock);
+	delete worker->replies;
+	delete worker->limiter;
+	delete worker;
+
+}
+
+static void *worker_main(void *arg){
+
+	struct timeval stop_interval = { 1, 0 };
+	struct event_base *base = event_base_new();
+	Worker *worker = start_worker((int) (intptr_t) arg, base);
+
+	event_set(&worker->stop_event, -1, EV_PERSIST, stop_cb, worker);
+	event_base_set(base, &worker->stop_event);
+	event_add(&worker->stop_event, &stop_interval);
+
+	event_base_dispatch(base);
+
+	event_del(&worker->stop_event);
+	stop_worker(worker);
+	event_base_free(base);
+	return NULL;
+
+}
+
+static void expire_cb(const int fd, short int which, void *arg){
+
+	cache.expire();
+
+}
+
+static void snapshot_cb(const int fd, short int which, void *arg){
+
+	if (!dns::Snapshot::save(cache, arguments.snapshot))
+		perror("snapshot");
+
+}
+
+static void reload_cb(const int sig, short int which, void *arg){
+
+	int zones = forwarder->reload(arguments.forward);
+	if (zones < 0)
+		fprintf(stderr, "Invalid forwarding table %s, keeping the current one\n", arguments.forward);
+	else if (!arguments.quiet)
+		printf("Loaded %d forwarding zones from %s\n", zones, arguments.forward);
+
+}
+
+static void stop_loop(){
+
+	if (arguments.snapshot)
+		snapshot_cb(-1, 0, NULL);
+	stopping = true;
+	event_loopbreak();
+
+}
+
+// Stops once the DoH requests in flight are answered, or at the deadline.
+// Idle twice in a row, so the last replies are written out first.
+static void drain_cb(const int fd, short int which, void *arg){
 
-	resolver.resolve(package);
+	static int idle = 0;
+	static time_t deadline = time(NULL) + DRAIN_SECONDS;
+	dns::DohServer *doh = (dns::DohServer *) arg;
 
-	if (arguments.verbose)
-		package.prettyPrint();
+	idle = doh->idle() ? idle + 1 : 0;
+	if (idle >= 2 || time(NULL) >= deadline)
+		stop_loop();
 
-	std::vector<uint8_t> vout = package.dump();
-	size_t out_size = vout.size();
-	std::string out(vout.begin(), vout.end());
+}
+
+static void terminate_cb(const int sig, short int which, void *arg){
+
+	static struct event drain_event;
+	static bool draining = false;
+	struct timeval drain_interval = { 0, 100000 };
+	dns::DohServer *doh = (dns::DohServer *) arg;
 
-	if (sendto(sock, out.c_str(), out_size, 0, (struct sockaddr *) &server_sin, server_sz) == -1 ) {
-		perror("sendto()");
-		event_loopbreak();
+	// After a handoff the peer socket is the next binary's: the replies to
+	// its asks must not be read here.
+	if (handed && peers)
+		peers->drain();
+
+	// After a handoff, new DoH connections go to the next binary while
+	// this one answers what it has read. A second signal stops it at once.
+	if (handed && doh && !draining) {
+		draining = true;
+		doh->drain();
+		event_set(&drain_event, -1, EV_PERSIST, drain_cb, doh);
+		event_add(&drain_event, &drain_interval);
+		return;
 	}
+	stop_loop();
+
+}
+
+// The next binary has the sockets: stop as on SIGTERM, from the loop.
+static void handed_over(){
+
+	handed = true;
+	kill(getpid(), SIGTERM);
+
+}
+
+static void trace_cb(const int sig, short int which, void *arg){
+
+	dns::Tracer::dump(stderr);
+
+}
+
+static void top_cb(const int sig, short int which, void *arg){
+
+	dns::HeavyHitters::dump(stderr);
+
+}
+
+static void window_cb(const int fd, short int which, void *arg){
+
+	dns::HeavyHitters::tick();
+	if (admission)
+		admission->decay();
+
+}
+
+static void fastpath_cb(const int fd, short int which, void *arg){
+
+	dns::FastPath *fastpath = (dns::FastPath *) arg;
+	fastpath->poll();
 
 }
 
 int main(int argc, char **argv) {
 
-	int ret, port, sock, fd[2];
+	int ret, port, fd[2];
 
-	struct event udp_event;
-	struct sockaddr_in sin;
+	struct event_base *base;
+	Worker *main_worker;
+	std::vector<pthread_t> threads;
+	struct event fastpath_event;
+	struct event expire_event;
+	struct timeval expire_interval = { 60, 0 };
+	struct event snapshot_event, sigterm_event, sigint_event, sighup_event, sigusr1_event, sigusr2_event;
+	struct event window_event;
+	struct timeval snapshot_interval, window_interval;
+	dns::FastPath *fastpath = NULL;
+	dns::DohServer *doh = NULL;
+	dns::SharedCache *shared = NULL;
+	dns::Handoff *handoff = NULL;
+	bool taken = false;
+	std::string shared_name;
 
 	parse_args (argc, argv);
 
+	if (arguments.threads < 1)
+		arguments.threads = 1;
+	if (arguments.shared_cache) {
+		shared_name = arguments.shared_cache;
+		shared_name = shared_name.substr(0, shared_name.find(':'));
+	}
+
+	// Before anything is bound: the running server may hand its sockets.
+	if (arguments.upgrade) {
+		handoff = new dns::Handoff(arguments.upgrade);
+		taken = handoff->take(shared_name, listening);
+		if (taken) {
+			// One thread per socket taken over, on the port they are bound to.
+			arguments.threads = listening.udp.size();
+			if (!arguments.quiet)
+				printf("Taking over %zu sockets from %s\n", listening.udp.size(), arguments.upgrade);
+		} else if (!arguments.quiet) {
+			printf("No server to take over on %s (%s)\n", arguments.upgrade, handoff->error().c_str());
+		}
+	}
+	if (!arguments.peer != !arguments.peers) {
+		fprintf(stderr, "--peer and --peers go together\n");
+		exit(EXIT_FAILURE);
+	}
+	// Every thread reading the cache holds an epoch slot: the workers, the
+	// DoH ones, the peer thread and the one handing the cache over.
+	if (arguments.threads > dns::Epoch::SLOTS - dns::DohServer::WORKERS - 2) {
+		fprintf(stderr, "--threads is at most %d\n", dns::Epoch::SLOTS - dns::DohServer::WORKERS - 2);
+		exit(EXIT_FAILURE);
+	}
+	if (arguments.fastpath && arguments.threads > 1) {
+		fprintf(stderr, "--fastpath answers from one thread, it cannot be used with --threads\n");
+		exit(EXIT_FAILURE);
+	}
+	if (arguments.cpus) {
+		cpus = dns::Affinity::parseCpus(arguments.cpus);
+		if ((int) cpus.size() < arguments.threads) {
+			fprintf(stderr, "--cpus needs a CPU for each of the %d threads\n", arguments.threads);
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	if (arguments.verbose){
 
   		printf (
@@ -75,35 +467,258 @@ int main(int argc, char **argv) {
         	"VERBOSE = %s\n"
         	"QUIET = %s\n"
         	"NOCACHE = %s\n"
-        	"DNS = %s\n",
+        	"DNS = %s\n"
+        	"FASTPATH = %s\n"
+        	"RATE_LIMIT = %d\n"
+        	"RRL = %d (slip %d)\n"
+        	"SNAPSHOT = %s (every %ds)\n"
+        	"THREADS = %d (cpus %s)\n"
+        	"TRACE = %d\n"
+        	"DOH = %d\n"
+        	"ZONES = %s\n"
+        	"SHARED_CACHE = %s\n"
+        	"PORT = %d\n"
+        	"PEERS = %s (as %s)\n"
+        	"UPGRADE = %s\n"
+        	"TOP = %d (window %ds)\n"
+        	"ADMIT = %d\n",
         	arguments.host_file,
         	arguments.verbose ? "yes" : "no",
         	arguments.quiet ? "yes" : "no",
         	arguments.nocache ? "yes" : "no",
-    		arguments.dns
+    		arguments.dns,
+    		arguments.fastpath ? arguments.fastpath : "no",
+    		arguments.rate_limit,
+    		arguments.rrl, arguments.slip,
+    		arguments.snapshot ? arguments.snapshot : "no",
+    		arguments.snapshot_interval,
+    		arguments.threads, arguments.cpus ? arguments.cpus : "any",
+    		arguments.trace,
+    		arguments.doh,
+    		arguments.zones ? arguments.zones : "no",
+    		arguments.shared_cache ? arguments.shared_cache : "no",
+    		arguments.port,
+    		arguments.peers ? arguments.peers : "no", arguments.peer ? arguments.peer : "-",
+    		arguments.upgrade ? arguments.upgrade : "no",
+    		arguments.top, arguments.window,
+    		arguments.admit
 		);
 
 	}
 
+	if (arguments.trace >= 0)
+		dns::Tracer::enable(arguments.trace);
+	if (arguments.top > 0)
+		dns::HeavyHitters::enable(arguments.top);
+
+	if (arguments.shared_cache) {
+		const char *colon = strchr(arguments.shared_cache, ':');
+		size_t mb = colon ? atoi(colon + 1) : 64;
+		shared = new dns::SharedCache(shared_name, mb << 20);
+		if (!shared->ok()) {
+			fprintf(stderr, "Shared cache %s: %s\n", shared_name.c_str(), shared->error().c_str());
+			exit(EXIT_FAILURE);
+		}
+		cache.setStore(shared);
+		if (!arguments.quiet)
+			printf("Shared cache %s: %zu slots (%zu bytes), %lu buckets recovered so far\n",
+				shared_name.c_str(), shared->capacity(), shared->bytes(), (unsigned long) shared->recovered());
+	}
+
 	cache.load(arguments.host_file);
 
-	sock = socket(AF_INET, SOCK_DGRAM, 0);
-	memset(&sin, 0, sizeof(sin));
-	sin.sin_family = AF_INET;
-	sin.sin_addr.s_addr = INADDR_ANY;
-	sin.sin_port = htons(1053);
-	if (bind(sock, (struct sockaddr *) &sin, sizeof(sin))) {
-		perror("bind()");
-		exit(EXIT_FAILURE);
+	if (arguments.admit > 1) {
+		admission = new dns::TinyLfu(arguments.admit);
+		cache.setAdmission(admission);
+	}
+
+	resolver = new dns::Resolver(cache, arguments.dns);
+	resolver->setStream(&stream);
+
+	if (arguments.forward) {
+		forwarder = new dns::Forwarder(arguments.dns);
+		reload_cb(SIGHUP, 0, NULL);
+		resolver->setForwarder(forwarder);
+	}
+
+	if (arguments.blocklist) {
+		size_t rules = blocklist.load(arguments.blocklist);
+		resolver->setBlocklist(&blocklist);
+		if (!arguments.quiet)
+			printf("Loaded %zu blocking rules from %s (%zu bytes)\n",
+				rules, arguments.blocklist, blocklist.memory());
 	}
 
-	event_init();
+	if (arguments.zones) {
+		std::stringstream list(arguments.zones);
+		std::string path;
+		while (getline(list, path, ',')) {
+			int records = zones.load(path);
+			if (records < 0) {
+				fprintf(stderr, "%s\n", zones.error().c_str());
+				exit(EXIT_FAILURE);
+			}
+			if (!arguments.quiet)
+				printf("Loaded %d records from %s\n", records, path.c_str());
+		}
+		if (!arguments.quiet)
+			printf("Compiled replies for %zu names (%zu bytes)\n", zones.size(), zones.memory());
+		resolver->setAuthority(&zones);
+	}
+
+	// The cache of the server taken over is newer than any snapshot.
+	if (taken && handoff->streams()) {
+		size_t received = handoff->receive(cache);
+		if (!arguments.quiet)
+			printf("Received %zu cache entries from %s\n", received, arguments.upgrade);
+	} else if (taken) {
+		if (!arguments.quiet)
+			printf("Cache shared with the server on %s\n", arguments.upgrade);
+	} else if (arguments.snapshot) {
+		size_t loaded = dns::Snapshot::load(cache, arguments.snapshot);
+		if (!arguments.quiet)
+			printf("Loaded %zu cache entries from %s\n", loaded, arguments.snapshot);
+	}
 
-	event_set(&udp_event, sock, EV_READ|EV_PERSIST, udp_cb, NULL);
-	event_add(&udp_event, 0);
+	for (int i = listening.udp.size(); i < arguments.threads; i++)
+		listening.udp.push_back(open_socket(i));
+
+	base = (struct event_base *) event_init();
+	main_worker = start_worker(0, base);
+
+	for (int i = 1; i < arguments.threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, worker_main, (void *) (intptr_t) i)) {
+			perror("pthread_create()");
+			exit(EXIT_FAILURE);
+		}
+		threads.push_back(thread);
+	}
+
+	if (arguments.fastpath) {
+
+		fastpath = new dns::FastPath(*resolver, arguments.fastpath, arguments.port, main_worker->sock);
+		if (!fastpath->ok())
+			exit(EXIT_FAILURE);
+		// Same loop as worker 0, which shares its limits.
+		fastpath->setLimiter(main_worker->limiter);
+
+		event_set(&fastpath_event, fastpath->fileno(), EV_READ|EV_PERSIST, fastpath_cb, fastpath);
+		event_add(&fastpath_event, 0);
+
+	}
+
+	if (arguments.doh > 0) {
+
+		doh = new dns::DohServer(*resolver, base, arguments.doh, listening.doh);
+		if (!doh->ok()) {
+			fprintf(stderr, "Cannot listen for DNS over HTTP on port %d\n", arguments.doh);
+			exit(EXIT_FAILURE);
+		}
+		listening.doh = doh->fileno();
+		// Same loop as worker 0, which shares its limits.
+		doh->setLimiter(main_worker->limiter);
+
+	} else if (listening.doh >= 0) {
+
+		close(listening.doh);
+		listening.doh = -1;
+
+	}
+
+	if (arguments.peer) {
+
+		peers = new dns::Peers(arguments.peer, arguments.peers);
+		if (!peers->ok() || !peers->listen(*resolver, listening.peer)) {
+			fprintf(stderr, "Peers: %s\n", peers->error().c_str());
+			exit(EXIT_FAILURE);
+		}
+		listening.peer = peers->fileno();
+		resolver->setPeer(peers);
+		if (!arguments.quiet)
+			printf("Sharing the cache with %zu peers from %s\n", peers->size() - 1, arguments.peer);
+
+	} else if (listening.peer >= 0) {
+
+		close(listening.peer);
+		listening.peer = -1;
+
+	}
+
+	event_set(&expire_event, -1, EV_PERSIST, expire_cb, NULL);
+	event_add(&expire_event, &expire_interval);
+
+	if (arguments.snapshot && arguments.snapshot_interval > 0) {
+		snapshot_interval.tv_sec = arguments.snapshot_interval;
+		snapshot_interval.tv_usec = 0;
+		event_set(&snapshot_event, -1, EV_PERSIST, snapshot_cb, NULL);
+		event_add(&snapshot_event, &snapshot_interval);
+	}
+
+	signal_set(&sigterm_event, SIGTERM, terminate_cb, doh);
+	signal_add(&sigterm_event, NULL);
+	signal_set(&sigint_event, SIGINT, terminate_cb, doh);
+	signal_add(&sigint_event, NULL);
+
+	if (arguments.trace >= 0) {
+		signal_set(&sigusr1_event, SIGUSR1, trace_cb, NULL);
+		signal_add(&sigusr1_event, NULL);
+	}
+
+	if (arguments.top > 0) {
+		signal_set(&sigusr2_event, SIGUSR2, top_cb, NULL);
+		signal_add(&sigusr2_event, NULL);
+	}
+
+	if ((arguments.top > 0 || admission) && arguments.window > 0) {
+		window_interval.tv_sec = arguments.window;
+		window_interval.tv_usec = 0;
+		event_set(&window_event, -1, EV_PERSIST, window_cb, NULL);
+		event_add(&window_event, &window_interval);
+	}
+
+	if (forwarder) {
+		signal_set(&sighup_event, SIGHUP, reload_cb, NULL);
+		signal_add(&sighup_event, NULL);
+	}
+
+	// Answering on every socket now, the previous server can go.
+	if (handoff) {
+		if (taken && !handoff->ready())
+			fprintf(stderr, "The server on %s went away during the handoff\n", arguments.upgrade);
+		if (!handoff->listen(base, cache, shared_name, listening, handed_over)) {
+			fprintf(stderr, "Cannot wait for upgrades on %s: %s\n", arguments.upgrade, handoff->error().c_str());
+			exit(EXIT_FAILURE);
+		}
+	}
 
 	event_dispatch();
-	close(sock);
+	stopping = true;
+	for (pthread_t thread : threads)
+		pthread_join(thread, NULL);
+	if (handoff) {
+		if (handoff->taken() && !arguments.quiet)
+			printf("Handed over to the server started on %s\n", arguments.upgrade);
+		delete handoff;
+	}
+	if (fastpath && handed)
+		fastpath->release();
+	delete fastpath;
+	delete doh;
+	if (peers) {
+		dns::Peers::Stats stats = peers->stats();
+		if (!arguments.quiet)
+			printf("Peers: asked %lu, answered %lu, told %lu; served %lu, learned %lu\n",
+				(unsigned long) stats.asked, (unsigned long) stats.hits, (unsigned long) stats.told,
+				(unsigned long) stats.served, (unsigned long) stats.learned);
+		resolver->setPeer(NULL);
+		delete peers;
+	}
+	cache.setStore(NULL);
+	delete shared;
+	cache.setAdmission(NULL);
+	delete admission;
+	stop_worker(main_worker);
 
 	return 0;
 
@@ -1,4 +1,38 @@
 #include "Dns.hpp"
+#include "RateLimit.hpp"
+#include "Snapshot.hpp"
+#include "SendQueue.hpp"
+#include "Affinity.hpp"
+#include "Doh.hpp"
+#include "Zone.hpp"
+#include "SharedCache.hpp"
+#include "Peers.hpp"
+#include "Handoff.hpp"
+#include "Sketch.hpp"
+#include "FastPath.hpp"
+#include <thread>
+#include <linux/filter.h>
+
+// Answers every query with an A record 10.0.0.5 and counts them.
+struct StubUpstream: public dns::Upstream {
+
+    int asked = 0;
+
+    ssize_t exchange(const std::vector<uint8_t>& query, const sockaddr_in& server, uint8_t* res){
+        asked++;
+        dns::A_Answer a("stub.site5.com", dns::Package::A_Type, dns::Package::IN_Class, 60);
+        a.setRData(10, 0, 0, 5);
+        std::vector<uint8_t> rr;
+        dns::Package::putAnswer(rr, &a);
+        memcpy(res, query.data(), query.size());
+        // Same header and question as the query, QR set and one answer.
+        res[2] |= 0x80;
+        res[7] = 1;
+        memcpy(res + query.size(), rr.data(), rr.size());
+        return query.size() + rr.size();
+    }
+
+};
 
 int main(){
 
@@ -13,7 +47,7 @@ int main(){
     0x77, 0x08, 0x66, 0x61, 0x63, 0x65, 0x62, 0x6f, 0x6f, 0x6b, 0x03, 0x63, 0x6f, 0x6d, 0x00, 
     0x00, 0x01, 0x00, 0x01 };
 
-    dns::Package PackageRequest1(package_request_1);
+    dns::Package PackageRequest1(package_request_1, sizeof(package_request_1));
 	PackageRequest1.prettyPrint();
 
     /*
@@ -27,8 +61,44 @@ int main(){
     0x77, 0x08, 0x66, 0x61, 0x63, 0x65, 0x62, 0x6f, 0x6f, 0x6b, 0x03, 0x63, 0x6f, 0x6d, 0x00, 
     0x00, 0x05, 0x00, 0x01 };
 
-    dns::Package PackageRequest2(package_request_2);
-	PackageRequest2.prettyPrint();
+    /*
+    **  It announces one answer it does not carry, so it is rejected and
+    **  answered with FORMERR.
+    */
+
+    try {
+        dns::Package PackageRequest2(package_request_2, sizeof(package_request_2));
+        PackageRequest2.prettyPrint();
+    } catch (dns::FormatError& e) {
+        std::cout << "PackageRequest2 malformed: " << e.what() << std::endl;
+        print_hex(dns::Package::formatError(package_request_2, sizeof(package_request_2)));
+    }
+
+    /*
+    **  Malformed Examples:
+    **      Name pointing to itself, and a name running past the end.
+    */
+
+    uint8_t package_loop[] = {
+    0x00, 0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xc0, 0x0c,
+    0x00, 0x01, 0x00, 0x01 };
+
+    uint8_t package_truncated[] = {
+    0x00, 0x02, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3f, 0x77 };
+
+    try {
+        dns::Package PackageLoop(package_loop, sizeof(package_loop));
+        std::cout << "PackageLoop accepted" << std::endl;
+    } catch (dns::FormatError& e) {
+        std::cout << "PackageLoop malformed: " << e.what() << std::endl;
+    }
+
+    try {
+        dns::Package PackageTruncated(package_truncated, sizeof(package_truncated));
+        std::cout << "PackageTruncated accepted" << std::endl;
+    } catch (dns::FormatError& e) {
+        std::cout << "PackageTruncated malformed: " << e.what() << std::endl;
+    }
 
     /*
     **  Response Example:
@@ -46,7 +116,7 @@ int main(){
     0x63, 0x31, 0x30, 0x72, 0xc0, 0x10, 0xc0, 0x2e, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 
     0x15, 0x00, 0x04, 0x9d, 0xf0, 0x0e, 0x23 };
 
-	dns::Package PackageResponse1(package_response_1);
+	dns::Package PackageResponse1(package_response_1, sizeof(package_response_1));
 	PackageResponse1.prettyPrint();
 
     /*
@@ -65,7 +135,7 @@ int main(){
     0x11, 0x09, 0x73, 0x74, 0x61, 0x72, 0x2d, 0x6d, 0x69, 0x6e, 0x69, 0x04, 0x63, 0x31, 0x30, 
     0x72, 0xc0, 0x10 };
 
-    dns::Package PackageResponse2(package_response_2);
+    dns::Package PackageResponse2(package_response_2, sizeof(package_response_2));
 	PackageResponse2.prettyPrint();
 
     /*
@@ -127,9 +197,10 @@ int main(){
 
     /*
     ** Caching QuenstionSite1 and answerSite1.
+    ** The cache owns what it is given, so it gets a copy.
     */
 
-    cache.set(QuestionSite1, PackageResponseSite1.getAnswers());
+    cache.set(QuestionSite1, std::vector<dns::Answer*> (1, answerSite1->copy()));
     
     std::optional<std::vector<dns::Answer*>> res1 = cache.get(QuestionSite1);
     std::optional<std::vector<dns::Answer*>> res2 = cache.get(QuestionSite2);
@@ -146,6 +217,715 @@ int main(){
     }else
 		std::cout << "QuestionSite2 not found" << std::endl;
     
+    /*
+    ** Reverse and IPv6 lookups from /etc/hosts
+    ** Example: "::1   localhost" gives an AAAA and a ...ip6.arpa PTR record
+    */
+
+    dns::Question QuestionPTR("1.0.0.127.in-addr.arpa", dns::Package::PTR_Type, dns::Package::IN_Class);
+    dns::Question QuestionAAAA("localhost", dns::Package::AAAA_Type, dns::Package::IN_Class);
+
+    for (dns::Question q : { QuestionPTR, QuestionAAAA }){
+        std::optional<std::vector<dns::Answer*>> res = cache.get(q);
+        if (res){
+            std::cout << q.qName << " => " << (*res)[0]->rDataToStr() << std::endl;
+            for (dns::Answer* a : *res)
+                delete a;
+        }else
+            std::cout << q.qName << " not found" << std::endl;
+    }
+
+    /*
+    ** Round trip of every supported record type through dump() and parse.
+    */
+
+    dns::Package PackageTypes(0x0333);
+    PackageTypes.addQuestion(dns::Question("site3.com", dns::Package::MX_Type, dns::Package::IN_Class));
+    PackageTypes.setFlagQR(dns::Package::QR_Response);
+
+    dns::AAAA_Answer* aaaa = new dns::AAAA_Answer("site3.com", dns::Package::AAAA_Type, dns::Package::IN_Class, 60);
+    uint8_t v6[16] = { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+    aaaa->setRData(v6);
+    PackageTypes.addAnswer(aaaa);
+
+    dns::MX_Answer* mx = new dns::MX_Answer("site3.com", dns::Package::MX_Type, dns::Package::IN_Class, 60);
+    mx->preference = 10;
+    mx->exchange = "mail.site3.com";
+    PackageTypes.addAnswer(mx);
+
+    dns::TXT_Answer* txt = new dns::TXT_Answer("site3.com", dns::Package::TXT_Type, dns::Package::IN_Class, 60);
+    txt->strings.push_back("v=spf1 -all");
+    PackageTypes.addAnswer(txt);
+
+    dns::SRV_Answer* srv = new dns::SRV_Answer("_sip._udp.site3.com", dns::Package::SRV_Type, dns::Package::IN_Class, 60);
+    srv->priority = 1;
+    srv->weight = 5;
+    srv->port = 5060;
+    srv->target = "sip.site3.com";
+    PackageTypes.addAnswer(srv);
+
+    dns::Answer* ptr = new dns::PTR_Answer("1.1.168.192.in-addr.arpa", dns::Package::PTR_Type, dns::Package::IN_Class, 60);
+    ptr->setRData("www.site1.com");
+    PackageTypes.addAnswer(ptr);
+
+    std::vector<uint8_t> typesOut = PackageTypes.dump();
+    dns::Package PackageTypesParsed(typesOut.data(), typesOut.size());
+    PackageTypesParsed.prettyPrint();
+
+    // Names and support come from the compile time record tables.
+    static_assert(dns::recordInfo(dns::Package::SRV_Type).read != NULL, "SRV is registered");
+    std::cout << "Types: " << dns::Package::rtypes2string(dns::Package::AAAA_Type) << " "
+        << dns::Package::rtypes2string(99) << " "
+        << dns::Package::rtypes2string(65535) << " "
+        << dns::Package::rcodes2string(dns::Package::NameError_ResponseType)
+        << " (expected AAAA Unknown Unknown NameError_ResponseType)" << std::endl;
+
+    /*
+    ** CNAME chains and several questions in one package, from the cache:
+    **      www.site4.com CNAME alias.site4.com, alias.site4.com A 10.0.0.4
+    **      loop1.site4.com CNAME loop2.site4.com CNAME loop1.site4.com
+    */
+
+    auto cacheCNAME = [&cache](std::string name, std::string target){
+        dns::Answer* a = new dns::CNAME_Answer(name, dns::Package::CNAME_Type, dns::Package::IN_Class, 60);
+        a->setRData(target);
+        cache.set(dns::Question(name, dns::Package::CNAME_Type, dns::Package::IN_Class),
+            std::vector<dns::Answer*> (1, a));
+    };
+
+    cacheCNAME("www.site4.com", "alias.site4.com");
+    cacheCNAME("loop1.site4.com", "loop2.site4.com");
+    cacheCNAME("loop2.site4.com", "loop1.site4.com");
+
+    dns::Answer* answerSite4 = new dns::A_Answer("alias.site4.com", dns::Package::A_Type, dns::Package::IN_Class, 60);
+    answerSite4->setRData(10,0,0,4);
+    cache.set(dns::Question("alias.site4.com", dns::Package::A_Type, dns::Package::IN_Class),
+        std::vector<dns::Answer*> (1, answerSite4));
+
+    dns::Package PackageChain(0x0444);
+    PackageChain.addQuestion(dns::Question("www.site4.com", dns::Package::A_Type, dns::Package::IN_Class));
+    PackageChain.addQuestion(QuestionSite1);
+    PackageChain.addQuestion(dns::Question("loop1.site4.com", dns::Package::A_Type, dns::Package::IN_Class));
+
+    dns::Resolver chainResolver(cache);
+    std::cout << "Chain answered locally: " << chainResolver.resolveLocal(PackageChain) << std::endl;
+    PackageChain.prettyPrint();
+
+    /*
+    ** Blocking rules: exact, subdomains only, and name plus subdomains.
+    ** They apply to CNAME targets too.
+    */
+
+    dns::DomainTrie rules;
+    rules.insert("tracker.site5.com");
+    rules.insert("*.ads.site5.com");
+    rules.insert(".alias.site4.com");
+
+    for (std::string name : { "tracker.site5.com", "www.tracker.site5.com", "ads.site5.com",
+        "x.y.ADS.site5.com", "alias.site4.com", "a.alias.site4.com", "site5.com" })
+        std::cout << "Blocked " << name << ": " << rules.contains(name) << std::endl;
+
+    dns::Resolver blockingResolver(cache);
+    blockingResolver.setBlocklist(&rules);
+    dns::Package PackageBlocked(0x0555);
+    PackageBlocked.addQuestion(dns::Question("www.site4.com", dns::Package::A_Type, dns::Package::IN_Class));
+    blockingResolver.resolveLocal(PackageBlocked);
+    PackageBlocked.prettyPrint();
+
+    /*
+    ** UDP replies: answers longer than the client takes are cut and TC set,
+    ** 512 bytes without EDNS, what its OPT record offers up to 1232 with it.
+    */
+
+    dns::Cache bigCache;
+    dns::Resolver bigResolver(bigCache);
+    for (int count : { 30, 100 }) {
+        std::string bigName = "big" + std::to_string(count) + ".site9.com";
+        std::vector<dns::Answer*> bigAnswers;
+        for (int i = 0; i < count; i++){
+            dns::Answer* a = new dns::A_Answer(bigName, dns::Package::A_Type, dns::Package::IN_Class, 60);
+            a->setRData(10,9,0,i);
+            bigAnswers.push_back(a);
+        }
+        bigCache.set(dns::Question(bigName, dns::Package::A_Type, dns::Package::IN_Class), bigAnswers);
+    }
+    std::cout << "UDP replies:";
+    for (std::string bigName : { "big30.site9.com", "big100.site9.com" }){
+        for (uint16_t offered : { 0, 4096 }){
+            dns::Package q(0x0666);
+            q.addQuestion(dns::Question(bigName, dns::Package::A_Type, dns::Package::IN_Class));
+            std::vector<uint8_t> wire = q.dump();
+            if (offered){
+                wire[11] = 1;
+                uint8_t opt[] = { 0, 0, 41, (uint8_t) (offered >> 8), (uint8_t) offered, 0, 0, 0, 0, 0, 0 };
+                wire.insert(wire.end(), opt, opt + sizeof(opt));
+            }
+            dns::Package parsed(wire.data(), wire.size());
+            bigResolver.resolveLocal(parsed);
+            std::vector<uint8_t> udp = parsed.dump(parsed.udpSize());
+            std::cout << " " << bigName << "/" << offered << " TC " << ((udp[2] >> 1) & 1)
+                << " an/ar " << (udp[6] << 8 | udp[7]) << "/" << (int) udp[11] << " fits " << (udp.size() <= parsed.udpSize()) << ";";
+        }
+    }
+    std::cout << " (expected big30/0 TC 1 0/0, big30/4096 TC 0 30/1, big100/0 TC 1 0/0, big100/4096 TC 1 0/1, all fit)" << std::endl;
+
+    /*
+    ** Fast path: frames from the ring are limited as datagrams on the UDP
+    ** socket are, over the limit dropped or slipped back truncated. No
+    ** ring here, frames are handed to it directly.
+    */
+
+    dns::Cache edgeCache;
+    dns::Resolver edgeResolver(edgeCache);
+    dns::Answer* edgeAnswer = new dns::A_Answer("edge.site9.com", dns::Package::A_Type, dns::Package::IN_Class, 60);
+    edgeAnswer->setRData(10,9,9,9);
+    edgeCache.set(dns::Question("edge.site9.com", dns::Package::A_Type, dns::Package::IN_Class),
+        std::vector<dns::Answer*> (1, edgeAnswer));
+    int edgeSock = socket(AF_INET, SOCK_DGRAM, 0);
+    dns::RateLimiter edgeLimiter(0, 1, 2);
+    dns::FastPath edge(edgeResolver, "", 1053, edgeSock);
+    edge.setLimiter(&edgeLimiter);
+
+    dns::Package edgeQuery(0x0888);
+    edgeQuery.addQuestion(dns::Question("edge.site9.com", dns::Package::A_Type, dns::Package::IN_Class));
+    std::vector<uint8_t> edgeWire = edgeQuery.dump();
+    // A frame from 10.0.0.99:40000 carrying wire, returns its length.
+    auto edgeFrame = [](uint8_t* frame, const std::vector<uint8_t>& wire) {
+        memset(frame, 0, 2048);
+        ((ether_header*) frame)->ether_type = htons(ETHERTYPE_IP);
+        iphdr* ip = (iphdr*) (frame + sizeof(ether_header));
+        ip->version = 4;
+        ip->ihl = 5;
+        ip->protocol = IPPROTO_UDP;
+        ip->saddr = htonl(0x0A000063);
+        ip->daddr = htonl(0x0A000001);
+        udphdr* udp = (udphdr*) (ip + 1);
+        udp->source = htons(40000);
+        udp->dest = htons(1053);
+        udp->len = htons(sizeof(udphdr) + wire.size());
+        memcpy(udp + 1, wire.data(), wire.size());
+        return sizeof(ether_header) + sizeof(iphdr) + sizeof(udphdr) + wire.size();
+    };
+    std::cout << "Fast path limited:";
+    for (int i = 0; i < 3; i++){
+        uint8_t frame[2048];
+        size_t replyLen = edge.handle(frame, edgeFrame(frame, edgeWire), sizeof(frame));
+        udphdr* edgeUdp = (udphdr*) (frame + sizeof(ether_header) + sizeof(iphdr));
+        const uint8_t* reply = (const uint8_t*) (edgeUdp + 1);
+        std::cout << " " << replyLen;
+        if (replyLen)
+            std::cout << " to " << ntohs(edgeUdp->dest) << " TC " << ((reply[2] >> 1) & 1) << " an " << (int) reply[7];
+        std::cout << ";";
+    }
+    std::cout << " (expected 104 to 40000 TC 0 an 1; 0; 74 to 40000 TC 1 an 0;)" << std::endl;
+
+    /*
+    ** Snapshot: everything cached above but the hosts entries goes to a
+    ** stream and back into a fresh cache.
+    */
+
+    std::stringstream snapshot;
+    size_t saved = dns::Snapshot::save(cache, snapshot);
+
+    dns::Cache restored;
+    size_t loaded = dns::Snapshot::load(restored, snapshot);
+    std::cout << "Snapshot: saved " << saved << ", loaded " << loaded << std::endl;
+
+    // To a file: synced under a temporary name, then renamed over it.
+    bool savedFile = dns::Snapshot::save(cache, "/tmp/jffdns-tests.snapshot");
+    bool tmpLeft = access("/tmp/jffdns-tests.snapshot.tmp", F_OK) == 0;
+    dns::Cache restoredFile;
+    size_t loadedFile = dns::Snapshot::load(restoredFile, "/tmp/jffdns-tests.snapshot");
+    unlink("/tmp/jffdns-tests.snapshot");
+    std::cout << "Snapshot file: saved " << savedFile << ", temporary left " << tmpLeft << ", loaded " << loadedFile
+        << " (expected saved 1, temporary left 0, loaded " << saved << ")" << std::endl;
+
+    std::optional<std::vector<dns::Answer*>> res4 = restored.get(
+        dns::Question("alias.site4.com", dns::Package::A_Type, dns::Package::IN_Class));
+    if (res4){
+        std::cout << "alias.site4.com restored: " << (*res4)[0]->rDataToStr()
+            << " TTL " << (*res4)[0]->aTTL << std::endl;
+        for (dns::Answer* a : *res4)
+            delete a;
+    }else
+        std::cout << "alias.site4.com not restored" << std::endl;
+
+    /*
+    ** Rate limiting: 2 queries per second per client /24, then 2 responses
+    ** per second per name with every second one over the limit slipped.
+    */
+
+    dns::RateLimiter clientLimiter(2, 0, 0);
+    uint32_t client = inet_addr("10.0.0.1");
+    uint32_t neighbour = inet_addr("10.0.0.2");
+    uint32_t now = 1000;
+
+    std::cout << "Client limit: "
+        << clientLimiter.check(client, package_request_1, sizeof(package_request_1), now)
+        << clientLimiter.check(neighbour, package_request_1, sizeof(package_request_1), now)
+        << clientLimiter.check(client, package_request_1, sizeof(package_request_1), now)
+        << clientLimiter.check(client, package_request_1, sizeof(package_request_1), now + 500)
+        << " (expected 0010)" << std::endl;
+
+    dns::RateLimiter responseLimiter(0, 2, 2);
+    std::cout << "Response limit: "
+        << responseLimiter.check(client, package_request_1, sizeof(package_request_1), now)
+        << responseLimiter.check(client, package_request_1, sizeof(package_request_1), now)
+        << responseLimiter.check(client, package_request_1, sizeof(package_request_1), now)
+        << responseLimiter.check(client, package_request_1, sizeof(package_request_1), now)
+        << responseLimiter.check(client, package_request_2, sizeof(package_request_2), now)
+        << " (expected 00120)" << std::endl;
+
+    // Types differing in bit 5 only (A and SRV) get their own buckets, a
+    // name in capitals shares the bucket of the lower case one.
+    uint8_t srv_request[sizeof(package_request_1)], upper_request[sizeof(package_request_1)];
+    memcpy(srv_request, package_request_1, sizeof(srv_request));
+    srv_request[sizeof(srv_request) - 3] = dns::Package::SRV_Type;
+    memcpy(upper_request, package_request_1, sizeof(upper_request));
+    memcpy(upper_request + 13, "WWW", 3);
+    dns::RateLimiter typeLimiter(0, 1, 0);
+    std::cout << "Response limit by type: "
+        << typeLimiter.check(client, package_request_1, sizeof(package_request_1), now)
+        << typeLimiter.check(client, srv_request, sizeof(srv_request), now)
+        << typeLimiter.check(client, upper_request, sizeof(upper_request), now)
+        << " (expected 001)" << std::endl;
+
+    uint8_t slipped[sizeof(package_request_1)];
+    memcpy(slipped, package_request_1, sizeof(slipped));
+    size_t slippedLen = dns::RateLimiter::truncate(slipped, sizeof(slipped));
+    std::vector<uint8_t> slippedOut(slipped, slipped + slippedLen);
+    print_hex(slippedOut);
+
+    /*
+    ** Batched replies over loopback: three equal replies to one peer go as
+    ** one GSO message, the reply to the other peer as a second one, all
+    ** in a single sendmmsg().
+    */
+
+    auto loopback = [](int sock){
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(sock, (sockaddr*) &addr, sizeof(addr));
+        socklen_t len = sizeof(addr);
+        getsockname(sock, (sockaddr*) &addr, &len);
+        return addr;
+    };
+
+    int sender = socket(AF_INET, SOCK_DGRAM, 0);
+    int peer1 = socket(AF_INET, SOCK_DGRAM, 0);
+    int peer2 = socket(AF_INET, SOCK_DGRAM, 0);
+    loopback(sender);
+    sockaddr_in peer1Addr = loopback(peer1);
+    sockaddr_in peer2Addr = loopback(peer2);
+
+    dns::SendQueue queue(sender);
+    queue.push(peer1Addr, package_request_1, sizeof(package_request_1));
+    queue.push(peer2Addr, package_request_2, sizeof(package_request_2));
+    queue.push(peer1Addr, package_request_1, sizeof(package_request_1));
+    queue.push(peer1Addr, package_request_1, 20);
+    queue.flush();
+
+    int received1 = 0, received2 = 0;
+    uint8_t datagram[BUF_SIZE];
+    while (recv(peer1, datagram, sizeof(datagram), MSG_DONTWAIT) > 0)
+        received1++;
+    while (recv(peer2, datagram, sizeof(datagram), MSG_DONTWAIT) > 0)
+        received2++;
+    std::cout << "Send queue: " << received1 << " + " << received2 << " datagrams, "
+        << queue.syscalls() << " syscall (expected 3 + 1 datagrams, 1 syscall)" << std::endl;
+    close(sender);
+    close(peer1);
+    close(peer2);
+
+    /*
+    ** Latency histograms: 1..1000 us, percentiles within 6.25%
+    */
+
+    dns::Histogram histogram;
+    for (uint64_t us = 1; us <= 1000; us++)
+        histogram.record(us * 1000);
+    std::cout << "Histogram: p50 " << histogram.percentile(0.5) / 1000
+        << " p99 " << histogram.percentile(0.99) / 1000
+        << " max " << histogram.max() / 1000
+        << " (expected about 500, 990 and 1000)" << std::endl;
+
+    /*
+    ** CPU lists for --cpus
+    */
+
+    std::vector<int> cpuList = dns::Affinity::parseCpus("0-2,8");
+    std::cout << "CPUs:";
+    for (int cpu : cpuList)
+        std::cout << " " << cpu;
+    std::cout << ", bad list " << dns::Affinity::parseCpus("3-1").size()
+        << " (expected 0 1 2 8, bad list 0)" << std::endl;
+
+    /*
+    ** base64url of DoH GET requests, padding optional
+    */
+
+    std::vector<uint8_t> decoded;
+    bool decodedOk = dns::DohServer::base64url("AAEC_-8", decoded);
+    std::vector<uint8_t> rejected;
+    std::cout << "base64url: " << decodedOk << " " << decoded.size() << " bytes, last "
+        << (int) decoded.back() << ", bad " << dns::DohServer::base64url("AA+A", rejected)
+        << " (expected 1 5 bytes, last 239, bad 0)" << std::endl;
+
+    /*
+    ** Authoritative zone: replies come compiled, AA set, NXDOMAIN and
+    ** NODATA carry the SOA, a delegation gets a referral with glue.
+    */
+
+    std::stringstream zoneFile(
+        "$ORIGIN corp.test.\n$TTL 1h\n"
+        "@     SOA ns1 hostmaster ( 1 2h 30m 2w 5m )\n"
+        "      NS  ns1\n"
+        "ns1   A   10.0.0.1\n"
+        "www   CNAME web\n"
+        "web   A   10.0.0.2\n"
+        "dev   NS  ns.dev\n"
+        "ns.dev A  10.0.1.1\n");
+    dns::Zones zones;
+    int zoneRecords = zones.load(zoneFile, "corp.test");
+    std::cout << "Zone: " << zoneRecords << " records, " << zones.size()
+        << " names (expected 7 records, 6 names)" << std::endl;
+
+    const char* zoneNames[] = { "WWW.corp.test", "web.corp.test", "nope.corp.test", "a.b.dev.corp.test" };
+    uint16_t zoneTypes[] = { dns::Package::A_Type, dns::Package::MX_Type, dns::Package::A_Type, dns::Package::A_Type };
+    std::cout << "Zone replies:";
+    for (int i = 0; i < 4; i++){
+        dns::Package q(0x0444);
+        q.addQuestion(dns::Question(zoneNames[i], zoneTypes[i], dns::Package::IN_Class));
+        std::vector<uint8_t> wire = q.dump();
+        uint8_t reply[BUF_SIZE];
+        size_t n = zones.answer(wire.data(), wire.size(), reply, sizeof(reply));
+        std::cout << " " << zoneNames[i] << " AA " << ((reply[2] >> 2) & 1) << " rcode " << (reply[3] & 0x0F)
+            << " an/ns/ar " << (int) reply[7] << "/" << (int) reply[9] << "/" << (int) reply[11] << ";";
+        if (i == 0){
+            dns::Package parsed(reply, n);
+            std::cout << " " << parsed.getAnswers().back()->rDataToStr() << ";";
+        }
+    }
+    std::cout << " (expected AA 1 rcode 0 2/1/1 10.0.0.2, AA 1 rcode 0 0/1/0,"
+        << " AA 1 rcode 3 0/1/0, AA 0 rcode 0 0/1/1)" << std::endl;
+
+    // Every path asks the resolver, which answers from the zones it is given.
+    dns::Resolver zoneResolver(cache);
+    dns::Package zoneQuery(0x0445);
+    zoneQuery.addQuestion(dns::Question("web.corp.test", dns::Package::A_Type, dns::Package::IN_Class));
+    std::vector<uint8_t> zoneWire = zoneQuery.dump();
+    uint8_t zoneReply[BUF_SIZE];
+    size_t withoutZones = zoneResolver.authoritative(zoneWire.data(), zoneWire.size(), zoneReply, sizeof(zoneReply));
+    zoneResolver.setAuthority(&zones);
+    size_t withZones = zoneResolver.authoritative(zoneWire.data(), zoneWire.size(), zoneReply, sizeof(zoneReply));
+    std::cout << "Zone through the resolver: " << (withoutZones > 0) << (withZones > 0)
+        << " AA " << ((zoneReply[2] >> 2) & 1) << " (expected 01 AA 1)" << std::endl;
+
+    /*
+    ** Interned names: two names under one suffix share its nodes, which go
+    ** with the last of them.
+    */
+
+    dns::Names& names = dns::Names::instance();
+    size_t nodesBefore = names.size();
+    const dns::Label* internedA = names.intern("d1.cloudfront.example");
+    const dns::Label* internedB = names.intern("d2.cloudfront.example");
+    size_t nodesUsed = names.size() - nodesBefore;
+    bool spelled = dns::Names::equals(internedA, "d1.cloudfront.example") &&
+        !dns::Names::equals(internedB, "d1.cloudfront.example") && dns::Names::str(internedB) == "d2.cloudfront.example";
+    names.release(internedA);
+    names.release(internedB);
+    std::cout << "Names: " << nodesUsed << " nodes for 2 names, spelled " << spelled << ", "
+        << names.size() - nodesBefore << " left (expected 4 nodes for 2 names, spelled 1, 0 left)" << std::endl;
+
+    /*
+    ** Shared cache: two mappings of one segment, as two processes would
+    ** have. What one cache stores the other finds.
+    */
+
+    shm_unlink("/jffdns-tests");
+    dns::SharedCache sharedA("jffdns-tests", 1 << 20), sharedB("jffdns-tests", 1 << 20);
+    dns::Cache cacheA, cacheB;
+    cacheA.setStore(&sharedA);
+    cacheB.setStore(&sharedB);
+    dns::Answer* sharedAnswer = new dns::A_Answer("shared.site6.com", dns::Package::A_Type, dns::Package::IN_Class, 300);
+    sharedAnswer->setRData(5, 6, 7, 8);
+    dns::Question sharedQuestion("shared.site6.com", dns::Package::A_Type, dns::Package::IN_Class);
+    cacheA.set(sharedQuestion, std::vector<dns::Answer*> (1, sharedAnswer));
+    std::optional<std::vector<dns::Answer*>> sharedRes = cacheB.get(sharedQuestion);
+    std::cout << "Shared cache: " << (sharedA.ok() && sharedB.ok() ? "mapped" : sharedA.error())
+        << ", other process sees " << (sharedRes ? (*sharedRes)[0]->rDataToStr() : "nothing")
+        << " (expected mapped, other process sees 5.6.7.8)" << std::endl;
+    cacheA.setStore(NULL);
+    cacheB.setStore(NULL);
+    shm_unlink("/jffdns-tests");
+
+    /*
+    ** Pluggable upstream: misses are answered by StubUpstream, the answer
+    ** is cached and the second query is a hit.
+    */
+
+    StubUpstream stub;
+    dns::Resolver stubResolver(cache);
+    stubResolver.setUpstream(&stub);
+    cache.resetStats();
+
+    for (int i = 0; i < 2; i++){
+        dns::Package PackageStub(0x0333 + i);
+        PackageStub.addQuestion(dns::Question("stub.site5.com", dns::Package::A_Type, dns::Package::IN_Class));
+        stubResolver.resolve(PackageStub);
+        PackageStub.prettyPrint();
+    }
+    dns::Cache::Stats stubStats = cache.stats();
+    std::cout << "Stub upstream: asked " << stub.asked << ", cache hits " << stubStats.hits
+        << " misses " << stubStats.misses << " (expected asked 1, cache hits 2 misses 2)" << std::endl;
+
+    /*
+    ** Upstream lists: tcp:// marks the ones asked over TCP.
+    */
+
+    dns::Upstreams upstreamList;
+    bool parsed = upstreamList.parse("10.0.0.53,tcp://10.0.1.53:5353");
+    std::cout << "Upstreams: parsed " << parsed << ", tcp " << upstreamList.servers[0].tcp << upstreamList.servers[1].tcp
+        << ", port " << ntohs(upstreamList.servers[1].sin_port) << " (expected parsed 1, tcp 01, port 5353)" << std::endl;
+
+    /*
+    ** Peers: instances agree on the owner of a name, names spread over the
+    ** ring, and the owner caches a reply pushed to it by another peer.
+    */
+
+    const char* peerList = "127.0.0.1:5401,127.0.0.1:5402,127.0.0.1:5403";
+    dns::Peers peerA("127.0.0.1:5401", peerList), peerC("127.0.0.1:5403", peerList);
+    int owned[3] = { 0, 0, 0 }, agreed = 0;
+    for (int i = 0; i < 3000; i++){
+        std::string name = "host" + std::to_string(i) + ".site7.com";
+        owned[peerA.owner(name)]++;
+        agreed += peerA.owner(name) == peerC.owner(name);
+    }
+    std::cout << "Peers: " << agreed << " owners agreed, " << owned[0] << "/" << owned[1] << "/" << owned[2]
+        << " names each (expected 3000 agreed, about 1000 each)" << std::endl;
+
+    dns::Package peerQuery(0x0555);
+    peerQuery.addQuestion(dns::Question("stub.site5.com", dns::Package::A_Type, dns::Package::IN_Class));
+    uint8_t pushed[BUF_SIZE];
+    ssize_t pushedLength = stub.exchange(peerQuery.dump(), sockaddr_in(), pushed);
+    dns::Cache ownerCache;
+    dns::Resolver ownerResolver(ownerCache);
+    std::vector<uint8_t> unanswered = peerQuery.dump();
+    bool learned = ownerResolver.learn(pushed, pushedLength);
+    std::optional<std::vector<dns::Answer*>> ownerRes = ownerCache.get(dns::Question("stub.site5.com", dns::Package::A_Type, dns::Package::IN_Class));
+    std::cout << "Peer push: learned " << learned << ", owner has " << (ownerRes ? (*ownerRes)[0]->rDataToStr() : "nothing")
+        << ", query learned " << ownerResolver.learn(unanswered.data(), unanswered.size())
+        << " (expected learned 1, owner has 10.0.0.5, query learned 0)" << std::endl;
+
+    // A peer answers the others from its own thread, and only them.
+    std::string ownedName;
+    for (int i = 0; ownedName.empty(); i++)
+        if (peerA.owner("peer" + std::to_string(i) + ".site7.com") == 0)
+            ownedName = "peer" + std::to_string(i) + ".site7.com";
+    dns::Answer* ownedAnswer = new dns::A_Answer(ownedName, dns::Package::A_Type, dns::Package::IN_Class, 300);
+    ownedAnswer->setRData(10,0,0,7);
+    ownerCache.set(dns::Question(ownedName, dns::Package::A_Type, dns::Package::IN_Class),
+        std::vector<dns::Answer*> (1, ownedAnswer));
+    dns::Cache askerCache;
+    dns::Resolver askerResolver(askerCache);
+    dns::Peers peerB("127.0.0.1:5402", peerList);
+    bool listening = peerA.listen(ownerResolver) && peerB.listen(askerResolver);
+    dns::Package askQuery(0x0556);
+    askQuery.addQuestion(dns::Question(ownedName, dns::Package::A_Type, dns::Package::IN_Class));
+    std::vector<uint8_t> askWire = askQuery.dump();
+    uint8_t askReply[BUF_SIZE];
+    ssize_t asked = peerB.ask(askWire, ownedName, askReply);
+    bool sameId = asked > 2 && memcmp(askReply, askWire.data(), 2) == 0;
+
+    int stranger = socket(AF_INET, SOCK_DGRAM, 0);
+    timeval strangerTimeout = { 0, 200000 };
+    setsockopt(stranger, SOL_SOCKET, SO_RCVTIMEO, &strangerTimeout, sizeof(strangerTimeout));
+    sockaddr_in peerAddr;
+    memset(&peerAddr, 0, sizeof(peerAddr));
+    peerAddr.sin_family = AF_INET;
+    peerAddr.sin_port = htons(5401);
+    peerAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sendto(stranger, askWire.data(), askWire.size(), 0, (struct sockaddr*) &peerAddr, sizeof(peerAddr));
+    ssize_t strangerGot = recv(stranger, askReply, sizeof(askReply), 0);
+    close(stranger);
+    std::cout << "Peer ask: listening " << listening << ", answered " << (asked > 0) << ", same id " << sameId
+        << ", other port answered " << (strangerGot > 0) << " (expected listening 1, answered 1, same id 1, other port answered 0)" << std::endl;
+
+    /*
+    ** Handoff: a new server gets the listening socket and the cache of the
+    ** running one, which is told to stop once the new one is ready.
+    */
+
+    int upgradeSock = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in upgradeAddr, takenAddr;
+    memset(&upgradeAddr, 0, sizeof(upgradeAddr));
+    upgradeAddr.sin_family = AF_INET;
+    upgradeAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(upgradeSock, (struct sockaddr*) &upgradeAddr, sizeof(upgradeAddr));
+    socklen_t upgradeLength = sizeof(upgradeAddr);
+    getsockname(upgradeSock, (struct sockaddr*) &upgradeAddr, &upgradeLength);
+
+    // The old server drops everything on it, as its fast path would some.
+    struct sock_filter dropAll[] = { BPF_STMT(BPF_RET | BPF_K, 0) };
+    struct sock_fprog dropProg = { 1, dropAll };
+    setsockopt(upgradeSock, SOL_SOCKET, SO_ATTACH_FILTER, &dropProg, sizeof(dropProg));
+
+    dns::Cache oldCache, newCache;
+    dns::Answer* upgradeAnswer = new dns::A_Answer("up.site8.com", dns::Package::A_Type, dns::Package::IN_Class, 300);
+    upgradeAnswer->setRData(9, 9, 9, 9);
+    dns::Question upgradeQuestion("up.site8.com", dns::Package::A_Type, dns::Package::IN_Class);
+    oldCache.set(upgradeQuestion, std::vector<dns::Answer*> (1, upgradeAnswer));
+
+    std::atomic<bool> oldStopped(false);
+    bool tookOver;
+    size_t received;
+    dns::Handoff::Sockets given, taken;
+    given.udp.push_back(upgradeSock);
+    struct event_base* upgradeBase = event_base_new();
+    {
+        dns::Handoff oldServer("/tmp/jffdns-tests.sock"), newServer("/tmp/jffdns-tests.sock");
+        oldServer.listen(upgradeBase, oldCache, "", given, [&oldStopped]() { oldStopped = true; });
+        std::thread accepting([upgradeBase]() { event_base_loop(upgradeBase, EVLOOP_ONCE); });
+        tookOver = newServer.take("", taken);
+        accepting.join();
+        received = newServer.receive(newCache);
+        newServer.ready();
+    }
+    event_base_free(upgradeBase);
+
+    upgradeLength = sizeof(takenAddr);
+    bool samePort = taken.udp.size() == 1 &&
+        getsockname(taken.udp[0], (struct sockaddr*) &takenAddr, &upgradeLength) == 0 &&
+        takenAddr.sin_port == upgradeAddr.sin_port;
+    std::optional<std::vector<dns::Answer*>> upgradeRes = newCache.get(upgradeQuestion);
+
+    int upgradeClient = socket(AF_INET, SOCK_DGRAM, 0);
+    sendto(upgradeClient, "q", 1, 0, (struct sockaddr*) &upgradeAddr, sizeof(upgradeAddr));
+    close(upgradeClient);
+    timeval upgradeTimeout = { 0, 200000 };
+    char upgradeByte;
+    bool unfiltered = samePort &&
+        setsockopt(taken.udp[0], SOL_SOCKET, SO_RCVTIMEO, &upgradeTimeout, sizeof(upgradeTimeout)) == 0 &&
+        recv(taken.udp[0], &upgradeByte, 1, 0) == 1;
+    std::cout << "Handoff: took over " << tookOver << ", same socket " << samePort << ", received " << received
+        << " (" << (upgradeRes ? (*upgradeRes)[0]->rDataToStr() : "nothing") << "), old stopped " << oldStopped
+        << ", filter cleared " << unfiltered
+        << " (expected took over 1, same socket 1, received 1 (9.9.9.9), old stopped 1, filter cleared 1)" << std::endl;
+    close(upgradeSock);
+    for (int s : taken.udp)
+        close(s);
+    unlink("/tmp/jffdns-tests.sock");
+
+    // With peers: the old server stops reading the peer socket it handed
+    // over, so every reply to the new one's asks reaches it.
+    dns::Cache nextCache;
+    dns::Resolver nextResolver(nextCache);
+    dns::Peers nextB("127.0.0.1:5402", peerList);
+    bool nextListening = nextB.listen(nextResolver, dup(peerB.fileno()));
+    peerB.drain();
+    int nextAnswered = 0;
+    for (int i = 0; i < 20; i++)
+        nextAnswered += nextB.ask(askWire, ownedName, askReply) > 0;
+    std::cout << "Handoff with peers: listening " << nextListening << ", new answered " << nextAnswered
+        << "/20, old asks " << (peerB.ask(askWire, ownedName, askReply) > 0)
+        << " (expected listening 1, new answered 20/20, old asks 0)" << std::endl;
+
+    /*
+    ** Heavy hitters: the heavy names come out on top of a stream of one-off
+    ** names and halve on a new window. The admission filter keeps a name
+    ** looked up once out of the cache, its query still answered.
+    */
+
+    auto wireQuery = [](const std::string& name) {
+        dns::Package p(0x0666);
+        p.addQuestion(dns::Question(name, dns::Package::A_Type, dns::Package::IN_Class));
+        return p.dump();
+    };
+    std::vector<uint8_t> hotWire = wireQuery("hot.site10.com"), warmWire = wireQuery("Warm.site10.com");
+    dns::HeavyHitters::enable(3);
+    dns::HeavyHitters* hitters = dns::HeavyHitters::local();
+    for (int i = 0; i < 5000; i++){
+        std::vector<uint8_t> wire = i % 5 == 0 ? hotWire : i % 10 == 1 ? warmWire : wireQuery("once" + std::to_string(i) + ".site10.com");
+        hitters->query(wire.data(), wire.size(), htonl(0x0A000001 + i % 3));
+    }
+    hitters->nxdomain(warmWire.data(), warmWire.size());
+    uint32_t hotBefore = hitters->estimate(hotWire.data(), hotWire.size());
+    dns::HeavyHitters::tick();
+    hitters->query(warmWire.data(), warmWire.size(), htonl(0x0A000001));
+    std::cout << "Heavy hitters: hot " << hotBefore << " then " << hitters->estimate(hotWire.data(), hotWire.size())
+        << " (expected hot 1000 then 500), top 3 of each:" << std::endl;
+    dns::HeavyHitters::dump(stdout);
+
+    // The fast path counts its queries too, those it drops included.
+    uint8_t hitFrame[2048];
+    uint32_t edgeBefore = hitters->estimate(edgeWire.data(), edgeWire.size());
+    for (int i = 0; i < 3; i++)
+        edge.handle(hitFrame, edgeFrame(hitFrame, edgeWire), sizeof(hitFrame));
+    std::cout << "Heavy hitters on the fast path: " << edgeBefore << " then " << hitters->estimate(edgeWire.data(), edgeWire.size())
+        << " (expected 0 then 3)" << std::endl;
+
+    // And traces the queries it answers, stage by stage.
+    dns::Tracer::enable(0);
+    edge.setLimiter(NULL);
+    edge.handle(hitFrame, edgeFrame(hitFrame, edgeWire), sizeof(hitFrame));
+    char* traced = NULL;
+    size_t tracedSize = 0;
+    FILE* traceOut = open_memstream(&traced, &tracedSize);
+    dns::Tracer::dump(traceOut);
+    fclose(traceOut);
+    std::istringstream traceLines(traced);
+    std::string traceLine, traceStage;
+    std::cout << "Fast path traced:";
+    while (std::getline(traceLines, traceLine)){
+        std::istringstream fields(traceLine);
+        unsigned long count;
+        if (fields >> traceStage >> count && (traceStage == "parse" || traceStage == "resolve" || traceStage == "dump" || traceStage == "total"))
+            std::cout << " " << traceStage << " " << count;
+    }
+    free(traced);
+    std::cout << " (expected parse 1 resolve 1 dump 1 total 1)" << std::endl;
+    close(edgeSock);
+
+    dns::Cache admitCache;
+    dns::TinyLfu lfu(2);
+    admitCache.setAdmission(&lfu);
+    dns::Resolver admitResolver(admitCache);
+    admitResolver.setUpstream(&stub);
+    dns::Question admitQuestion("stub.site5.com", dns::Package::A_Type, dns::Package::IN_Class);
+    size_t admitAnswers[2];
+    bool admitted[2];
+    for (int i = 0; i < 2; i++){
+        dns::Package PackageAdmit(0x0777 + i);
+        PackageAdmit.addQuestion(admitQuestion);
+        admitResolver.resolve(PackageAdmit);
+        admitAnswers[i] = PackageAdmit.getAnswers().size();
+        admitted[i] = (bool) admitCache.get(admitQuestion);
+    }
+    std::cout << "Admission: first query answered " << admitAnswers[0] << " cached " << admitted[0]
+        << ", second answered " << admitAnswers[1] << " cached " << admitted[1]
+        << " (expected first query answered 1 cached 0, second answered 1 cached 1)" << std::endl;
+
+    // The fast path and DoH look in the cache before resolving a miss, the
+    // question still counts once.
+    dns::Cache onceCache;
+    dns::TinyLfu onceLfu(2);
+    onceCache.setAdmission(&onceLfu);
+    dns::Resolver onceResolver(onceCache);
+    onceResolver.setUpstream(&stub);
+    bool onceCached[2];
+    for (int i = 0; i < 2; i++){
+        dns::Package PackageOnce(0x0779 + i);
+        PackageOnce.addQuestion(admitQuestion);
+        if (!onceResolver.resolveLocal(PackageOnce))
+            onceResolver.resolve(PackageOnce, true);
+        onceCached[i] = (bool) onceCache.get(admitQuestion);
+    }
+    std::cout << "Admission after a local miss: first query cached " << onceCached[0] << ", second cached " << onceCached[1]
+        << " (expected first query cached 0, second cached 1)" << std::endl;
+
     /*
     ** Resolver
     */